@@ -1,13 +1,23 @@
+#include <fcntl.h>
 #include <float.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+//Build with: gcc -O2 -pthread climate.c -o climate
+
 #define NUM_STATES 50
 
+#define LINE_SZ 100 //Lines longer than this are read in pieces, the way fgets() splits them
+#define CHUNK_SZ (4 * 1024 * 1024) //Bytes of input parsed at a time by one thread
+#define CHUNKS_PER_THREAD 2 //How far ahead of the merge the threads may parse
+
 //Stores climate info which is read in the struct
 struct climate_info
 {
@@ -24,8 +34,61 @@ struct climate_info
     long double cloud_cover;
 };
 
+//The floating point values of one line. Sums of these depend on the order they are added in, so they are kept
+//and added to the report in file order rather than summed per chunk
+struct record
+{
+    double temperature;
+    double humidity;
+    double cloud_cover;
+    time_t time;
+    int state; //Index in the chunk's table
+};
+
+//A newline-aligned piece of an input file and what a thread parsed out of it
+struct chunk
+{
+    const char* start;
+    const char* end;
+    int parsed;
+
+    //Thread-local table with the codes and integer totals of the states in the chunk
+    struct climate_info* states;
+    int num_states;
+    int cap_states;
+
+    struct record* records;
+    long num_records;
+    long cap_records;
+};
+
+//An input file, mapped into memory (or read into it if it cannot be mapped)
+struct input
+{
+    char* data;
+    size_t len;
+    int mapped;
+};
+
+//Chunks of every input, in the order the serial reader would have read them
+struct job
+{
+    struct chunk* chunks;
+    int num_chunks;
+    int next; //First chunk no thread has claimed
+    int merged; //Chunks added to the report so far
+    int window;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
 //Prevents an error where methods are introduced before being defined
-void analyze_file(FILE *file, struct climate_info *states[], int num_states);
+int load_file(const char* path, struct input* input);
+void split_file(struct input* input, struct job* job);
+void* worker_main(void* arg);
+void analyze_chunk(struct chunk* chunk);
+void merge_chunk(struct chunk* chunk, struct climate_info *states[], int num_states);
 void print_report(struct climate_info *states[], int num_states);
 
 //Main method
@@ -46,130 +109,439 @@ int main(int argc, char *argv[])
 
     struct climate_info *states[NUM_STATES] = {NULL};
 
+    struct input* inputs = calloc(argc, sizeof(struct input));
+    struct job job = {0};
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
     for (int i = 1; i < argc; ++i)
     {
-        FILE* fileInput = fopen(argv[i], "r"); //Allows the file to be read
-        
-        //Returns an error if the file is null
-        if (fileInput == NULL)
+        //Returns an error if the file cannot be opened
+        if (load_file(argv[i], &inputs[i]) == -1)
         {
             printf("File is null!\n");
             continue;
         }
-        
-        analyze_file(fileInput, states, NUM_STATES); //Runs 'analyze_file' method to help analyze the data
 
-        fclose(fileInput); //Prevents a resource leak by closing the file
+        split_file(&inputs[i], &job); //Breaks the file into chunks for the threads to parse
+    }
+
+    //The main thread merges the chunks in order, and parses any chunk the other threads have not got to yet
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+    if (num_threads > job.num_chunks - 1)
+    {
+        num_threads = job.num_chunks - 1;
+    }
+
+    if (num_threads < 0)
+    {
+        num_threads = 0;
+    }
+
+    pthread_t* threads = calloc(num_threads + 1, sizeof(pthread_t));
+    int started = 0;
+
+    job.window = (num_threads + 1) * CHUNKS_PER_THREAD;
+
+    while (started < num_threads && pthread_create(&threads[started], NULL, worker_main, &job) == 0)
+    {
+        started++;
+    }
+
+    for (int i = 0; i < job.num_chunks; ++i)
+    {
+        struct chunk* chunk = &job.chunks[i];
+        int parse_here = 0;
+
+        pthread_mutex_lock(&job.lock);
+
+        if (job.next == i)
+        {
+            job.next++;
+            parse_here = 1;
+        }
+
+        while (parse_here == 0 && chunk -> parsed == 0)
+        {
+            pthread_cond_wait(&job.cond, &job.lock);
+        }
+
+        pthread_mutex_unlock(&job.lock);
+
+        if (parse_here == 1)
+        {
+            analyze_chunk(chunk);
+        }
+
+        merge_chunk(chunk, states, NUM_STATES); //Adds the chunk to the report
+
+        //Lets the threads parse further ahead now that the chunk is done with
+        pthread_mutex_lock(&job.lock);
+        job.merged++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
     }
 
+    //Prevents a resource leak by releasing the files
+    for (int i = 1; i < argc; ++i)
+    {
+        if (inputs[i].mapped == 1)
+        {
+            munmap(inputs[i].data, inputs[i].len);
+        }
+
+        else
+        {
+            free(inputs[i].data);
+        }
+    }
+
+    free(threads);
+    free(job.chunks);
+    free(inputs);
+
     print_report(states, NUM_STATES); //Returns an printed output of the files
     
     return 0; //Satisfies return condition in header
 }
 
-void analyze_file(FILE *file, struct climate_info **states, int num_states) //Goes through a file to analyze its data
+//Maps a file into memory, or reads it in if it is not a regular file. Returns -1 if it cannot be opened
+int load_file(const char* path, struct input* input)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        input -> len = st.st_size;
+
+        //An empty file has nothing to map
+        if (input -> len == 0)
+        {
+            close(fd);
+            return 0;
+        }
+
+        input -> data = mmap(NULL, input -> len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (input -> data != MAP_FAILED)
+        {
+            input -> mapped = 1;
+            close(fd);
+            return 0;
+        }
+
+        input -> data = NULL;
+        input -> len = 0;
+    }
+
+    //Pipes and the like are read until the end instead
+    size_t cap = 0;
+    ssize_t n = 1;
+
+    while (n > 0)
+    {
+        if (input -> len == cap)
+        {
+            cap = cap == 0 ? CHUNK_SZ : cap * 2;
+            input -> data = realloc(input -> data, cap);
+        }
+
+        n = read(fd, input -> data + input -> len, cap - input -> len);
+
+        if (n > 0)
+        {
+            input -> len += n;
+        }
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+//Splits a file into chunks of about CHUNK_SZ bytes that each end after a newline
+void split_file(struct input* input, struct job* job)
 {
-    int index, found;
+    size_t pos = 0;
 
-    const int line_sz = 100; 
-    char line[line_sz];
+    while (pos < input -> len)
+    {
+        size_t end = pos + CHUNK_SZ;
 
+        if (end >= input -> len)
+        {
+            end = input -> len;
+        }
+
+        else
+        {
+            const char* newline = memchr(input -> data + end - 1, '\n', input -> len - end + 1);
+
+            end = newline == NULL ? input -> len : (size_t) (newline - input -> data) + 1;
+        }
+
+        job -> chunks = realloc(job -> chunks, (job -> num_chunks + 1) * sizeof(struct chunk));
+        memset(&job -> chunks[job -> num_chunks], 0, sizeof(struct chunk));
+
+        job -> chunks[job -> num_chunks].start = input -> data + pos;
+        job -> chunks[job -> num_chunks].end = input -> data + end;
+        job -> num_chunks++;
+
+        pos = end;
+    }
+}
+
+//Parses chunks until none are left, staying at most a window of chunks ahead of the merge
+void* worker_main(void* arg)
+{
+    struct job* job = arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&job -> lock);
+
+        while (job -> next < job -> num_chunks && job -> next >= job -> merged + job -> window)
+        {
+            pthread_cond_wait(&job -> cond, &job -> lock);
+        }
+
+        if (job -> next == job -> num_chunks)
+        {
+            pthread_mutex_unlock(&job -> lock);
+            return NULL;
+        }
+
+        struct chunk* chunk = &job -> chunks[job -> next++];
+
+        pthread_mutex_unlock(&job -> lock);
+
+        analyze_chunk(chunk);
+
+        pthread_mutex_lock(&job -> lock);
+        chunk -> parsed = 1;
+        pthread_cond_broadcast(&job -> cond);
+        pthread_mutex_unlock(&job -> lock);
+    }
+}
+
+//Tokenizes one line and adds it to the chunk's table
+static void analyze_line(char* line, struct chunk* chunk)
+{
     const char* delim = "\t\n";
 
-    struct climate_info* s1;
+    char* saveptr;
+    char* token = strtok_r(line, delim, &saveptr);
+    char* token_arr[9];
+
+    int i = 0;
+
+    while (token != NULL && i < 9)
+    {
+        token_arr[i++] = token;
+        token = strtok_r(NULL, delim, &saveptr);
+    }
 
-    while (fgets(line, line_sz, file) != NULL) //Allows for tokenization of each line
+    //Skips blank and incomplete lines
+    if (i < 9)
     {
-        char* token = strtok(line, delim);
-        char* token_arr[9];
+        return;
+    }
 
-        int i = 0;
-        
-        while (token != NULL)
+    //Converts tokenized data stored as a string to double, int, time_t, etc
+    char code[3];
+    struct record r;
+
+    snprintf(code, sizeof(code), "%s", token_arr[0]);
+    r.temperature = atof(token_arr[8]) * 1.8 - 459.67; //Standard conversion of Kelvin
+    r.humidity = atof(token_arr[3]);
+    r.cloud_cover = atof(token_arr[5]);
+    r.time = atol(token_arr[1]) / 1000;
+
+    //Checks to see if the state is already in the chunk's table
+    for (r.state = 0; r.state < chunk -> num_states; ++r.state)
+    {
+        if (strcmp(code, chunk -> states[r.state].code) == 0)
         {
-            token_arr[i++] = token;
-            token = strtok(NULL, delim);
+            break;
         }
+    }
 
-        found = 0;
+    if (r.state == chunk -> num_states)
+    {
+        if (chunk -> num_states == chunk -> cap_states)
+        {
+            chunk -> cap_states = chunk -> cap_states == 0 ? NUM_STATES : chunk -> cap_states * 2;
+            chunk -> states = realloc(chunk -> states, chunk -> cap_states * sizeof(struct climate_info));
+        }
 
-        //Converts tokenized data stored as a string to double, int, time_t, etc
-        char* code = token_arr[0];
-        double temp = atof(token_arr[8]) * 1.8 - 459.67; //Standard conversion of Kelvin
-        double sum_humidity = atof(token_arr[3]);
-        int lightning_strikes = atoi(token_arr[6]);
-        int snow_cover = atoi(token_arr[4]);
-        double cloud_cover = atof(token_arr[5]);
+        memset(&chunk -> states[r.state], 0, sizeof(struct climate_info));
+        strcpy(chunk -> states[r.state].code, code);
+        chunk -> num_states++;
+    }
 
-        time_t time = atol(token_arr[1]);
+    //Integer totals can be summed in any order, so they are kept per chunk
+    chunk -> states[r.state].num_records += 1;
+    chunk -> states[r.state].lightning_strikes += atoi(token_arr[6]);
+    chunk -> states[r.state].snow_cover += atoi(token_arr[4]);
 
-        for (int i = 0; i < num_states; ++i) 
+    if (chunk -> num_records == chunk -> cap_records)
+    {
+        chunk -> cap_records = chunk -> cap_records == 0 ? CHUNK_SZ / 64 : chunk -> cap_records * 2;
+        chunk -> records = realloc(chunk -> records, chunk -> cap_records * sizeof(struct record));
+    }
+
+    chunk -> records[chunk -> num_records++] = r;
+}
+
+//Goes through a chunk to analyze its data
+void analyze_chunk(struct chunk* chunk)
+{
+    char line[LINE_SZ];
+
+    const char* pos = chunk -> start;
+
+    while (pos < chunk -> end) //Copies out each line to tokenize it
+    {
+        size_t len = chunk -> end - pos;
+
+        const char* newline = memchr(pos, '\n', len < LINE_SZ - 1 ? len : LINE_SZ - 1);
+
+        if (newline != NULL)
+        {
+            len = newline - pos + 1;
+        }
+
+        else if (len > LINE_SZ - 1)
+        {
+            len = LINE_SZ - 1;
+        }
+
+        memcpy(line, pos, len);
+        line[len] = '\0';
+
+        analyze_line(line, chunk);
+
+        pos += len;
+    }
+}
+
+//Adds a parsed chunk to the report, in the same order the lines would have been read in one at a time
+void merge_chunk(struct chunk* chunk, struct climate_info *states[], int num_states)
+{
+    int* index = malloc((chunk -> num_states + 1) * sizeof(int));
+
+    for (int i = 0; i < chunk -> num_states; ++i)
+    {
+        index[i] = -1;
+
+        for (int j = 0; j < num_states; ++j)
         {
             //Checks to see if the state is present and makes struct point to it
-            if (states[i] != NULL && strcmp(code, states[i]-> code) == 0)
+            if (states[j] != NULL && strcmp(chunk -> states[i].code, states[j] -> code) == 0)
             {
-                found = 1;
-
-                s1 = states[i];
-                index = i;
-                
-                break; //Breaks out of loop manually
+                index[i] = j;
+                break;
             }
         }
+    }
+
+    for (long i = 0; i < chunk -> num_records; ++i)
+    {
+        struct record* r = &chunk -> records[i];
+        int state = index[r -> state];
 
         //Dynamically Allocates Memory in the case the state is not found and copies over its instance data
-        if (found == 0)
-        {
-            s1 = (struct climate_info *) malloc(sizeof(struct climate_info));
-            
-            strcpy(s1 -> code, code);
-
-            s1 -> num_records = 1;
-            s1 -> sum_humidity = sum_humidity;
-            s1 -> sum_temperature = temp;
-            s1 -> max_temperature = temp;
-            s1 -> max_temperature_occurence = time / 1000;
-            s1 -> min_temperature = temp;
-            s1 -> min_temperature_occurence = time / 1000;
-            s1 -> lightning_strikes = lightning_strikes;
-            s1 -> snow_cover = snow_cover;
-            s1 -> cloud_cover = cloud_cover;
-            
-            for (int i = 0; i < num_states; ++i)
+        if (state == -1)
+        {
+            for (int j = 0; j < num_states; ++j)
             {
-                if (states[i] == NULL)
+                if (states[j] == NULL)
                 {
-                    states[i] = s1;
+                    state = j;
                     break;
                 }
             }
+
+            //Leaves out states that no longer fit
+            if (state == -1)
+            {
+                index[r -> state] = -2;
+                continue;
+            }
+
+            struct climate_info* s1 = (struct climate_info *) malloc(sizeof(struct climate_info));
+
+            strcpy(s1 -> code, chunk -> states[r -> state].code);
+
+            s1 -> num_records = 0; //Added from the chunk's totals below
+            s1 -> sum_humidity = r -> humidity;
+            s1 -> sum_temperature = r -> temperature;
+            s1 -> max_temperature = r -> temperature;
+            s1 -> max_temperature_occurence = r -> time;
+            s1 -> min_temperature = r -> temperature;
+            s1 -> min_temperature_occurence = r -> time;
+            s1 -> lightning_strikes = 0;
+            s1 -> snow_cover = 0;
+            s1 -> cloud_cover = r -> cloud_cover;
+
+            states[state] = s1;
+            index[r -> state] = state;
         }
 
         //For all other cases if the state is present, the data is augmented to, not overwritten
-        else
+        else if (state >= 0)
         {
-            states[index] -> num_records += 1;
-            states[index] -> sum_humidity += sum_humidity;
-            states[index] -> sum_temperature += temp;
-            states[index] -> lightning_strikes += lightning_strikes;
-            states[index] -> snow_cover += snow_cover;
-            states[index] -> cloud_cover += cloud_cover;
+            states[state] -> sum_humidity += r -> humidity;
+            states[state] -> sum_temperature += r -> temperature;
+            states[state] -> cloud_cover += r -> cloud_cover;
 
             //Algorithm that finds the greatest maximum temperature
-            if (states[index] -> max_temperature < temp)
+            if (states[state] -> max_temperature < r -> temperature)
             {
-                states[index] -> max_temperature = temp;
-                states[index] -> max_temperature_occurence = time / 1000;
+                states[state] -> max_temperature = r -> temperature;
+                states[state] -> max_temperature_occurence = r -> time;
             }
-            
+
             //Algorithm that finds the greatest minimum temperature
-            if (states[index] -> min_temperature > temp)
+            if (states[state] -> min_temperature > r -> temperature)
             {
-                states[index] -> min_temperature = temp;
-                states[index] -> min_temperature_occurence = time / 1000;
+                states[state] -> min_temperature = r -> temperature;
+                states[state] -> min_temperature_occurence = r -> time;
             }
         }
     }
+
+    for (int i = 0; i < chunk -> num_states; ++i)
+    {
+        if (index[i] >= 0)
+        {
+            states[index[i]] -> num_records += chunk -> states[i].num_records;
+            states[index[i]] -> lightning_strikes += chunk -> states[i].lightning_strikes;
+            states[index[i]] -> snow_cover += chunk -> states[i].snow_cover;
+        }
+    }
+
+    //Prevents a resource leak by freeing the chunk's tables
+    free(index);
+    free(chunk -> states);
+    free(chunk -> records);
+
+    chunk -> states = NULL;
+    chunk -> records = NULL;
 }
 
 //Produces a visible output of the data analysis
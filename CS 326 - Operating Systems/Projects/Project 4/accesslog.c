@@ -0,0 +1,407 @@
+/**
+ * @file
+ *
+ * Asynchronous access log. See accesslog.h.
+ *
+ * The rings are single-producer, single-consumer: a thread (or forked
+ * connection process) claims a free ring the first time it logs by swapping
+ * its thread id into the ring's owner field, and is then the only one to
+ * advance the ring's head. The writer thread is the only one to advance the
+ * tails. Head and tail are free-running counters; the difference is the
+ * number of queued records. A ring whose owner has died is handed back once
+ * the writer has drained it. Records of a thread that finds every ring taken
+ * are dropped and counted in a shared counter after the rings, so the log
+ * still reports them.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+
+/** Number of rings, i.e. of threads or processes that can log at once */
+#define LOG_RINGS 64
+
+/** Records per ring (a power of two) */
+#define RING_RECORDS 4096
+
+/** Size of the writer's output buffer */
+#define WRITE_BUF_LEN (256 * 1024)
+
+/** Room needed to format one record */
+#define LINE_MAX_LEN (ACCESS_LOG_PATH_LEN + 128)
+
+/** Buffered lines are written at least this often, in milliseconds */
+#define FLUSH_INTERVAL_MS 200
+
+/** How long the writer sleeps when every ring is empty, in milliseconds */
+#define IDLE_SLEEP_MS 10
+
+struct log_ring {
+    /** Thread id of the producer, or 0 if the ring is free */
+    int32_t owner;
+
+    /** Records pushed so far; only the owner writes it */
+    uint32_t head;
+
+    /** Records the owner had to drop because the ring was full */
+    uint64_t dropped;
+
+    /** Keeps the writer's counter off the producer's cache line */
+    char pad[48];
+
+    /** Records consumed so far; only the writer writes it */
+    uint32_t tail;
+
+    struct access_record records[RING_RECORDS];
+};
+
+static struct log_ring *g_rings = NULL; /*!< Shared with forked children */
+static int g_log_fd = -1;
+
+/** Records dropped because no ring was free; follows g_rings */
+static uint64_t *g_ringless_drops = NULL;
+
+/** Size of the shared mapping holding the rings and the counter */
+#define RINGS_MAP_LEN (LOG_RINGS * sizeof(struct log_ring) + sizeof(uint64_t))
+
+static __thread struct log_ring *t_ring = NULL;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Writes out the whole buffer. Only the writer thread calls this, so it is
+ * free to block.
+ */
+static void flush(const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t written = write(g_log_fd, buf, len);
+
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("access log");
+            return;
+        }
+
+        buf += written;
+        len -= written;
+    }
+}
+
+/**
+ * Formats one record as a log line.
+ *
+ * Returns:
+ *  - Length of the line
+ */
+static size_t format_record(const struct access_record *rec, char *out)
+{
+    /* Requests come in bursts, so the date part is usually unchanged */
+    static time_t cached_second = -1;
+    static char cached_date[32];
+
+    time_t second = rec->time_ms / 1000;
+    char peer[INET6_ADDRSTRLEN] = "-";
+
+    if(second != cached_second)
+    {
+        struct tm tm;
+
+        gmtime_r(&second, &tm);
+        strftime(cached_date, sizeof(cached_date), "%Y-%m-%dT%H:%M:%S", &tm);
+        cached_second = second;
+    }
+
+    if(rec->family == AF_INET || rec->family == AF_INET6)
+    {
+        inet_ntop(rec->family, rec->addr, peer, sizeof(peer));
+    }
+
+    return snprintf(out, LINE_MAX_LEN, "%s.%03dZ %s %u %llu %llu %s\n",
+            cached_date, (int) (rec->time_ms % 1000), peer, rec->status,
+            (unsigned long long) rec->bytes,
+            (unsigned long long) (rec->elapsed_ns / 1000), rec->path);
+}
+
+/**
+ * Hands a drained ring back if its owner no longer exists (a connection
+ * process that died without calling access_log_detach()).
+ */
+static void reclaim(struct log_ring *ring)
+{
+    int32_t owner = __atomic_load_n(&ring->owner, __ATOMIC_RELAXED);
+
+    if(owner != 0 && kill(owner, 0) == -1 && errno == ESRCH)
+    {
+        __atomic_compare_exchange_n(&ring->owner, &owner, 0, false,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    static char buf[WRITE_BUF_LEN];
+    uint64_t reported_drops = 0;
+    int64_t last_flush = now_ms();
+    size_t used = 0;
+
+    (void) arg;
+
+    while(true)
+    {
+        bool drained_any = false;
+        uint64_t drops = __atomic_load_n(g_ringless_drops, __ATOMIC_RELAXED);
+
+        for(int i = 0; i < LOG_RINGS; i++)
+        {
+            struct log_ring *ring = &g_rings[i];
+            uint32_t tail = ring->tail;
+            uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+            drops += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+            if(tail == head)
+            {
+                reclaim(ring);
+                continue;
+            }
+
+            for(; tail != head; tail++)
+            {
+                if(WRITE_BUF_LEN - used < LINE_MAX_LEN)
+                {
+                    flush(buf, used);
+                    used = 0;
+                    last_flush = now_ms();
+                }
+
+                used += format_record(
+                        &ring->records[tail & (RING_RECORDS - 1)], buf + used);
+            }
+
+            /* The slots may be reused once the tail moves past them */
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            drained_any = true;
+        }
+
+        if(drops != reported_drops && WRITE_BUF_LEN - used >= LINE_MAX_LEN)
+        {
+            used += snprintf(buf + used, LINE_MAX_LEN,
+                    "# %llu records dropped (log rings full or all taken)\n",
+                    (unsigned long long) (drops - reported_drops));
+            reported_drops = drops;
+        }
+
+        if(used > 0 && (used >= WRITE_BUF_LEN / 2
+                    || now_ms() - last_flush >= FLUSH_INTERVAL_MS))
+        {
+            flush(buf, used);
+            used = 0;
+            last_flush = now_ms();
+        }
+
+        if(drained_any == false)
+        {
+            struct timespec idle = { 0, IDLE_SLEEP_MS * 1000000L };
+
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens the log file, maps the rings and starts the writer thread. Must be
+ * called before the server forks or starts its workers.
+ *
+ * Inputs:
+ *  - path: file to append to
+ *
+ * Returns:
+ *  - true on success
+ */
+bool access_log_open(const char *path)
+{
+    pthread_t writer;
+
+    g_log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+    if(g_log_fd == -1)
+    {
+        perror(path);
+        return false;
+    }
+
+    g_rings = mmap(NULL, RINGS_MAP_LEN, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(g_rings == MAP_FAILED)
+    {
+        perror("mmap");
+        g_rings = NULL;
+        close(g_log_fd);
+        return false;
+    }
+
+    g_ringless_drops = (uint64_t *) (g_rings + LOG_RINGS);
+
+    if(pthread_create(&writer, NULL, writer_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        munmap(g_rings, RINGS_MAP_LEN);
+        g_rings = NULL;
+        close(g_log_fd);
+        return false;
+    }
+
+    pthread_detach(writer);
+
+    return true;
+}
+
+/**
+ * Returns true if access logging is on.
+ */
+bool access_log_enabled(void)
+{
+    return g_rings != NULL;
+}
+
+/**
+ * Starts a record for a request that is being taken up.
+ *
+ * Inputs:
+ *  - rec: record to initialize
+ *  - path: request target
+ */
+void access_log_begin(struct access_record *rec, const char *path)
+{
+    rec->time_ms = now_ms();
+    rec->elapsed_ns = now_ns();
+    snprintf(rec->path, ACCESS_LOG_PATH_LEN, "%s", path);
+}
+
+/**
+ * Claims a free ring for the calling thread.
+ */
+static struct log_ring *claim_ring(void)
+{
+    int32_t tid = syscall(SYS_gettid);
+
+    for(int i = 0; i < LOG_RINGS; i++)
+    {
+        int32_t expected = 0;
+
+        if(__atomic_compare_exchange_n(&g_rings[i].owner, &expected, tid,
+                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return &g_rings[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Completes a record once its response has been sent and queues it for the
+ * writer. Never blocks; if the caller's ring is full (or no ring is free)
+ * the record is dropped.
+ *
+ * Inputs:
+ *  - rec: record from access_log_begin()
+ *  - peer: client address (may be NULL)
+ *  - status: response status code
+ *  - bytes: response bytes sent
+ */
+void access_log_commit(struct access_record *rec,
+        const struct sockaddr_storage *peer, int status, uint64_t bytes)
+{
+    if(t_ring == NULL)
+    {
+        t_ring = claim_ring();
+
+        if(t_ring == NULL)
+        {
+            __atomic_fetch_add(g_ringless_drops, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    rec->elapsed_ns = now_ns() - rec->elapsed_ns;
+    rec->status = status;
+    rec->bytes = bytes;
+    rec->family = AF_UNSPEC;
+
+    if(peer != NULL && peer->ss_family == AF_INET)
+    {
+        rec->family = AF_INET;
+        memcpy(rec->addr, &((const struct sockaddr_in *) peer)->sin_addr, 4);
+    }
+
+    else if(peer != NULL && peer->ss_family == AF_INET6)
+    {
+        rec->family = AF_INET6;
+        memcpy(rec->addr, &((const struct sockaddr_in6 *) peer)->sin6_addr,
+                16);
+    }
+
+    uint32_t head = t_ring->head;
+    uint32_t tail = __atomic_load_n(&t_ring->tail, __ATOMIC_ACQUIRE);
+
+    if(head - tail == RING_RECORDS)
+    {
+        __atomic_fetch_add(&t_ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    t_ring->records[head & (RING_RECORDS - 1)] = *rec;
+    __atomic_store_n(&t_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Gives up the calling thread's ring, e.g. before a connection process
+ * exits. Queued records are still written.
+ */
+void access_log_detach(void)
+{
+    if(t_ring != NULL)
+    {
+        __atomic_store_n(&t_ring->owner, 0, __ATOMIC_RELEASE);
+        t_ring = NULL;
+    }
+}
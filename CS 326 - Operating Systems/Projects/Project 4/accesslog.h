@@ -0,0 +1,62 @@
+/**
+ * @file
+ *
+ * Asynchronous access log. Request handlers fill in a fixed-size record per
+ * response and push it into a single-producer ring of their own; a writer
+ * thread in the main process drains every ring, formats the records and
+ * appends them to the log file in large writes. The rings live in shared
+ * memory, so connection processes forked by the server log through the same
+ * writer. A handler never waits: when its ring is full the record is dropped
+ * and counted.
+ *
+ * Each line has six space-separated fields:
+ *
+ *     2026-10-19T14:16:56.123Z 127.0.0.1 200 5120 87 /index.html
+ *
+ * the time the request was taken up (UTC), the client address, the status
+ * code, the number of response bytes sent, the time to serve the request in
+ * microseconds, and the request target.
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/** Longer request targets are truncated in the log */
+#define ACCESS_LOG_PATH_LEN 192
+
+/**
+ * One access log entry. Filled in by access_log_begin() when a request is
+ * taken up and completed by access_log_commit().
+ */
+struct access_record {
+    /** Wall-clock time the request was taken up, in milliseconds */
+    int64_t time_ms;
+
+    /** Monotonic start time in nanoseconds; becomes the latency on commit */
+    uint64_t elapsed_ns;
+
+    /** Response bytes sent */
+    uint64_t bytes;
+
+    uint16_t status;
+
+    /** Client address family (AF_INET or AF_INET6) and address */
+    uint16_t family;
+    uint8_t addr[16];
+
+    /** NUL-terminated request target */
+    char path[ACCESS_LOG_PATH_LEN];
+};
+
+bool access_log_open(const char *path);
+bool access_log_enabled(void);
+void access_log_begin(struct access_record *rec, const char *path);
+void access_log_commit(struct access_record *rec,
+        const struct sockaddr_storage *peer, int status, uint64_t bytes);
+void access_log_detach(void);
+
+#endif
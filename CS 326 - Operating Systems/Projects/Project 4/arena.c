@@ -0,0 +1,117 @@
+/**
+ * @file
+ *
+ * Per-request arenas. See arena.h.
+ *
+ * A connection is only ever served by one thread (or process), so the pool
+ * is thread-local and needs no locking.
+ */
+
+#include <stdalign.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/**
+ * Header of a block; its memory follows.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    alignas(max_align_t) char data[];
+};
+
+/** Free pooled blocks of this thread */
+static __thread struct arena_block *g_pool = NULL;
+static __thread int g_pool_len = 0;
+
+static struct arena_block *get_block(size_t size)
+{
+    struct arena_block *block;
+
+    if(size == ARENA_BLOCK_SIZE && g_pool != NULL)
+    {
+        block = g_pool;
+        g_pool = block->next;
+        g_pool_len--;
+
+        return block;
+    }
+
+    block = malloc(sizeof(struct arena_block) + size);
+
+    if(block != NULL)
+    {
+        block->size = size;
+    }
+
+    return block;
+}
+
+/**
+ * Allocates *len* bytes, suitably aligned for any type, that stay valid until
+ * the next arena_reset().
+ *
+ * Returns:
+ *  - The memory, or NULL if it cannot be allocated
+ */
+void *arena_alloc(struct arena *arena, size_t len)
+{
+    const size_t align = alignof(max_align_t);
+
+    len = (len + align - 1) & ~(align - 1);
+
+    if(arena->blocks != NULL && arena->blocks->size - arena->used >= len)
+    {
+        void *ptr = arena->blocks->data + arena->used;
+
+        arena->used += len;
+
+        return ptr;
+    }
+
+    struct arena_block *block = get_block(len > ARENA_BLOCK_SIZE
+            ? len : ARENA_BLOCK_SIZE);
+
+    if(block == NULL)
+    {
+        return NULL;
+    }
+
+    /* What is left of the previous block goes unused until the reset */
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->used = len;
+
+    return block->data;
+}
+
+/**
+ * Frees everything allocated from the arena, returning its blocks to this
+ * thread's pool.
+ */
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *next;
+
+    for(struct arena_block *block = arena->blocks; block != NULL;
+            block = next)
+    {
+        next = block->next;
+
+        if(block->size == ARENA_BLOCK_SIZE && g_pool_len < ARENA_POOL_BLOCKS)
+        {
+            block->next = g_pool;
+            g_pool = block;
+            g_pool_len++;
+        }
+
+        else
+        {
+            free(block);
+        }
+    }
+
+    arena->blocks = NULL;
+    arena->used = 0;
+}
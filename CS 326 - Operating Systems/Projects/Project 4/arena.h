@@ -0,0 +1,40 @@
+/**
+ * @file
+ *
+ * Per-request memory. Everything a response needs while it is built and sent
+ * (its generated header lines, the buffer a streamed body is framed in,
+ * scratch paths) is carved out of the connection's arena with a pointer
+ * bump, and the whole arena is handed back at once when the response is
+ * released. Blocks come from a small per-thread pool, so an idle connection
+ * holds none, and the block a connection gets is usually the one the
+ * previous response on that thread just gave back and is still in cache.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/** Size of a pooled block; larger allocations get a block of their own */
+#define ARENA_BLOCK_SIZE (8 * 1024)
+
+/** Most free blocks kept per thread */
+#define ARENA_POOL_BLOCKS 64
+
+struct arena_block;
+
+/**
+ * A connection's arena. Zero-initialized, it is empty.
+ */
+struct arena {
+    /** Blocks in use, the one being carved up first */
+    struct arena_block *blocks;
+
+    /** Bytes of the first block handed out */
+    size_t used;
+};
+
+void *arena_alloc(struct arena *arena, size_t len);
+void arena_reset(struct arena *arena);
+
+#endif
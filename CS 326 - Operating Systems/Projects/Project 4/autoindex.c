@@ -0,0 +1,769 @@
+/**
+ * @file
+ *
+ * Directory listings. See autoindex.h.
+ *
+ * A hit costs a stat() of the directory and a probe of the table under a
+ * mutex; the directory is only read, sorted and rendered (outside the lock)
+ * when its modification time no longer matches. A replaced page is dropped
+ * from the table at once but freed with its last reference. Pages that do
+ * not fit in the table's memory budget next to those in use are rendered for
+ * the one response and freed after it.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "autoindex.h"
+#include "httpdate.h"
+#include "logger.h"
+
+/** Hash buckets (a power of two) */
+#define AUTOINDEX_BUCKETS 256
+
+/** Memory kept for rendered pages */
+#define AUTOINDEX_CACHE_BYTES (16 * 1024 * 1024)
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct autoindex_page *g_buckets[AUTOINDEX_BUCKETS];
+
+/** Bytes of the pages in the table */
+static size_t g_cached = 0;
+
+/**
+ * One directory entry, as listed.
+ */
+struct listing_entry {
+    char *name;
+    bool is_dir;
+    off_t size;
+    time_t mtime;
+};
+
+/**
+ * Growing output buffer; *failed* is set if memory runs out.
+ */
+struct page_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+/**
+ * FNV-1a hash of a NUL-terminated string.
+ */
+static uint64_t hash_str(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*str != '\0')
+    {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static size_t bucket(const char *path, enum autoindex_format format)
+{
+    return (hash_str(path) + format) & (AUTOINDEX_BUCKETS - 1);
+}
+
+/**
+ * Parses the name of a listing format ("html", "json" or "off").
+ *
+ * Returns:
+ *  - The format, or -1 if the name is not one
+ */
+int autoindex_parse_format(const char *name)
+{
+    if(strcmp(name, "html") == 0)
+    {
+        return AUTOINDEX_HTML;
+    }
+
+    if(strcmp(name, "json") == 0)
+    {
+        return AUTOINDEX_JSON;
+    }
+
+    if(strcmp(name, "off") == 0)
+    {
+        return AUTOINDEX_OFF;
+    }
+
+    return -1;
+}
+
+static bool reserve(struct page_buf *buf, size_t len)
+{
+    if(buf->failed)
+    {
+        return false;
+    }
+
+    if(buf->len + len < buf->cap)
+    {
+        return true;
+    }
+
+    size_t cap = buf->cap > 0 ? buf->cap : 4096;
+
+    while(buf->len + len >= cap)
+    {
+        cap *= 2;
+    }
+
+    char *data = realloc(buf->data, cap);
+
+    if(data == NULL)
+    {
+        buf->failed = true;
+        return false;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+
+    return true;
+}
+
+static void put(struct page_buf *buf, const char *str, size_t len)
+{
+    if(reserve(buf, len))
+    {
+        memcpy(buf->data + buf->len, str, len);
+        buf->len += len;
+    }
+}
+
+static void put_str(struct page_buf *buf, const char *str)
+{
+    put(buf, str, strlen(str));
+}
+
+static void put_fmt(struct page_buf *buf, const char *fmt, ...)
+{
+    va_list args;
+    char small[128];
+
+    va_start(args, fmt);
+    int len = vsnprintf(small, sizeof(small), fmt, args);
+    va_end(args);
+
+    /* Only ever used for numbers and dates */
+    if(len > 0 && (size_t) len < sizeof(small))
+    {
+        put(buf, small, len);
+    }
+}
+
+/**
+ * Appends *str* as HTML text (also safe inside a quoted attribute).
+ */
+static void put_html(struct page_buf *buf, const char *str)
+{
+    for(; *str != '\0'; str++)
+    {
+        switch(*str)
+        {
+            case '&':
+                put_str(buf, "&amp;");
+                break;
+            case '<':
+                put_str(buf, "&lt;");
+                break;
+            case '>':
+                put_str(buf, "&gt;");
+                break;
+            case '"':
+                put_str(buf, "&quot;");
+                break;
+            case '\'':
+                put_str(buf, "&#39;");
+                break;
+            default:
+                put(buf, str, 1);
+                break;
+        }
+    }
+}
+
+/**
+ * Appends the first *len* bytes of *str* percent-encoded for a URL path,
+ * leaving the '/' separators.
+ */
+static void put_url_len(struct page_buf *buf, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for(const char *end = str + len; str < end; str++)
+    {
+        unsigned char c = *str;
+
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                || (c >= '0' && c <= '9') || strchr("/-._~", c) != NULL)
+        {
+            put(buf, str, 1);
+        }
+
+        else
+        {
+            char escaped[3] = { '%', hex[c >> 4], hex[c & 15] };
+
+            put(buf, escaped, 3);
+        }
+    }
+}
+
+static void put_url(struct page_buf *buf, const char *str)
+{
+    put_url_len(buf, str, strlen(str));
+}
+
+/**
+ * Appends *str* as the contents of a JSON string.
+ */
+static void put_json(struct page_buf *buf, const char *str)
+{
+    for(; *str != '\0'; str++)
+    {
+        unsigned char c = *str;
+
+        if(c == '"' || c == '\\')
+        {
+            char escaped[2] = { '\\', c };
+
+            put(buf, escaped, 2);
+        }
+
+        else if(c < 0x20)
+        {
+            put_fmt(buf, "\\u%04x", c);
+        }
+
+        else
+        {
+            put(buf, str, 1);
+        }
+    }
+}
+
+/**
+ * Directories first, then by name.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct listing_entry *x = a;
+    const struct listing_entry *y = b;
+
+    if(x->is_dir != y->is_dir)
+    {
+        return x->is_dir ? -1 : 1;
+    }
+
+    return strcmp(x->name, y->name);
+}
+
+/**
+ * Reads the entries of an open directory, skipping hidden ones and ones
+ * that cannot be stat()ed (such as dangling symbolic links).
+ *
+ * Returns:
+ *  - The number of entries in *entries*, or -1 on failure
+ */
+static ssize_t read_entries(int dir_fd, struct listing_entry **entries)
+{
+    DIR *dir = fdopendir(dir_fd);
+    struct listing_entry *list = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    bool failed = false;
+    struct dirent *ent;
+
+    if(dir == NULL)
+    {
+        close(dir_fd);
+        return -1;
+    }
+
+    while(failed == false && (ent = readdir(dir)) != NULL)
+    {
+        struct stat st;
+
+        /* Also skips "." and ".."; dot files are not meant to be listed */
+        if(ent->d_name[0] == '.'
+                || fstatat(dirfd(dir), ent->d_name, &st, 0) == -1)
+        {
+            continue;
+        }
+
+        if(count == cap)
+        {
+            size_t grown_cap = cap > 0 ? cap * 2 : 64;
+            struct listing_entry *grown = realloc(list,
+                    grown_cap * sizeof(struct listing_entry));
+
+            if(grown == NULL)
+            {
+                failed = true;
+                break;
+            }
+
+            list = grown;
+            cap = grown_cap;
+        }
+
+        list[count].name = strdup(ent->d_name);
+        failed = list[count].name == NULL;
+        list[count].is_dir = S_ISDIR(st.st_mode);
+        list[count].size = st.st_size;
+        list[count].mtime = st.st_mtime;
+        count += failed == false;
+    }
+
+    closedir(dir);
+
+    if(failed)
+    {
+        for(size_t i = 0; i < count; i++)
+        {
+            free(list[i].name);
+        }
+
+        free(list);
+
+        return -1;
+    }
+
+    qsort(list, count, sizeof(struct listing_entry), compare_entries);
+    *entries = list;
+
+    return count;
+}
+
+static void render_html(struct page_buf *buf, const char *path,
+        const struct listing_entry *entries, size_t count)
+{
+    put_str(buf, "<!DOCTYPE html>\n<html>\n<head>\n"
+            "<meta charset=\"utf-8\">\n<title>Index of ");
+    put_html(buf, path);
+    put_str(buf, "</title>\n</head>\n<body>\n<h1>Index of ");
+    put_html(buf, path);
+    put_str(buf, "</h1>\n<table>\n"
+            "<tr><th>Name</th><th>Last modified</th><th>Size</th></tr>\n");
+
+    /* Absolute links also work for a directory requested without its
+     * trailing slash */
+    if(strcmp(path, "/") != 0)
+    {
+        size_t parent = strlen(path) - 1;
+
+        while(parent > 0 && path[parent - 1] != '/')
+        {
+            parent--;
+        }
+
+        put_str(buf, "<tr><td><a href=\"");
+        put_url_len(buf, path, parent);
+        put_str(buf, "\">../</a></td><td></td><td>-</td></tr>\n");
+    }
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct listing_entry *entry = &entries[i];
+        char modified[32] = "";
+        struct tm tm;
+
+        if(gmtime_r(&entry->mtime, &tm) != NULL)
+        {
+            strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+        }
+
+        put_str(buf, "<tr><td><a href=\"");
+        put_url(buf, path);
+        put_url(buf, entry->name);
+        put_str(buf, entry->is_dir ? "/\">" : "\">");
+        put_html(buf, entry->name);
+        put_str(buf, entry->is_dir ? "/</a></td><td>" : "</a></td><td>");
+        put_str(buf, modified);
+        put_str(buf, "</td><td>");
+
+        if(entry->is_dir)
+        {
+            put_str(buf, "-");
+        }
+
+        else
+        {
+            put_fmt(buf, "%jd", (intmax_t) entry->size);
+        }
+
+        put_str(buf, "</td></tr>\n");
+    }
+
+    put_str(buf, "</table>\n</body>\n</html>\n");
+}
+
+static void render_json(struct page_buf *buf,
+        const struct listing_entry *entries, size_t count)
+{
+    put_str(buf, "[");
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const struct listing_entry *entry = &entries[i];
+        char modified[HTTP_DATE_SIZE];
+
+        http_date_format(entry->mtime, modified, sizeof(modified));
+
+        put_str(buf, i > 0 ? ",\n{ \"name\": \"" : "\n{ \"name\": \"");
+        put_json(buf, entry->name);
+        put_str(buf, entry->is_dir ? "\", \"type\": \"directory\""
+                : "\", \"type\": \"file\"");
+        put_str(buf, ", \"mtime\": \"");
+        put_str(buf, modified);
+        put_str(buf, "\"");
+
+        if(entry->is_dir == false)
+        {
+            put_fmt(buf, ", \"size\": %jd", (intmax_t) entry->size);
+        }
+
+        put_str(buf, " }");
+    }
+
+    put_str(buf, "\n]\n");
+}
+
+/**
+ * Reads and renders a directory.
+ *
+ * Returns:
+ *  - A page with no references that is not in the table, or NULL on failure
+ */
+static struct autoindex_page *render(int root_fd, const char *rel,
+        const char *path, enum autoindex_format format)
+{
+    struct autoindex_page *page = calloc(1, sizeof(struct autoindex_page));
+    struct listing_entry *entries = NULL;
+    struct page_buf buf = {0};
+    struct stat st;
+
+    if(page == NULL)
+    {
+        return NULL;
+    }
+
+    int dir_fd = openat(root_fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* The time the listing is keyed by is taken before reading, so changes
+     * made while it is read show up as a mismatch next time */
+    if(dir_fd == -1 || fstat(dir_fd, &st) == -1)
+    {
+        if(dir_fd != -1)
+        {
+            close(dir_fd);
+        }
+
+        free(page);
+        return NULL;
+    }
+
+    ssize_t count = read_entries(dir_fd, &entries);
+
+    if(count == -1)
+    {
+        free(page);
+        return NULL;
+    }
+
+    if(format == AUTOINDEX_JSON)
+    {
+        render_json(&buf, entries, count);
+    }
+
+    else
+    {
+        render_html(&buf, path, entries, count);
+    }
+
+    for(ssize_t i = 0; i < count; i++)
+    {
+        free(entries[i].name);
+    }
+
+    free(entries);
+
+    page->path = strdup(path);
+
+    if(buf.failed || page->path == NULL)
+    {
+        free(buf.data);
+        free(page->path);
+        free(page);
+        return NULL;
+    }
+
+    page->format = format;
+    page->dev = st.st_dev;
+    page->ino = st.st_ino;
+    page->mtime = st.st_mtim;
+    page->body = buf.data;
+    page->len = buf.len;
+
+    LOG("Rendered a listing of %s (%zd entries, %zu bytes)\n", path, count,
+            buf.len);
+
+    return page;
+}
+
+static void free_page(struct autoindex_page *page)
+{
+    free(page->body);
+    free(page->path);
+    free(page);
+}
+
+/**
+ * Takes a page out of the table; it is freed now if it is not in use, or
+ * else by its last autoindex_release(). Call with the lock held.
+ */
+static void drop_page(struct autoindex_page *page)
+{
+    struct autoindex_page **link = &g_buckets[bucket(page->path,
+            page->format)];
+
+    while(*link != page)
+    {
+        link = &(*link)->hash_next;
+    }
+
+    *link = page->hash_next;
+    page->cached = false;
+    g_cached -= page->len;
+
+    if(page->refs == 0)
+    {
+        free_page(page);
+    }
+}
+
+/**
+ * Drops unused pages until *len* more bytes fit in the budget. Call with the
+ * lock held.
+ *
+ * Returns:
+ *  - true if they fit
+ */
+static bool make_room(size_t len)
+{
+    for(int i = 0; i < AUTOINDEX_BUCKETS
+            && g_cached + len > AUTOINDEX_CACHE_BYTES; i++)
+    {
+        struct autoindex_page *next;
+
+        for(struct autoindex_page *page = g_buckets[i]; page != NULL;
+                page = next)
+        {
+            next = page->hash_next;
+
+            if(page->refs == 0)
+            {
+                drop_page(page);
+            }
+        }
+    }
+
+    return g_cached + len <= AUTOINDEX_CACHE_BYTES;
+}
+
+static bool same_directory(const struct autoindex_page *page, dev_t dev,
+        ino_t ino, const struct timespec *mtime)
+{
+    return page->dev == dev && page->ino == ino
+        && page->mtime.tv_sec == mtime->tv_sec
+        && page->mtime.tv_nsec == mtime->tv_nsec;
+}
+
+/**
+ * Returns true if a URL path has a ".." component.
+ */
+static bool leaves_directory(const char *path)
+{
+    size_t len = strlen(path);
+
+    return strstr(path, "/../") != NULL
+        || (len >= 3 && strcmp(path + len - 3, "/..") == 0);
+}
+
+/**
+ * Finds the page for a directory. Call with the lock held.
+ */
+static struct autoindex_page *find_page(const char *path,
+        enum autoindex_format format)
+{
+    struct autoindex_page *page = g_buckets[bucket(path, format)];
+
+    while(page != NULL && (page->format != format
+                || strcmp(page->path, path) != 0))
+    {
+        page = page->hash_next;
+    }
+
+    return page;
+}
+
+/**
+ * Returns a reference to the listing of a directory, rendering it if the
+ * directory has changed since it was last listed.
+ *
+ * Inputs:
+ *  - root_fd: document root the path is relative to
+ *  - path: request path of the directory ("./" followed by the path; any
+ *    number of trailing slashes)
+ *  - format: AUTOINDEX_HTML or AUTOINDEX_JSON
+ *
+ * Returns:
+ *  - The page, or NULL if the path is not a listable directory (errno is
+ *    set)
+ */
+struct autoindex_page *autoindex_acquire(int root_fd, const char *path,
+        enum autoindex_format format)
+{
+    char key[PATH_MAX];
+    struct stat st;
+
+    /* The table is keyed by the path as a URL: "/", "/pub/", ... */
+    size_t len = strlen(path);
+
+    while(len > 1 && path[len - 1] == '/')
+    {
+        len--;
+    }
+
+    if(len + 2 > sizeof(key) || path[0] != '.')
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    memcpy(key, path + 1, len - 1);
+    key[len - 1] = '\0';
+
+    if(key[0] != '/')
+    {
+        memmove(key + 1, key, len);
+        key[0] = '/';
+    }
+
+    /* Never list anything above the document root */
+    if(leaves_directory(key))
+    {
+        errno = EACCES;
+        return NULL;
+    }
+
+    if(strcmp(key, "/") != 0)
+    {
+        strcat(key, "/");
+    }
+
+    if(fstatat(root_fd, path, &st, 0) == -1)
+    {
+        return NULL;
+    }
+
+    if(S_ISDIR(st.st_mode) == false)
+    {
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_lock);
+
+    struct autoindex_page *page = find_page(key, format);
+
+    if(page != NULL
+            && same_directory(page, st.st_dev, st.st_ino, &st.st_mtim))
+    {
+        page->refs++;
+        pthread_mutex_unlock(&g_lock);
+        return page;
+    }
+
+    pthread_mutex_unlock(&g_lock);
+
+    struct autoindex_page *fresh = render(root_fd, path, key, format);
+
+    if(fresh == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_lock);
+
+    /* Another thread may have rendered the same listing meanwhile */
+    page = find_page(key, format);
+
+    if(page != NULL && same_directory(page, fresh->dev, fresh->ino,
+                &fresh->mtime))
+    {
+        page->refs++;
+        pthread_mutex_unlock(&g_lock);
+        free_page(fresh);
+        return page;
+    }
+
+    if(page != NULL)
+    {
+        drop_page(page);
+    }
+
+    fresh->refs = 1;
+
+    if(make_room(fresh->len))
+    {
+        fresh->cached = true;
+        fresh->hash_next = g_buckets[bucket(key, format)];
+        g_buckets[bucket(key, format)] = fresh;
+        g_cached += fresh->len;
+    }
+
+    pthread_mutex_unlock(&g_lock);
+
+    return fresh;
+}
+
+/**
+ * Drops a reference; a page that is no longer in the table is freed with the
+ * last one.
+ */
+void autoindex_release(struct autoindex_page *page)
+{
+    pthread_mutex_lock(&g_lock);
+
+    bool unused = --page->refs == 0 && page->cached == false;
+
+    pthread_mutex_unlock(&g_lock);
+
+    if(unused)
+    {
+        free_page(page);
+    }
+}
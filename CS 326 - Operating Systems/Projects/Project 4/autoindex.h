@@ -0,0 +1,67 @@
+/**
+ * @file
+ *
+ * Directory listings for directories without an index.html. A listing is
+ * rendered (as HTML or JSON) once and kept in a process-wide table keyed by
+ * the directory's request path, identity and modification time, so repeated
+ * requests for a large directory cost one stat() instead of a scan and a
+ * sort. Adding, removing or renaming an entry changes the directory's
+ * modification time and so gets a fresh listing; the sizes and times shown
+ * for entries that are only rewritten in place catch up on the next such
+ * change.
+ */
+
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * What a directory without an index.html is answered with.
+ */
+enum autoindex_format {
+    /** 404 Not Found */
+    AUTOINDEX_OFF,
+
+    /** An HTML page linking to each entry */
+    AUTOINDEX_HTML,
+
+    /** A JSON array with the name, type, size and time of each entry */
+    AUTOINDEX_JSON,
+};
+
+/**
+ * A rendered listing. Valid until autoindex_release().
+ */
+struct autoindex_page {
+    /** Path of the directory below the document root, e.g. "/pub/" */
+    char *path;
+    enum autoindex_format format;
+
+    /** Identity and modification time of the directory when it was read */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+
+    /** The rendered body */
+    char *body;
+    size_t len;
+
+    /** Outstanding references from autoindex_acquire() */
+    int refs;
+
+    /** True while the page is in the table */
+    bool cached;
+
+    struct autoindex_page *hash_next;
+};
+
+int autoindex_parse_format(const char *name);
+struct autoindex_page *autoindex_acquire(int root_fd, const char *path,
+        enum autoindex_format format);
+void autoindex_release(struct autoindex_page *page);
+
+#endif
@@ -0,0 +1,512 @@
+/**
+ * @file
+ *
+ * HTTP load generator for comparing www builds and backends on loopback.
+ * Keeps a number of keep-alive connections busy with GET requests for a fixed
+ * amount of time and reports throughput and latency percentiles.
+ *
+ * Each path may carry a weight ("/small.bin:80"); every request picks a path
+ * at random in proportion to the weights. With -P, each connection keeps that
+ * many requests in flight (HTTP pipelining); latency is then measured from
+ * when a request was written to when its response was complete.
+ *
+ * Usage: loadgen [-c connections] [-d seconds] [-p port] [-P depth] [-q]
+ *                path[:weight]...
+ *
+ * With -q, a single summary line is printed instead of the report:
+ *     req/s MB/s p50_us p90_us p99_us p999_us max_us errors
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECV_BUF_LEN 65536
+
+/** Maximum number of distinct paths in the request mix */
+#define MAX_PATHS 32
+
+/** Maximum pipelining depth */
+#define MAX_DEPTH 64
+
+/** Latency histogram: log-linear, 16 buckets per power of two of ns */
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+/**
+ * A request in the mix, preformatted.
+ */
+struct request {
+    char text[1024];
+    size_t len;
+    unsigned weight;
+};
+
+/**
+ * State of one client connection.
+ */
+struct client {
+    int fd;
+
+    /** When each outstanding request was sent, oldest first (a ring) */
+    double sent_at[MAX_DEPTH];
+    int oldest;
+    int outstanding;
+
+    /** Response parsing: header bytes seen so far, body bytes left */
+    char header[4096];
+    size_t header_len;
+    bool in_body;
+    size_t body_left;
+
+    /** Whether the server asked to close the connection after this reply */
+    bool server_close;
+};
+
+static struct sockaddr_in g_addr;
+static struct request g_requests_mix[MAX_PATHS];
+static int g_num_paths = 0;
+static unsigned g_total_weight = 0;
+static int g_depth = 1;
+static int g_epoll_fd;
+
+static unsigned long g_requests = 0;
+static unsigned long g_errors = 0;
+static unsigned long long g_bytes = 0;
+static uint64_t g_histogram[HIST_BUCKETS];
+static uint64_t g_latency_max = 0;
+static double g_latency_sum = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bucket_index(uint64_t value)
+{
+    if(value < SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_value(int index)
+{
+    if(index < SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+
+    return (SUB_BUCKETS + sub) << (exponent - SUB_BITS);
+}
+
+static void record_latency(double seconds)
+{
+    uint64_t ns = seconds * 1e9;
+
+    g_histogram[bucket_index(ns)]++;
+    g_latency_sum += seconds;
+
+    if(ns > g_latency_max)
+    {
+        g_latency_max = ns;
+    }
+}
+
+/**
+ * Returns the latency (in microseconds) that a given fraction of requests
+ * did not exceed.
+ */
+static double percentile(double fraction)
+{
+    uint64_t target = g_requests * fraction;
+    uint64_t seen = 0;
+
+    if(target == 0)
+    {
+        target = 1;
+    }
+
+    for(int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += g_histogram[i];
+
+        if(seen >= target)
+        {
+            return bucket_value(i) / 1e3;
+        }
+    }
+
+    return g_latency_max / 1e3;
+}
+
+static const struct request *pick_request(void)
+{
+    unsigned ticket = rand() % g_total_weight;
+
+    for(int i = 0; i < g_num_paths; i++)
+    {
+        if(ticket < g_requests_mix[i].weight)
+        {
+            return &g_requests_mix[i];
+        }
+
+        ticket -= g_requests_mix[i].weight;
+    }
+
+    return &g_requests_mix[0];
+}
+
+/**
+ * Tops the connection up to the pipelining depth with one write.
+ */
+static int send_requests(struct client *c)
+{
+    char batch[MAX_DEPTH * 1024];
+    size_t len = 0;
+    double sent = now();
+
+    while(c->outstanding < g_depth)
+    {
+        const struct request *req = pick_request();
+
+        memcpy(batch + len, req->text, req->len);
+        len += req->len;
+        c->sent_at[(c->oldest + c->outstanding) % MAX_DEPTH] = sent;
+        c->outstanding++;
+    }
+
+    if(len > 0 && write(c->fd, batch, len) != (ssize_t) len)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int client_connect(struct client *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(c->fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(c->fd, (struct sockaddr *) &g_addr, sizeof(g_addr)) == -1)
+    {
+        perror("connect");
+        close(c->fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+
+    c->oldest = 0;
+    c->outstanding = 0;
+    c->header_len = 0;
+    c->in_body = false;
+    c->body_left = 0;
+    c->server_close = false;
+
+    return send_requests(c);
+}
+
+static void client_reconnect(struct client *c)
+{
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    if(client_connect(c) == -1)
+    {
+        g_errors++;
+    }
+}
+
+/**
+ * Parses the status line and headers of a response once they are complete.
+ */
+static void parse_header(struct client *c)
+{
+    c->header[c->header_len] = '\0';
+    c->body_left = 0;
+
+    if(strncmp(c->header, "HTTP/1.1 2", 10) != 0
+            && strncmp(c->header, "HTTP/1.1 3", 10) != 0)
+    {
+        g_errors++;
+    }
+
+    char *line = strstr(c->header, "\r\n");
+
+    while(line != NULL && line[2] != '\r')
+    {
+        line += 2;
+
+        if(strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            c->body_left = strtoull(line + 15, NULL, 10);
+        }
+
+        else if(strncasecmp(line, "Connection: close", 17) == 0)
+        {
+            c->server_close = true;
+        }
+
+        line = strstr(line, "\r\n");
+    }
+}
+
+/**
+ * Called when a response is complete.
+ *
+ * Returns:
+ *  - false if the connection was replaced and the rest of the data must be
+ *    thrown away
+ */
+static bool response_done(struct client *c)
+{
+    g_requests++;
+    record_latency(now() - c->sent_at[c->oldest]);
+    c->oldest = (c->oldest + 1) % MAX_DEPTH;
+    c->outstanding--;
+
+    if(c->server_close)
+    {
+        client_reconnect(c);
+        return false;
+    }
+
+    if(send_requests(c) == -1)
+    {
+        g_errors++;
+        client_reconnect(c);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Consumes response bytes, which may hold several pipelined responses.
+ */
+static void consume(struct client *c, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        if(c->in_body == false)
+        {
+            c->header[c->header_len++] = *data++;
+            len--;
+
+            if(c->header_len >= 4 && memcmp(c->header + c->header_len - 4,
+                        "\r\n\r\n", 4) == 0)
+            {
+                parse_header(c);
+                c->header_len = 0;
+                c->in_body = true;
+            }
+
+            else if(c->header_len == sizeof(c->header) - 1)
+            {
+                c->header_len = 0;
+                g_errors++;
+            }
+
+            if(c->in_body == false || c->body_left > 0)
+            {
+                continue;
+            }
+        }
+
+        size_t take = len < c->body_left ? len : c->body_left;
+
+        c->body_left -= take;
+        data += take;
+        len -= take;
+
+        if(c->body_left == 0)
+        {
+            c->in_body = false;
+
+            if(response_done(c) == false)
+            {
+                return;
+            }
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-p port] "
+            "[-P depth] [-q] path[:weight]...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int connections = 16;
+    int duration = 5;
+    int port = 8080;
+    bool quiet = false;
+    int opt;
+
+    while((opt = getopt(argc, argv, "c:d:p:P:q")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'P':
+                g_depth = atoi(optarg);
+                break;
+            case 'q':
+                quiet = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind == argc || argc - optind > MAX_PATHS || g_depth < 1
+            || g_depth > MAX_DEPTH)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for(int i = optind; i < argc; i++)
+    {
+        struct request *req = &g_requests_mix[g_num_paths++];
+        char *weight = strrchr(argv[i], ':');
+
+        req->weight = 1;
+
+        if(weight != NULL)
+        {
+            *weight = '\0';
+            req->weight = atoi(weight + 1);
+        }
+
+        req->len = snprintf(req->text, sizeof(req->text),
+                "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", argv[i]);
+        g_total_weight += req->weight;
+    }
+
+    if(g_total_weight == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &g_addr.sin_addr);
+
+    g_epoll_fd = epoll_create1(0);
+    srand(1);
+
+    struct client *clients = calloc(connections, sizeof(struct client));
+
+    for(int i = 0; i < connections; i++)
+    {
+        if(client_connect(&clients[i]) == -1)
+        {
+            return 1;
+        }
+    }
+
+    static char buf[RECV_BUF_LEN];
+    struct epoll_event events[256];
+    double start = now();
+    double end = start + duration;
+
+    while(now() < end)
+    {
+        int n = epoll_wait(g_epoll_fd, events, 256, 100);
+
+        for(int i = 0; i < n; i++)
+        {
+            struct client *c = events[i].data.ptr;
+            ssize_t got = read(c->fd, buf, sizeof(buf));
+
+            if(got <= 0)
+            {
+                if(got == -1 && errno == EAGAIN)
+                {
+                    continue;
+                }
+
+                g_errors++;
+                client_reconnect(c);
+                continue;
+            }
+
+            g_bytes += got;
+            consume(c, buf, got);
+        }
+    }
+
+    double elapsed = now() - start;
+    double mean = g_requests > 0 ? g_latency_sum / g_requests * 1e6 : 0.0;
+
+    if(quiet)
+    {
+        printf("%.0f %.2f %.1f %.1f %.1f %.1f %.1f %lu\n",
+                g_requests / elapsed, g_bytes / elapsed / (1024 * 1024),
+                percentile(0.5), percentile(0.9), percentile(0.99),
+                percentile(0.999), g_latency_max / 1e3, g_errors);
+        return 0;
+    }
+
+    printf("requests:   %lu\n", g_requests);
+    printf("errors:     %lu\n", g_errors);
+    printf("throughput: %.0f req/s, %.2f MB/s\n", g_requests / elapsed,
+            g_bytes / elapsed / (1024 * 1024));
+    printf("latency:    %.1f us mean, p50 %.1f, p90 %.1f, p99 %.1f, "
+            "p99.9 %.1f, max %.1f us\n", mean, percentile(0.5),
+            percentile(0.9), percentile(0.99), percentile(0.999),
+            g_latency_max / 1e3);
+
+    return 0;
+}
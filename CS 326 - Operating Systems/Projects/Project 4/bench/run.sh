@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+# Benchmark suite: serves a generated document root with bench/www (an -O2
+# build of the server with logging compiled out) on loopback, drives it with
+# bench/loadgen through a fixed set of scenarios, and compares the results
+# with the checked-in bench/baseline.txt.
+#
+# Usage: bench/run.sh [-b] [-d seconds] [-p port] [-- www flags...]
+#
+#   -b  write this run's results to bench/baseline.txt instead of comparing
+#
+# Anything after -- is passed to www (e.g. -- -w cores, or -- -u).
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+seconds=5
+port=8095
+update=false
+
+while getopts "bd:p:" opt; do
+    case $opt in
+        b) update=true ;;
+        d) seconds=$OPTARG ;;
+        p) port=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+[ "$1" = "--" ] && shift
+
+baseline=bench/baseline.txt
+results=$(mktemp)
+root=$(mktemp -d)
+server=
+
+trap 'kill $server 2> /dev/null || true; rm -rf "$root" "$results"' EXIT
+
+# Document root: one small text page, a medium and a large binary file
+mkdir -p "$root/assets"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$root/index.html"
+head -c $((64 * 1024)) /dev/urandom > "$root/assets/medium.bin"
+head -c $((4 * 1024 * 1024)) /dev/urandom > "$root/assets/large.bin"
+
+# name connections depth paths...
+scenarios=(
+    "small 32 1 /index.html"
+    "medium 32 1 /assets/medium.bin"
+    "large 8 1 /assets/large.bin"
+    "mix 32 1 /index.html:80 /assets/medium.bin:15 /assets/large.bin:5"
+    "pipelined 16 8 /index.html"
+)
+
+./bench/www -n 0 "$@" "$port" "$root" 2> /dev/null &
+server=$!
+sleep 0.5
+
+for scenario in "${scenarios[@]}"; do
+    read -r name connections depth paths <<< "$scenario"
+    # shellcheck disable=SC2086
+    line=$(./bench/loadgen -q -c "$connections" -P "$depth" -d "$seconds" \
+        -p "$port" $paths)
+    echo "$name $line" >> "$results"
+done
+
+if $update; then
+    {
+        echo "# scenario req/s MB/s p50_us p90_us p99_us p999_us max_us errors"
+        echo "# $(uname -m), $(nproc) cpu(s), -O2 -DLOGGER=0, www flags: -n 0${*:+ $*}"
+        cat "$results"
+    } > "$baseline"
+    cat "$baseline"
+    exit 0
+fi
+
+printf "%-10s %10s %10s %8s %10s %10s %8s\n" scenario "req/s" baseline \
+    change "p99 us" baseline change
+
+while read -r name rps _ _ _ p99 _ _ errors; do
+    base=$(grep "^$name " "$baseline" 2> /dev/null || true)
+    read -r _ base_rps _ _ _ base_p99 _ _ _ <<< "$base"
+
+    if [ -z "$base" ]; then
+        printf "%-10s %10s %10s %8s %10s %10s %8s\n" "$name" "$rps" - - \
+            "$p99" - -
+        continue
+    fi
+
+    awk -v n="$name" -v r="$rps" -v br="$base_rps" -v p="$p99" \
+        -v bp="$base_p99" -v e="$errors" 'BEGIN {
+        printf "%-10s %10d %10d %+7.1f%% %10.1f %10.1f %+7.1f%%%s\n",
+            n, r, br, (r - br) * 100 / br, p, bp, (p - bp) * 100 / bp,
+            (e > 0 ? "  (" e " errors)" : "")
+    }'
+done < "$results"
@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+# Compares the io_uring backend (-u) against the fork-per-connection
+# handle_request() path on loopback, for a small and a large file.
+#
+# Usage: bench/uring_vs_sync.sh [port] [seconds] [connections]
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+port=${1:-8090}
+seconds=${2:-5}
+connections=${3:-32}
+root=$(mktemp -d)
+
+trap 'kill $server 2> /dev/null || true; rm -rf "$root"' EXIT
+
+head -c 4096 /dev/urandom > "$root/small.bin"
+head -c $((1024 * 1024)) /dev/urandom > "$root/large.bin"
+
+for mode in sync uring; do
+    flags="-n 0"
+    [ "$mode" = uring ] && flags="$flags -u -C $((connections * 2))"
+
+    ./bench/www $flags "$port" "$root" 2> /dev/null &
+    server=$!
+    sleep 0.5
+
+    for file in small.bin large.bin; do
+        echo "== $mode /$file"
+        ./bench/loadgen -c "$connections" -d "$seconds" -p "$port" "/$file"
+    done
+
+    kill $server
+    wait $server 2> /dev/null || true
+    port=$((port + 1))
+done
@@ -0,0 +1,396 @@
+/**
+ * @file
+ *
+ * Buffered connection reader used by the request handler. See conn.h.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "httpparse.h"
+
+/** Most free input buffers kept per thread */
+#define CONN_BUF_POOL 64
+
+/** Free pooled buffers of this thread, linked through their first bytes */
+static __thread char *g_pool = NULL;
+static __thread int g_pool_len = 0;
+
+/**
+ * Attaches an empty buffer to a client socket.
+ *
+ * Inputs:
+ *  - cb: buffer to initialize
+ *  - fd: socket to read from
+ *  - data: CONN_BUF_SIZE bytes of storage, or NULL to take it from the
+ *    thread's pool when input arrives and give it back with conn_buf_trim()
+ *    whenever nothing is buffered
+ */
+void conn_buf_init(struct conn_buf *cb, int fd, char *data)
+{
+    cb->fd = fd;
+    cb->data = data;
+    cb->pooled = data == NULL;
+    cb->start = 0;
+    cb->end = 0;
+    cb->timeout_ms = 0;
+    cb->read_timeout_ms = 0;
+    cb->wake_fd = -1;
+    cb->discard = 0;
+    cb->scanned = 0;
+}
+
+/**
+ * Gives a pooled buffer back if nothing is buffered in it, so connections
+ * waiting for their next request hold no buffer.
+ */
+void conn_buf_trim(struct conn_buf *cb)
+{
+    if(cb->pooled && cb->data != NULL && cb->start == cb->end)
+    {
+        conn_buf_free(cb);
+    }
+}
+
+/**
+ * Gives a pooled buffer back, whatever it holds. Call when the connection is
+ * closed.
+ */
+void conn_buf_free(struct conn_buf *cb)
+{
+    if(cb->pooled == false || cb->data == NULL)
+    {
+        return;
+    }
+
+    if(g_pool_len < CONN_BUF_POOL)
+    {
+        memcpy(cb->data, &g_pool, sizeof(g_pool));
+        g_pool = cb->data;
+        g_pool_len++;
+    }
+
+    else
+    {
+        free(cb->data);
+    }
+
+    cb->data = NULL;
+    cb->start = 0;
+    cb->end = 0;
+    cb->scanned = 0;
+}
+
+/**
+ * Returns the number of buffered bytes that have not been consumed yet.
+ */
+size_t conn_buf_pending(const struct conn_buf *cb)
+{
+    return cb->end - cb->start;
+}
+
+/**
+ * Returns true if the socket has input that has not been read into the
+ * buffer yet. Never blocks.
+ */
+bool conn_buf_unread(const struct conn_buf *cb)
+{
+    char byte;
+
+    return recv(cb->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/**
+ * Marks *len* buffered bytes as consumed. Pointers handed out by
+ * conn_buf_take_headers() and conn_buf_read_headers() stay valid until the
+ * next call to conn_buf_fill().
+ */
+void conn_buf_consume(struct conn_buf *cb, size_t len)
+{
+    cb->start += len;
+    cb->scanned = 0;
+
+    if(cb->start >= cb->end)
+    {
+        cb->start = 0;
+        cb->end = 0;
+    }
+}
+
+/**
+ * Moves unconsumed bytes to the front of the buffer and returns the free
+ * space after them, for callers that read into the buffer themselves (e.g.
+ * through io_uring). Follow up with conn_buf_commit().
+ *
+ * Inputs:
+ *  - cb: connection buffer
+ *  - space: set to the start of the free space
+ *
+ * Returns:
+ *  - Number of free bytes (0 if the buffer is full, or if no pooled buffer
+ *    could be had)
+ */
+size_t conn_buf_reserve(struct conn_buf *cb, char **space)
+{
+    if(cb->data == NULL)
+    {
+        if(g_pool != NULL)
+        {
+            cb->data = g_pool;
+            memcpy(&g_pool, g_pool, sizeof(g_pool));
+            g_pool_len--;
+        }
+
+        else if((cb->data = malloc(CONN_BUF_SIZE)) == NULL)
+        {
+            *space = NULL;
+            return 0;
+        }
+    }
+
+    if(cb->start > 0)
+    {
+        memmove(cb->data, cb->data + cb->start, cb->end - cb->start);
+        cb->end -= cb->start;
+        cb->start = 0;
+    }
+
+    *space = cb->data + cb->end;
+
+    return CONN_BUF_SIZE - cb->end;
+}
+
+/**
+ * Accounts for *len* bytes that were placed in the space returned by
+ * conn_buf_reserve(). Bytes owed to conn_buf_discard() are dropped here.
+ */
+void conn_buf_commit(struct conn_buf *cb, size_t len)
+{
+    cb->end += len;
+
+    if(cb->discard > 0)
+    {
+        size_t drop = cb->discard < len ? cb->discard : len;
+
+        /* Only freshly read bytes can be owed, and they sit at the end */
+        memmove(cb->data + cb->end - len, cb->data + cb->end - len + drop,
+                len - drop);
+        cb->end -= drop;
+        cb->discard -= drop;
+    }
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * conn_buf_fill() with an explicit timeout in milliseconds (zero or less
+ * waits forever).
+ */
+static ssize_t fill_within(struct conn_buf *cb, int timeout_ms)
+{
+    char *space;
+    size_t free_space = conn_buf_reserve(cb, &space);
+
+    if(free_space == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Only wake up early between requests */
+    bool wakeable = cb->wake_fd != -1 && conn_buf_pending(cb) == 0
+        && cb->discard == 0;
+
+    if(timeout_ms > 0 || wakeable)
+    {
+        struct pollfd pfds[2] = {
+            { .fd = cb->fd, .events = POLLIN },
+            { .fd = cb->wake_fd, .events = POLLIN },
+        };
+        int ready;
+
+        do
+        {
+            ready = poll(pfds, wakeable ? 2 : 1,
+                    timeout_ms > 0 ? timeout_ms : -1);
+        }
+        while(ready == -1 && errno == EINTR);
+
+        if(ready == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        if(wakeable && pfds[0].revents == 0 && pfds[1].revents != 0)
+        {
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+
+    ssize_t read_size;
+
+    do
+    {
+        read_size = read(cb->fd, space, free_space);
+    }
+    while(read_size == -1 && errno == EINTR);
+
+    if(read_size > 0)
+    {
+        conn_buf_commit(cb, read_size);
+    }
+
+    return read_size;
+}
+
+/**
+ * Reads as much as the socket has available (up to the free space in the
+ * buffer) with a single read() call.
+ *
+ * If the buffer has a timeout set, waits at most that long for the socket to
+ * become readable.
+ *
+ * Returns:
+ *  - Number of bytes read;
+ *  - -1 on read failure, if the buffer is already full (errno = ENOBUFS), if
+ *    the timeout expired (errno = ETIMEDOUT) or if the wake descriptor
+ *    became readable while no request was under way (errno = ECANCELED)
+ *  - 0 on EOF
+ */
+ssize_t conn_buf_fill(struct conn_buf *cb)
+{
+    return fill_within(cb, cb->timeout_ms);
+}
+
+/**
+ * Throws away the next *len* bytes of input (e.g. a request body that is not
+ * used): buffered bytes right away, the rest as they arrive.
+ */
+void conn_buf_discard(struct conn_buf *cb, size_t len)
+{
+    size_t pending = conn_buf_pending(cb);
+
+    if(len <= pending)
+    {
+        conn_buf_consume(cb, len);
+        return;
+    }
+
+    conn_buf_consume(cb, pending);
+    cb->discard = len - pending;
+}
+
+/**
+ * Hands out a complete header block (request line and headers, up to and
+ * including the terminating empty line) if one is already buffered. The block
+ * is consumed; bytes after it remain buffered for the next request. Bytes
+ * examined by an earlier unsuccessful call are not scanned again. Never reads
+ * from the socket.
+ *
+ * Inputs:
+ *  - cb: connection buffer
+ *  - block: set to the start of the header block inside the buffer
+ *
+ * Returns:
+ *  - Length of the header block, or 0 if no complete block is buffered
+ */
+size_t conn_buf_take_headers(struct conn_buf *cb, char **block)
+{
+    if(cb->data == NULL)
+    {
+        return 0;
+    }
+
+    char *start = cb->data + cb->start;
+    size_t len = http_find_header_end(start, cb->end - cb->start,
+            &cb->scanned);
+
+    if(len > 0)
+    {
+        *block = start;
+        conn_buf_consume(cb, len);
+    }
+
+    return len;
+}
+
+/**
+ * Like conn_buf_take_headers(), but reads from the socket until a complete
+ * header block is buffered. The buffer's timeout applies while nothing is
+ * buffered; once part of a block is, its read timeout also bounds the time
+ * until the whole block is in.
+ *
+ * Inputs:
+ *  - cb: connection buffer
+ *  - block: set to the start of the header block inside the buffer
+ *
+ * Returns:
+ *  - Length of the header block;
+ *  - -1 on read failure, if the headers do not fit in the buffer, if a
+ *    timeout expired (errno = ETIMEDOUT) or if the wake descriptor fired
+ *    before the block started (errno = ECANCELED)
+ *  - 0 on EOF
+ */
+ssize_t conn_buf_read_headers(struct conn_buf *cb, char **block)
+{
+    int64_t deadline = 0;
+
+    while(true)
+    {
+        size_t len = conn_buf_take_headers(cb, block);
+
+        if(len > 0)
+        {
+            return len;
+        }
+
+        int timeout_ms = cb->timeout_ms;
+
+        if(cb->read_timeout_ms > 0
+                && (conn_buf_pending(cb) > 0 || cb->discard > 0))
+        {
+            int64_t now = now_ms();
+
+            if(deadline == 0)
+            {
+                deadline = now + cb->read_timeout_ms;
+            }
+
+            if(now >= deadline)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            if(timeout_ms <= 0 || deadline - now < timeout_ms)
+            {
+                timeout_ms = deadline - now;
+            }
+        }
+
+        ssize_t read_size = fill_within(cb, timeout_ms);
+
+        if(read_size <= 0)
+        {
+            return read_size;
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file
+ *
+ * Per-connection input buffering. Instead of issuing one read() per byte, the
+ * connection reads large chunks into a buffer and hands out complete header
+ * blocks from it. Any bytes that belong to a following (pipelined) request
+ * stay in the buffer for the next call.
+ *
+ * The storage is either the caller's (the io_uring loop registers it with
+ * the kernel) or taken from a per-thread pool only while bytes are buffered,
+ * so that connections waiting for their next request hold none.
+ */
+
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Capacity of the per-connection input buffer (also the max header size) */
+#define CONN_BUF_SIZE 16384
+
+/**
+ * Buffered reader attached to a client socket. Valid data lives in
+ * data[start, end); everything before start has already been consumed.
+ */
+struct conn_buf {
+    /** Socket the buffer reads from */
+    int fd;
+
+    /** Offset of the first unconsumed byte */
+    size_t start;
+
+    /** Offset one past the last valid byte */
+    size_t end;
+
+    /**
+     * How long conn_buf_fill() waits for data before giving up with
+     * ETIMEDOUT, in milliseconds. Zero or less waits forever.
+     */
+    int timeout_ms;
+
+    /**
+     * How long conn_buf_read_headers() allows for the rest of a header block
+     * to arrive once part of it is buffered, in milliseconds, however the
+     * bytes trickle in. Zero or less allows any amount of time.
+     */
+    int read_timeout_ms;
+
+    /**
+     * Descriptor that ends the wait for a new request (with ECANCELED) once
+     * it becomes readable, or -1. A request already under way is unaffected.
+     */
+    int wake_fd;
+
+    /** Incoming bytes still to be thrown away (an unused request body) */
+    size_t discard;
+
+    /** How far past start the search for the end of the headers has got */
+    size_t scanned;
+
+    /** Raw bytes read from the socket (CONN_BUF_SIZE of them); NULL while a
+     * pooled buffer is not attached */
+    char *data;
+
+    /** True if *data* comes from (and goes back to) the thread's pool */
+    bool pooled;
+};
+
+void conn_buf_init(struct conn_buf *cb, int fd, char *data);
+void conn_buf_trim(struct conn_buf *cb);
+void conn_buf_free(struct conn_buf *cb);
+ssize_t conn_buf_fill(struct conn_buf *cb);
+size_t conn_buf_reserve(struct conn_buf *cb, char **space);
+void conn_buf_commit(struct conn_buf *cb, size_t len);
+size_t conn_buf_pending(const struct conn_buf *cb);
+bool conn_buf_unread(const struct conn_buf *cb);
+void conn_buf_consume(struct conn_buf *cb, size_t len);
+void conn_buf_discard(struct conn_buf *cb, size_t len);
+size_t conn_buf_take_headers(struct conn_buf *cb, char **block);
+ssize_t conn_buf_read_headers(struct conn_buf *cb, char **block);
+
+#endif
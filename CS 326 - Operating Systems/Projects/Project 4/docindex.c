@@ -0,0 +1,848 @@
+/**
+ * @file
+ *
+ * Document root index. See docindex.h.
+ *
+ * Keys are canonical paths relative to the root: no leading "./", no empty,
+ * "." or trailing components, and "" for the root itself. Every directory
+ * that was walked has an inotify watch, and the watcher thread applies each
+ * event to the table under the write lock; lookups take the read lock and
+ * copy out what they need. When the event queue overflows, the whole index
+ * is rebuilt.
+ *
+ * A path that is not in the table is known to be missing if its nearest
+ * ancestor in the table is a walked directory (or a file). Symbolic links
+ * are recorded but not followed, so paths through them fall back to the file
+ * system, which also keeps the walk from looping.
+ *
+ * A process forked from the server (one per connection) gets a copy of the
+ * table that the watcher no longer updates, so the child stops using it.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "docindex.h"
+#include "logger.h"
+
+/** Give up on indexing document roots larger than this */
+#define DOCINDEX_MAX_ENTRIES (1024 * 1024)
+
+/** Longest canonical path kept */
+#define DOCINDEX_PATH_MAX 4096
+
+/** Events the watcher follows in each directory */
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+        | IN_CLOSE_WRITE | IN_ATTRIB | IN_MODIFY | IN_ONLYDIR)
+
+struct index_entry {
+    char *path;
+
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    mode_t mode;
+
+    /** A symbolic link: lookups through it go to the file system */
+    bool link;
+
+    /** A directory whose contents are in the index (and watched) */
+    bool walked;
+
+    struct index_entry *next;
+};
+
+static struct {
+    /** False until the first build succeeds, and in forked children */
+    bool enabled;
+
+    int root_fd;
+    int inotify_fd;
+    int stop_fd;
+    pthread_t watcher;
+    bool watching;
+
+    pthread_rwlock_t lock;
+
+    /** Hash buckets (a power of two) */
+    struct index_entry **buckets;
+    size_t num_buckets;
+    size_t count;
+
+    /** Directory of each watch descriptor, indexed by descriptor */
+    char **watches;
+    int num_watches;
+} g_index = {
+    .root_fd = -1,
+    .inotify_fd = -1,
+    .stop_fd = -1,
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/**
+ * FNV-1a hash of a NUL-terminated string.
+ */
+static uint64_t hash_str(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*str != '\0')
+    {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static struct index_entry *find(const char *path)
+{
+    struct index_entry *entry;
+
+    entry = g_index.buckets[hash_str(path) & (g_index.num_buckets - 1)];
+
+    while(entry != NULL && strcmp(entry->path, path) != 0)
+    {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+static bool grow(void)
+{
+    size_t num_buckets = g_index.num_buckets * 2;
+    struct index_entry **buckets = calloc(num_buckets,
+            sizeof(struct index_entry *));
+
+    if(buckets == NULL)
+    {
+        return false;
+    }
+
+    for(size_t i = 0; i < g_index.num_buckets; i++)
+    {
+        struct index_entry *entry = g_index.buckets[i];
+
+        while(entry != NULL)
+        {
+            struct index_entry *next = entry->next;
+            size_t bucket = hash_str(entry->path) & (num_buckets - 1);
+
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(g_index.buckets);
+    g_index.buckets = buckets;
+    g_index.num_buckets = num_buckets;
+
+    return true;
+}
+
+/**
+ * Adds or updates the entry for *path*.
+ *
+ * Returns:
+ *  - The entry, or NULL if the index is full or memory is short
+ */
+static struct index_entry *put(const char *path, const struct stat *st,
+        bool link)
+{
+    struct index_entry *entry = find(path);
+
+    if(entry == NULL)
+    {
+        if(g_index.count == DOCINDEX_MAX_ENTRIES)
+        {
+            return NULL;
+        }
+
+        if(g_index.count >= g_index.num_buckets && grow() == false)
+        {
+            return NULL;
+        }
+
+        entry = calloc(1, sizeof(struct index_entry));
+
+        if(entry == NULL || (entry->path = strdup(path)) == NULL)
+        {
+            free(entry);
+            return NULL;
+        }
+
+        size_t bucket = hash_str(path) & (g_index.num_buckets - 1);
+
+        entry->next = g_index.buckets[bucket];
+        g_index.buckets[bucket] = entry;
+        g_index.count++;
+    }
+
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->mode = st->st_mode;
+    entry->link = link;
+
+    return entry;
+}
+
+/**
+ * Removes *path* and, if it is a directory, everything below it.
+ */
+static void remove_tree(const char *path)
+{
+    size_t len = strlen(path);
+
+    for(size_t i = 0; i < g_index.num_buckets; i++)
+    {
+        struct index_entry **link = &g_index.buckets[i];
+
+        while(*link != NULL)
+        {
+            struct index_entry *entry = *link;
+            bool below = strncmp(entry->path, path, len) == 0
+                && (entry->path[len] == '\0'
+                    || (entry->path[len] == '/' && len > 0));
+
+            if(below)
+            {
+                *link = entry->next;
+                g_index.count--;
+                free(entry->path);
+                free(entry);
+            }
+
+            else
+            {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+static void clear(void)
+{
+    for(size_t i = 0; i < g_index.num_buckets; i++)
+    {
+        struct index_entry *entry = g_index.buckets[i];
+
+        while(entry != NULL)
+        {
+            struct index_entry *next = entry->next;
+
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+
+        g_index.buckets[i] = NULL;
+    }
+
+    g_index.count = 0;
+
+    for(int i = 0; i < g_index.num_watches; i++)
+    {
+        if(g_index.watches[i] != NULL)
+        {
+            inotify_rm_watch(g_index.inotify_fd, i);
+            free(g_index.watches[i]);
+            g_index.watches[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Joins a directory path and a name into a canonical path.
+ */
+static bool join(char *buf, const char *dir, const char *name)
+{
+    int len = snprintf(buf, DOCINDEX_PATH_MAX, "%s%s%s", dir,
+            dir[0] != '\0' ? "/" : "", name);
+
+    return len >= 0 && len < DOCINDEX_PATH_MAX;
+}
+
+/**
+ * Starts watching a directory of the index.
+ */
+static bool watch(const char *dir)
+{
+    char path[DOCINDEX_PATH_MAX + 32];
+
+    /* inotify takes a path; go through the root's descriptor if the root is
+     * not the working directory */
+    if(g_index.root_fd == AT_FDCWD)
+    {
+        snprintf(path, sizeof(path), "./%s", dir);
+    }
+
+    else
+    {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", g_index.root_fd,
+            dir);
+    }
+
+    int wd = inotify_add_watch(g_index.inotify_fd, path, WATCH_EVENTS);
+
+    if(wd == -1)
+    {
+        perror("inotify_add_watch");
+        return false;
+    }
+
+    if(wd >= g_index.num_watches)
+    {
+        int num_watches = g_index.num_watches > 0 ? g_index.num_watches : 64;
+
+        while(num_watches <= wd)
+        {
+            num_watches *= 2;
+        }
+
+        char **watches = realloc(g_index.watches,
+                num_watches * sizeof(char *));
+
+        if(watches == NULL)
+        {
+            return false;
+        }
+
+        memset(watches + g_index.num_watches, 0,
+            (num_watches - g_index.num_watches) * sizeof(char *));
+        g_index.watches = watches;
+        g_index.num_watches = num_watches;
+    }
+
+    /* A directory moved within the root keeps its watch descriptor */
+    free(g_index.watches[wd]);
+    g_index.watches[wd] = strdup(dir);
+
+    return g_index.watches[wd] != NULL;
+}
+
+static bool add_path(const char *path);
+
+/**
+ * Indexes the contents of a directory that is already in the table, and
+ * everything below it.
+ */
+static bool walk(struct index_entry *dir)
+{
+    char path[DOCINDEX_PATH_MAX];
+    int fd = openat(g_index.root_fd, dir->path[0] != '\0' ? dir->path : ".",
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if(fd == -1)
+    {
+        /* Unreadable: leave it to the file system */
+        return true;
+    }
+
+    /* Watch before reading, so nothing created meanwhile is missed */
+    if(watch(dir->path) == false)
+    {
+        close(fd);
+        return false;
+    }
+
+    DIR *d = fdopendir(fd);
+
+    if(d == NULL)
+    {
+        close(fd);
+        return false;
+    }
+
+    struct dirent *ent;
+    bool ok = true;
+
+    dir->walked = true;
+
+    while(ok && (ent = readdir(d)) != NULL)
+    {
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        ok = join(path, dir->path, ent->d_name) == false || add_path(path);
+    }
+
+    closedir(d);
+
+    return ok;
+}
+
+/**
+ * Indexes (or re-indexes) one path, walking it if it is a new directory.
+ *
+ * Returns:
+ *  - false if the index could not take it
+ */
+static bool add_path(const char *path)
+{
+    struct stat st;
+    bool link = false;
+
+    if(fstatat(g_index.root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        /* Gone again already; a later event will say so */
+        remove_tree(path);
+        return true;
+    }
+
+    if(S_ISLNK(st.st_mode))
+    {
+        link = true;
+
+        if(fstatat(g_index.root_fd, path, &st, 0) == -1)
+        {
+            memset(&st, 0, sizeof(st));
+        }
+    }
+
+    struct index_entry *old = find(path);
+    bool is_dir = link == false && S_ISDIR(st.st_mode);
+
+    /* A directory replaced by something else takes its contents along */
+    if(old != NULL && old->walked && is_dir == false)
+    {
+        remove_tree(path);
+        old = NULL;
+    }
+
+    bool was_walked = old != NULL && old->walked;
+    struct index_entry *entry = put(path, &st, link);
+
+    if(entry == NULL)
+    {
+        LOGP("Document root index is full\n");
+        return false;
+    }
+
+    if(is_dir == false || was_walked)
+    {
+        return true;
+    }
+
+    return walk(entry);
+}
+
+/**
+ * Builds the whole index from the root down.
+ */
+static bool build(void)
+{
+    struct stat st;
+
+    clear();
+
+    if(fstatat(g_index.root_fd, ".", &st, 0) == -1)
+    {
+        perror("stat");
+        return false;
+    }
+
+    struct index_entry *root = put("", &st, false);
+
+    return root != NULL && walk(root);
+}
+
+/**
+ * Applies one inotify event to the table.
+ */
+static bool apply_event(const struct inotify_event *event)
+{
+    if(event->mask & IN_Q_OVERFLOW)
+    {
+        LOGP("inotify queue overflowed; rebuilding the document root index\n");
+        return build();
+    }
+
+    if(event->wd < 0 || event->wd >= g_index.num_watches
+            || g_index.watches[event->wd] == NULL)
+    {
+        return true;
+    }
+
+    if(event->mask & IN_IGNORED)
+    {
+        free(g_index.watches[event->wd]);
+        g_index.watches[event->wd] = NULL;
+        return true;
+    }
+
+    char path[DOCINDEX_PATH_MAX];
+    const char *dir = g_index.watches[event->wd];
+
+    /* Events without a name are about the watched directory itself */
+    if(event->len == 0)
+    {
+        struct index_entry *entry = find(dir);
+        struct stat st;
+
+        if(entry != NULL && fstatat(g_index.root_fd,
+                    dir[0] != '\0' ? dir : ".", &st, 0) == 0)
+        {
+            entry->mtime = st.st_mtime;
+        }
+
+        return true;
+    }
+
+    if(join(path, dir, event->name) == false)
+    {
+        return true;
+    }
+
+    if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        remove_tree(path);
+        return true;
+    }
+
+    return add_path(path);
+}
+
+static void *watcher_main(void *arg)
+{
+    char buf[64 * 1024]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = g_index.inotify_fd, .events = POLLIN },
+        { .fd = g_index.stop_fd, .events = POLLIN },
+    };
+
+    (void) arg;
+
+    while(true)
+    {
+        if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("poll");
+            break;
+        }
+
+        if(fds[1].revents != 0)
+        {
+            break;
+        }
+
+        ssize_t len = read(g_index.inotify_fd, buf, sizeof(buf));
+
+        if(len <= 0)
+        {
+            continue;
+        }
+
+        pthread_rwlock_wrlock(&g_index.lock);
+
+        for(char *p = buf; p < buf + len; )
+        {
+            const struct inotify_event *event = (struct inotify_event *) p;
+
+            if(apply_event(event) == false)
+            {
+                LOGP("Document root index disabled\n");
+                g_index.enabled = false;
+            }
+
+            p += sizeof(struct inotify_event) + event->len;
+        }
+
+        pthread_rwlock_unlock(&g_index.lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * The copy of the table in a forked child would never see another update.
+ */
+static void atfork_child(void)
+{
+    g_index.enabled = false;
+}
+
+/**
+ * Walks the document root into the index and starts following changes to
+ * it. Call before serving starts; on failure, lookups keep using the file
+ * system.
+ *
+ * Inputs:
+ *  - root_fd: document root (AT_FDCWD for the working directory)
+ *
+ * Returns:
+ *  - true if the index is in use
+ */
+bool docindex_start(int root_fd)
+{
+    static bool atfork_registered = false;
+
+    g_index.root_fd = root_fd;
+    g_index.num_buckets = 1024;
+    g_index.buckets = calloc(g_index.num_buckets,
+            sizeof(struct index_entry *));
+    g_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    g_index.stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    if(g_index.buckets == NULL || g_index.inotify_fd == -1
+            || g_index.stop_fd == -1)
+    {
+        perror("docindex_start");
+        docindex_stop();
+        return false;
+    }
+
+    if(build() == false)
+    {
+        LOGP("Could not index the document root\n");
+        docindex_stop();
+        return false;
+    }
+
+    if(pthread_create(&g_index.watcher, NULL, watcher_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        docindex_stop();
+        return false;
+    }
+
+    g_index.watching = true;
+
+    if(atfork_registered == false)
+    {
+        pthread_atfork(NULL, NULL, atfork_child);
+        atfork_registered = true;
+    }
+
+    LOG("Indexed %zu paths under the document root\n", g_index.count);
+    g_index.enabled = true;
+
+    return true;
+}
+
+/**
+ * Stops following changes and frees the index; lookups go back to the file
+ * system.
+ */
+void docindex_stop(void)
+{
+    g_index.enabled = false;
+
+    if(g_index.watching)
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(g_index.stop_fd, &one, sizeof(one));
+
+        (void) ret;
+        pthread_join(g_index.watcher, NULL);
+        g_index.watching = false;
+    }
+
+    if(g_index.buckets != NULL)
+    {
+        clear();
+    }
+
+    free(g_index.buckets);
+    free(g_index.watches);
+    g_index.buckets = NULL;
+    g_index.watches = NULL;
+    g_index.num_buckets = 0;
+    g_index.num_watches = 0;
+
+    if(g_index.inotify_fd != -1)
+    {
+        close(g_index.inotify_fd);
+        g_index.inotify_fd = -1;
+    }
+
+    if(g_index.stop_fd != -1)
+    {
+        close(g_index.stop_fd);
+        g_index.stop_fd = -1;
+    }
+}
+
+/**
+ * Canonicalizes a request path ("./a//b/" -> "a/b").
+ *
+ * Returns:
+ *  - false if the path has ".." components or is too long
+ */
+static bool canonicalize(const char *path, char *buf)
+{
+    size_t len = 0;
+
+    while(*path != '\0')
+    {
+        const char *end = strchrnul(path, '/');
+        size_t n = end - path;
+
+        if(n == 2 && path[0] == '.' && path[1] == '.')
+        {
+            return false;
+        }
+
+        if(n > 0 && (n != 1 || path[0] != '.'))
+        {
+            if(len + n + 2 > DOCINDEX_PATH_MAX)
+            {
+                return false;
+            }
+
+            if(len > 0)
+            {
+                buf[len++] = '/';
+            }
+
+            memcpy(buf + len, path, n);
+            len += n;
+        }
+
+        path = *end == '/' ? end + 1 : end;
+    }
+
+    buf[len] = '\0';
+
+    return true;
+}
+
+/**
+ * What can be said about a path that is not in the table, from its nearest
+ * ancestor that is.
+ */
+static enum docindex_result missing(char *path)
+{
+    while(path[0] != '\0')
+    {
+        char *slash = strrchr(path, '/');
+
+        if(slash != NULL)
+        {
+            *slash = '\0';
+        }
+
+        else
+        {
+            path[0] = '\0';
+        }
+
+        const struct index_entry *entry = find(path);
+
+        if(entry != NULL)
+        {
+            if(entry->link)
+            {
+                return DOCINDEX_UNKNOWN;
+            }
+
+            return S_ISDIR(entry->mode) == false || entry->walked
+                ? DOCINDEX_MISSING : DOCINDEX_UNKNOWN;
+        }
+    }
+
+    return DOCINDEX_UNKNOWN;
+}
+
+static void fill_stat(const struct index_entry *entry, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = entry->dev;
+    st->st_ino = entry->ino;
+    st->st_size = entry->size;
+    st->st_mtime = entry->mtime;
+    st->st_mode = entry->mode;
+}
+
+/**
+ * Resolves a request path through the index, applying the directory ->
+ * index.html fallback the way the file system lookup does.
+ *
+ * Inputs:
+ *  - path: request path, relative to the document root
+ *  - resolved: receives the path of the file to serve (DOCINDEX_FOUND)
+ *  - length: capacity of *resolved*
+ *  - st: receives the file's metadata (DOCINDEX_FOUND)
+ *
+ * Returns:
+ *  - DOCINDEX_FOUND, DOCINDEX_MISSING, or DOCINDEX_UNKNOWN if the index is
+ *    not in use or cannot answer for the path
+ */
+enum docindex_result docindex_lookup(const char *path, char *resolved,
+        size_t length, struct stat *st)
+{
+    char key[DOCINDEX_PATH_MAX + sizeof("/index.html")];
+    enum docindex_result result = DOCINDEX_MISSING;
+
+    if(g_index.enabled == false || canonicalize(path, key) == false)
+    {
+        return DOCINDEX_UNKNOWN;
+    }
+
+    pthread_rwlock_rdlock(&g_index.lock);
+
+    if(g_index.enabled == false)
+    {
+        pthread_rwlock_unlock(&g_index.lock);
+        return DOCINDEX_UNKNOWN;
+    }
+
+    const struct index_entry *entry = find(key);
+
+    if(entry != NULL && entry->link == false && S_ISDIR(entry->mode))
+    {
+        if(entry->walked == false)
+        {
+            pthread_rwlock_unlock(&g_index.lock);
+            return DOCINDEX_UNKNOWN;
+        }
+
+        strcat(key, key[0] != '\0' ? "/index.html" : "index.html");
+        entry = find(key);
+    }
+
+    if(entry == NULL)
+    {
+        result = missing(key);
+    }
+
+    else if(entry->link)
+    {
+        result = DOCINDEX_UNKNOWN;
+    }
+
+    else if(S_ISREG(entry->mode)
+            && snprintf(resolved, length, "./%s", key) < (int) length)
+    {
+        fill_stat(entry, st);
+        result = DOCINDEX_FOUND;
+    }
+
+    pthread_rwlock_unlock(&g_index.lock);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file
+ *
+ * In-memory index of the document root. When enabled, the root is walked
+ * once at startup into a hash table from path to file metadata, and kept
+ * current by a thread that follows inotify events. The open-file cache then
+ * resolves request paths (including the directory -> index.html fallback)
+ * with hash probes instead of stat() calls, and answers paths that do not
+ * exist without touching the file system at all.
+ *
+ * Paths the index cannot vouch for, such as those through symbolic links or
+ * with ".." components, are left to the file system.
+ */
+
+#ifndef DOCINDEX_H
+#define DOCINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * Outcome of an index lookup.
+ */
+enum docindex_result {
+    /** The path resolves to a regular file */
+    DOCINDEX_FOUND,
+
+    /** Nothing can be served for the path */
+    DOCINDEX_MISSING,
+
+    /** The index does not know; ask the file system */
+    DOCINDEX_UNKNOWN,
+};
+
+bool docindex_start(int root_fd);
+void docindex_stop(void);
+enum docindex_result docindex_lookup(const char *path, char *resolved,
+        size_t length, struct stat *st);
+
+#endif
@@ -0,0 +1,407 @@
+/**
+ * @file
+ *
+ * Open-file cache used by the request handler. See fcache.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "docindex.h"
+#include "fcache.h"
+#include "logger.h"
+
+/**
+ * FNV-1a hash of a NUL-terminated string.
+ */
+static uint64_t hash_str(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*str != '\0')
+    {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Creates an empty cache.
+ *
+ * Inputs:
+ *  - capacity: maximum number of open files to keep (0 disables caching;
+ *    lookups then open the file every time)
+ *  - ttl: seconds before a cached entry is revalidated with stat()
+ *  - root_fd: directory request paths are looked up in (AT_FDCWD for the
+ *    working directory)
+ *
+ * Returns:
+ *  - The new cache, or NULL if memory could not be allocated
+ */
+struct fcache *fcache_create(size_t capacity, int ttl, int root_fd)
+{
+    struct fcache *cache = calloc(1, sizeof(struct fcache));
+
+    if(cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->capacity = capacity;
+    cache->ttl = ttl;
+    cache->root_fd = root_fd;
+    cache->num_buckets = 16;
+
+    while(cache->num_buckets < capacity * 2)
+    {
+        cache->num_buckets *= 2;
+    }
+
+    cache->buckets = calloc(cache->num_buckets, sizeof(struct fcache_entry *));
+
+    if(cache->buckets == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static void free_entry(struct fcache_entry *entry)
+{
+    if(entry->map != NULL)
+    {
+        fmap_release(entry->map);
+    }
+
+    close(entry->fd);
+    free(entry->key);
+    free(entry->path);
+    free(entry);
+}
+
+static void lru_remove(struct fcache *cache, struct fcache_entry *entry)
+{
+    if(entry->lru_prev != NULL)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if(entry->lru_next != NULL)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct fcache *cache, struct fcache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+
+    if(cache->lru_head != NULL)
+    {
+        cache->lru_head->lru_prev = entry;
+    }
+
+    cache->lru_head = entry;
+
+    if(cache->lru_tail == NULL)
+    {
+        cache->lru_tail = entry;
+    }
+}
+
+/**
+ * Removes an entry from the hash table and LRU list. The entry itself is
+ * freed right away unless a caller still holds a reference to it.
+ */
+static void unlink_entry(struct fcache *cache, struct fcache_entry *entry)
+{
+    size_t bucket = hash_str(entry->key) & (cache->num_buckets - 1);
+    struct fcache_entry **link = &cache->buckets[bucket];
+
+    while(*link != NULL && *link != entry)
+    {
+        link = &(*link)->hash_next;
+    }
+
+    if(*link == entry)
+    {
+        *link = entry->hash_next;
+    }
+
+    lru_remove(cache, entry);
+    cache->count--;
+    entry->unlinked = true;
+
+    if(entry->refs == 0)
+    {
+        free_entry(entry);
+    }
+}
+
+/**
+ * Resolves a request path to the file that should be served, applying the
+ * directory -> index.html fallback. The document root index answers if it
+ * can; otherwise the file system is asked.
+ *
+ * Inputs:
+ *  - root_fd: document root
+ *  - path: request path (relative to the document root)
+ *  - resolved: receives the path of the file to serve
+ *  - length: capacity of *resolved*
+ *  - st: receives the file's metadata
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if there is nothing to serve (errno is set)
+ */
+static int resolve(int root_fd, const char *path, char *resolved,
+        size_t length, struct stat *st)
+{
+    switch(docindex_lookup(path, resolved, length, st))
+    {
+        case DOCINDEX_FOUND:
+            return 0;
+        case DOCINDEX_MISSING:
+            errno = ENOENT;
+            return -1;
+        case DOCINDEX_UNKNOWN:
+            break;
+    }
+
+    if(fstatat(root_fd, path, st, 0) == -1)
+    {
+        return -1;
+    }
+
+    if(S_ISDIR(st->st_mode))
+    {
+        if(snprintf(resolved, length, "%s/index.html", path) >= length)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        if(fstatat(root_fd, resolved, st, 0) == -1)
+        {
+            return -1;
+        }
+    }
+
+    else if(snprintf(resolved, length, "%s", path) >= length)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if(S_ISREG(st->st_mode) == false)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool same_file(const struct fcache_entry *entry, const char *resolved,
+        const struct stat *st)
+{
+    return entry->dev == st->st_dev
+        && entry->ino == st->st_ino
+        && entry->size == st->st_size
+        && entry->mtime == st->st_mtime
+        && strcmp(entry->path, resolved) == 0;
+}
+
+/**
+ * Opens a resolved file and builds a (not yet cached) entry for it.
+ */
+static struct fcache_entry *open_entry(int root_fd, const char *key,
+        const char *resolved, time_t now)
+{
+    struct stat st;
+    int fd = openat(root_fd, resolved, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1)
+    {
+        return NULL;
+    }
+
+    if(fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct fcache_entry *entry = calloc(1, sizeof(struct fcache_entry));
+
+    if(entry == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    entry->key = strdup(key);
+    entry->path = strdup(resolved);
+
+    if(entry->key == NULL || entry->path == NULL)
+    {
+        free_entry(entry);
+        return NULL;
+    }
+
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->checked = now;
+
+    return entry;
+}
+
+/**
+ * Looks up the file to serve for a request path. Fresh entries are returned
+ * without touching the file system; stale ones are revalidated with stat()
+ * and reopened only if the file changed.
+ *
+ * Inputs:
+ *  - cache: the cache
+ *  - path: request path (relative to the document root)
+ *
+ * Returns:
+ *  - A referenced entry that must be passed to fcache_release() when done
+ *  - NULL if the file cannot be served (errno is set)
+ */
+struct fcache_entry *fcache_lookup(struct fcache *cache, const char *path)
+{
+    time_t now = time(NULL);
+    size_t bucket = hash_str(path) & (cache->num_buckets - 1);
+    struct fcache_entry *entry = cache->buckets[bucket];
+
+    while(entry != NULL && strcmp(entry->key, path) != 0)
+    {
+        entry = entry->hash_next;
+    }
+
+    if(entry != NULL && now - entry->checked < cache->ttl)
+    {
+        cache->hits++;
+        lru_remove(cache, entry);
+        lru_push_front(cache, entry);
+        entry->refs++;
+
+        return entry;
+    }
+
+    char resolved[4096];
+    struct stat st;
+
+    if(resolve(cache->root_fd, path, resolved, sizeof(resolved), &st) == -1)
+    {
+        if(entry != NULL)
+        {
+            unlink_entry(cache, entry);
+        }
+
+        cache->misses++;
+        return NULL;
+    }
+
+    if(entry != NULL)
+    {
+        if(same_file(entry, resolved, &st))
+        {
+            cache->hits++;
+            entry->checked = now;
+            lru_remove(cache, entry);
+            lru_push_front(cache, entry);
+            entry->refs++;
+
+            return entry;
+        }
+
+        LOG("Cached file changed: %s\n", entry->path);
+        unlink_entry(cache, entry);
+    }
+
+    cache->misses++;
+    entry = open_entry(cache->root_fd, path, resolved, now);
+
+    if(entry == NULL)
+    {
+        return NULL;
+    }
+
+    entry->refs = 1;
+
+    if(cache->capacity == 0)
+    {
+        entry->unlinked = true;
+        return entry;
+    }
+
+    while(cache->count >= cache->capacity && cache->lru_tail != NULL)
+    {
+        unlink_entry(cache, cache->lru_tail);
+    }
+
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push_front(cache, entry);
+    cache->count++;
+
+    return entry;
+}
+
+/**
+ * Drops a reference obtained from fcache_lookup(). Entries that were evicted
+ * while referenced are freed (and their descriptor closed) here.
+ */
+void fcache_release(struct fcache *cache, struct fcache_entry *entry)
+{
+    entry->refs--;
+
+    if(entry->refs == 0 && entry->unlinked)
+    {
+        free_entry(entry);
+    }
+}
+
+/**
+ * Closes every cached file and frees the cache. All references must have
+ * been released.
+ */
+void fcache_destroy(struct fcache *cache)
+{
+    while(cache->lru_tail != NULL)
+    {
+        unlink_entry(cache, cache->lru_tail);
+    }
+
+    free(cache->buckets);
+    free(cache);
+}
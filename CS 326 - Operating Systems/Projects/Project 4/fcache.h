@@ -0,0 +1,124 @@
+/**
+ * @file
+ *
+ * Open-file cache for static serving. Maps a request path to the resolved
+ * file (with the directory -> index.html fallback applied), its open file
+ * descriptor, its metadata and a precomputed response header, so hot files can
+ * be served without stat() or open() calls. Entries are revalidated with a
+ * single stat() once they are older than the cache's TTL (or against the
+ * document root index, if it is in use).
+ */
+
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "fmap.h"
+
+/** Room for the precomputed header lines of a cached file */
+#define FCACHE_HEADER_LEN 512
+#define FCACHE_VALIDATOR_LEN 64
+
+/**
+ * A cached, open file. Entries handed out by fcache_lookup() are reference
+ * counted and stay valid (including the fd) until fcache_release().
+ */
+struct fcache_entry {
+    /** Request path this entry was looked up under */
+    char *key;
+
+    /** Path of the file actually served (may end in /index.html) */
+    char *path;
+
+    /** Read-only descriptor for the file; always use explicit offsets */
+    int fd;
+
+    /** File size in bytes */
+    off_t size;
+
+    /** Last modification time */
+    time_t mtime;
+
+    /** Identity of the file, used to detect replacement on revalidation */
+    dev_t dev;
+    ino_t ino;
+
+    /**
+     * Response header lines that only depend on the file (status line,
+     * Content-Length, ...). Filled in by the server the first time the entry
+     * is used; header_len is 0 until then.
+     */
+    char header[FCACHE_HEADER_LEN];
+    size_t header_len;
+
+    /** MIME type of the content, filled in along with *header* */
+    const char *content_type;
+
+    /** ETag and Last-Modified values, filled in along with *header* */
+    char etag[FCACHE_VALIDATOR_LEN];
+    char last_modified[FCACHE_VALIDATOR_LEN];
+
+    /** Precompressed sidecar files found next to this one (a bit mask
+     * defined by the server), filled in along with *header* */
+    unsigned encodings;
+
+    /** Shared mapping of the file, if the server maps it (released along
+     * with the entry); map_tried is set once a mapping has been attempted */
+    struct fmap *map;
+    bool map_tried;
+
+    /** When the metadata was last confirmed with stat() */
+    time_t checked;
+
+    /** Outstanding references from fcache_lookup() */
+    int refs;
+
+    /** True once the entry has been dropped from the cache */
+    bool unlinked;
+
+    struct fcache_entry *hash_next;
+    struct fcache_entry *lru_prev;
+    struct fcache_entry *lru_next;
+};
+
+/**
+ * Bounded cache of open files. Not thread safe: each process or worker keeps
+ * its own.
+ */
+struct fcache {
+    /** Maximum number of entries (and open descriptors) kept */
+    size_t capacity;
+
+    /** Current number of entries */
+    size_t count;
+
+    /** Seconds before an entry's metadata is checked again */
+    int ttl;
+
+    /** Document root that request paths are relative to (AT_FDCWD for the
+     * working directory) */
+    int root_fd;
+
+    /** Hash buckets (a power of two) */
+    struct fcache_entry **buckets;
+    size_t num_buckets;
+
+    /** Most and least recently used entries */
+    struct fcache_entry *lru_head;
+    struct fcache_entry *lru_tail;
+
+    /** Statistics */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct fcache *fcache_create(size_t capacity, int ttl, int root_fd);
+void fcache_destroy(struct fcache *cache);
+struct fcache_entry *fcache_lookup(struct fcache *cache, const char *path);
+void fcache_release(struct fcache *cache, struct fcache_entry *entry);
+
+#endif
@@ -0,0 +1,153 @@
+/**
+ * @file
+ *
+ * Shared file mappings. See fmap.h.
+ *
+ * The table is only touched when a worker's open-file cache creates or drops
+ * an entry for a mapped file, not on every request, so a single mutex is
+ * enough. Responses use the mapping through the file cache entry, which holds
+ * the reference.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "fmap.h"
+#include "logger.h"
+
+/** Hash buckets (a power of two) */
+#define FMAP_BUCKETS 1024
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fmap *g_buckets[FMAP_BUCKETS];
+
+/** Bytes currently mapped, and the limit */
+static size_t g_mapped = 0;
+static size_t g_max_bytes = 0;
+
+static size_t bucket(dev_t dev, ino_t ino)
+{
+    uint64_t hash = ((uint64_t) dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+    return (hash ^ (hash >> 29)) & (FMAP_BUCKETS - 1);
+}
+
+/**
+ * Sets how many bytes may be mapped at once; files that would go over the
+ * limit are not mapped. Call before serving starts.
+ */
+void fmap_init(size_t max_bytes)
+{
+    g_max_bytes = max_bytes;
+}
+
+/**
+ * Returns a reference to the mapping of a file, mapping it if no worker has
+ * yet. The kernel is asked to read the whole file in ahead of use.
+ *
+ * Inputs:
+ *  - fd: open descriptor for the file (only used to map it)
+ *  - dev, ino, size, mtime: identity of the file, from fstat()
+ *
+ * Returns:
+ *  - The mapping, or NULL if the file is empty, would exceed the limit or
+ *    cannot be mapped
+ */
+struct fmap *fmap_acquire(int fd, dev_t dev, ino_t ino, off_t size,
+        time_t mtime)
+{
+    if(size <= 0)
+    {
+        return NULL;
+    }
+
+    size_t index = bucket(dev, ino);
+    struct fmap *map;
+
+    pthread_mutex_lock(&g_lock);
+
+    for(map = g_buckets[index]; map != NULL; map = map->hash_next)
+    {
+        if(map->dev == dev && map->ino == ino && map->size == size
+                && map->mtime == mtime)
+        {
+            map->refs++;
+            pthread_mutex_unlock(&g_lock);
+            return map;
+        }
+    }
+
+    if(g_mapped + size > g_max_bytes)
+    {
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+
+    map = calloc(1, sizeof(struct fmap));
+
+    if(map == NULL)
+    {
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+
+    map->addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(map->addr == MAP_FAILED)
+    {
+        perror("mmap");
+        free(map);
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+
+    madvise(map->addr, size, MADV_WILLNEED);
+
+    map->dev = dev;
+    map->ino = ino;
+    map->size = size;
+    map->mtime = mtime;
+    map->refs = 1;
+    map->hash_next = g_buckets[index];
+    g_buckets[index] = map;
+    g_mapped += size;
+
+    pthread_mutex_unlock(&g_lock);
+
+    LOG("Mapped %jd bytes (%zu mapped in total)\n", (intmax_t) size,
+            g_mapped);
+
+    return map;
+}
+
+/**
+ * Drops a reference; the file is unmapped with the last one.
+ */
+void fmap_release(struct fmap *map)
+{
+    pthread_mutex_lock(&g_lock);
+
+    if(--map->refs > 0)
+    {
+        pthread_mutex_unlock(&g_lock);
+        return;
+    }
+
+    struct fmap **link = &g_buckets[bucket(map->dev, map->ino)];
+
+    while(*link != map)
+    {
+        link = &(*link)->hash_next;
+    }
+
+    *link = map->hash_next;
+    g_mapped -= map->size;
+
+    pthread_mutex_unlock(&g_lock);
+
+    munmap(map->addr, map->size);
+    free(map);
+}
@@ -0,0 +1,44 @@
+/**
+ * @file
+ *
+ * Shared read-only mappings of served files. A file that is mapped once is
+ * served from the same mapping by every worker thread: mappings are kept in
+ * a process-wide table keyed by the file's identity (device, inode, size and
+ * modification time) and reference counted. A changed file has a new
+ * identity and so gets a new mapping; the old one is unmapped once the last
+ * response using it has been sent.
+ */
+
+#ifndef FMAP_H
+#define FMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * A mapped file. Valid until fmap_release().
+ */
+struct fmap {
+    /** Identity of the file */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+
+    /** Start of the mapping (size bytes) */
+    char *addr;
+
+    /** Outstanding references from fmap_acquire() */
+    int refs;
+
+    struct fmap *hash_next;
+};
+
+void fmap_init(size_t max_bytes);
+struct fmap *fmap_acquire(int fd, dev_t dev, ino_t ino, off_t size,
+        time_t mtime);
+void fmap_release(struct fmap *map);
+
+#endif
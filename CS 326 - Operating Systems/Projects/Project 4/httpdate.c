@@ -0,0 +1,194 @@
+/**
+ * @file
+ *
+ * Once-per-second HTTP date formatting. See httpdate.h.
+ *
+ * The shared state is a sequence counter and the formatted string. The
+ * counter is odd while a writer is updating the string. Readers copy the
+ * string and, if the counter moved in the meantime or the string is for an
+ * older second, format the date themselves instead. Whichever reader
+ * first notices that the second has changed becomes the writer by moving the
+ * counter from even to odd with a compare-and-swap; nobody ever waits on a
+ * lock.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "httpdate.h"
+
+/** The formatted string is stored as whole words so it can be copied with
+ * atomic loads and stores. */
+#define DATE_WORDS (HTTP_DATE_SIZE / sizeof(uint64_t))
+
+#define DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
+struct date_cache {
+    /** Sequence counter; odd while the string is being rewritten */
+    uint32_t seq;
+
+    /** Second that *value* was formatted for */
+    int64_t second;
+
+    /** NUL-terminated date string */
+    uint64_t value[DATE_WORDS];
+};
+
+static struct date_cache *g_date_cache = NULL; /*!< Shared between workers */
+
+/**
+ * Formats the date for a given second into *words*.
+ */
+static void format_date(time_t second, uint64_t *words)
+{
+    char buf[HTTP_DATE_SIZE] = {0};
+    struct tm tm;
+
+    gmtime_r(&second, &tm);
+    strftime(buf, sizeof(buf), DATE_FORMAT, &tm);
+    memcpy(words, buf, sizeof(buf));
+}
+
+/**
+ * Maps the shared date cache. Must be called before forking so every process
+ * uses the same copy; without it, http_date() formats the date on each call.
+ *
+ * Returns:
+ *  - true on success
+ */
+bool http_date_init(void)
+{
+    struct date_cache *cache = mmap(NULL, sizeof(struct date_cache),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(cache == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    cache->seq = 0;
+    cache->second = -1;
+    g_date_cache = cache;
+
+    return true;
+}
+
+/**
+ * Copies the current date, formatted for the HTTP Date header, into *buf*.
+ *
+ * Inputs:
+ *  - buf: receives the NUL-terminated date string
+ *  - length: capacity of *buf* (HTTP_DATE_SIZE is always enough)
+ *
+ * Returns:
+ *  - Length of the date string (HTTP_DATE_LEN), or 0 if *buf* is too small
+ */
+size_t http_date(char *buf, size_t length)
+{
+    struct timespec now;
+    uint64_t words[DATE_WORDS];
+
+    if(length < HTTP_DATE_LEN + 1)
+    {
+        return 0;
+    }
+
+    /* The coarse clock is read from the vDSO without a system call */
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+    struct date_cache *cache = g_date_cache;
+
+    if(cache == NULL)
+    {
+        format_date(now.tv_sec, words);
+        memcpy(buf, words, HTTP_DATE_LEN + 1);
+
+        return HTTP_DATE_LEN;
+    }
+
+    uint32_t seq = __atomic_load_n(&cache->seq, __ATOMIC_ACQUIRE);
+
+    if((seq & 1) == 0)
+    {
+        for(size_t i = 0; i < DATE_WORDS; i++)
+        {
+            words[i] = __atomic_load_n(&cache->value[i], __ATOMIC_RELAXED);
+        }
+
+        int64_t second = __atomic_load_n(&cache->second, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(__atomic_load_n(&cache->seq, __ATOMIC_RELAXED) == seq
+                && second == now.tv_sec)
+        {
+            memcpy(buf, words, HTTP_DATE_LEN + 1);
+            return HTTP_DATE_LEN;
+        }
+    }
+
+    /* Stale or mid-update: format it ourselves, and publish it if nobody
+     * else is already doing so. */
+    format_date(now.tv_sec, words);
+    memcpy(buf, words, HTTP_DATE_LEN + 1);
+
+    if((seq & 1) == 0 && __atomic_compare_exchange_n(&cache->seq, &seq,
+                seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        for(size_t i = 0; i < DATE_WORDS; i++)
+        {
+            __atomic_store_n(&cache->value[i], words[i], __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&cache->second, (int64_t) now.tv_sec,
+                __ATOMIC_RELAXED);
+        __atomic_store_n(&cache->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+    return HTTP_DATE_LEN;
+}
+
+/**
+ * Formats an arbitrary time (e.g. a file's modification time) as an HTTP
+ * date. Unlike http_date() this is not cached.
+ *
+ * Returns:
+ *  - Length of the date string, or 0 if *buf* is too small
+ */
+size_t http_date_format(time_t when, char *buf, size_t length)
+{
+    struct tm tm;
+
+    gmtime_r(&when, &tm);
+
+    return strftime(buf, length, DATE_FORMAT, &tm);
+}
+
+/**
+ * Parses an IMF-fixdate string, as sent in If-Modified-Since and If-Range.
+ * The obsolete RFC 850 and asctime() forms are not accepted.
+ *
+ * Returns:
+ *  - true if *str* was a valid date; *when* is set to it
+ */
+bool http_date_parse(const char *str, time_t *when)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+
+    if(strptime(str, DATE_FORMAT, &tm) == NULL)
+    {
+        return false;
+    }
+
+    *when = timegm(&tm);
+
+    return true;
+}
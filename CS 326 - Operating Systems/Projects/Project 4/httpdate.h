@@ -0,0 +1,28 @@
+/**
+ * @file
+ *
+ * Shared HTTP Date header value. The RFC 7231 date string is formatted at
+ * most once per second and published through a seqlock in shared memory, so
+ * every connection process can read it without locking, calling gmtime() or
+ * calling strftime().
+ */
+
+#ifndef HTTPDATE_H
+#define HTTPDATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/** Length of an IMF-fixdate string, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+
+/** Buffer size needed to hold an IMF-fixdate string and its terminator */
+#define HTTP_DATE_SIZE 32
+
+bool http_date_init(void);
+size_t http_date(char *buf, size_t length);
+size_t http_date_format(time_t when, char *buf, size_t length);
+bool http_date_parse(const char *str, time_t *when);
+
+#endif
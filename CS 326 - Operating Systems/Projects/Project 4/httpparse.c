@@ -0,0 +1,342 @@
+/**
+ * @file
+ *
+ * Zero-copy HTTP/1.x request parser. See httpparse.h.
+ *
+ * Every scan is a search for one or two delimiter bytes: '\n' for line ends,
+ * ' ' in the request line and ':' or '\n' in header lines. The vector loops
+ * compare a whole block against each delimiter, combine the masks and jump
+ * straight to the first hit; the tail shorter than a block is finished one
+ * byte at a time.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "httpparse.h"
+
+typedef const char *(*find_fn)(const char *pos, const char *end, char a,
+        char b);
+
+static const char *find_scalar(const char *pos, const char *end, char a,
+        char b)
+{
+    for(; pos < end; pos++)
+    {
+        if(*pos == a || *pos == b)
+        {
+            return pos;
+        }
+    }
+
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *pos, const char *end, char a, char b)
+{
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+
+    while(end - pos >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *) pos);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb)));
+
+        if(mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 16;
+    }
+
+    return find_scalar(pos, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *pos, const char *end, char a, char b)
+{
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+
+    while(end - pos >= 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *) pos);
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(block, va),
+                    _mm256_cmpeq_epi8(block, vb)));
+
+        if(mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 32;
+    }
+
+    /* The tail is finished here rather than in find_sse2(): jumping from
+     * dirty 256-bit state into legacy SSE code costs more than the scan. */
+    if(end - pos >= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *) pos);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(block, _mm256_castsi256_si128(va)),
+                    _mm_cmpeq_epi8(block, _mm256_castsi256_si128(vb))));
+
+        if(mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+
+        pos += 16;
+    }
+
+    return find_scalar(pos, end, a, b);
+}
+
+#endif
+
+static find_fn g_find = find_scalar;
+
+/**
+ * Picks the widest scanner the CPU supports before main() runs, so the
+ * choice is made once and never races with worker threads.
+ */
+__attribute__((constructor))
+static void select_scanner(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx2"))
+    {
+        g_find = find_avx2;
+    }
+
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        g_find = find_sse2;
+    }
+#endif
+}
+
+/**
+ * Finds the end of a request head (the empty line after the headers). Meant
+ * to be called again each time more bytes arrive: *scanned* remembers how far
+ * the previous call got, so only new bytes are examined.
+ *
+ * Inputs:
+ *  - data: buffered bytes
+ *  - len: number of buffered bytes
+ *  - scanned: resume offset; 0 for a new request, then left to this function
+ *
+ * Returns:
+ *  - Length of the head including the empty line;
+ *  - 0 if it is not complete yet
+ */
+size_t http_find_header_end(const char *data, size_t len, size_t *scanned)
+{
+    const char *pos = data + *scanned;
+    const char *end = data + len;
+
+    while(pos < end)
+    {
+        const char *newline = g_find(pos, end, '\n', '\n');
+
+        if(newline == NULL)
+        {
+            break;
+        }
+
+        const char *next = newline + 1;
+
+        if(next < end && *next == '\n')
+        {
+            return next + 1 - data;
+        }
+
+        if(next < end && *next == '\r')
+        {
+            if(next + 1 == end)
+            {
+                /* Undecided until the byte after the '\r' arrives */
+                *scanned = newline - data;
+                return 0;
+            }
+
+            if(next[1] == '\n')
+            {
+                return next + 2 - data;
+            }
+        }
+
+        if(next == end)
+        {
+            *scanned = newline - data;
+            return 0;
+        }
+
+        pos = next;
+    }
+
+    *scanned = len;
+
+    return 0;
+}
+
+/**
+ * Returns the slice between *start* and *end* with spaces, tabs and a
+ * trailing '\r' removed from both ends.
+ */
+static struct http_slice trim(char *start, char *end)
+{
+    while(start < end && (*start == ' ' || *start == '\t'))
+    {
+        start++;
+    }
+
+    while(end > start && (end[-1] == ' ' || end[-1] == '\t'
+                || end[-1] == '\r'))
+    {
+        end--;
+    }
+
+    return (struct http_slice) { start, end - start };
+}
+
+/**
+ * Splits a complete request head into the request line parts and header
+ * fields. Lines may end in "\r\n" or a bare "\n"; the head ends at the first
+ * empty line or at *len*. Header lines without a colon are skipped, as are
+ * fields beyond HTTP_MAX_HEADERS.
+ *
+ * Inputs:
+ *  - data: request head (not modified)
+ *  - len: length of the head
+ *  - head: receives slices into *data*
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if the request line is malformed
+ */
+int http_parse_request(char *data, size_t len, struct http_request_head *head)
+{
+    char *end = data + len;
+    char *pos = data;
+
+    head->num_headers = 0;
+    head->minor_version = -1;
+
+    /* Tolerate empty lines before the request line (RFC 7230, 3.5) */
+    while(pos < end && (*pos == '\r' || *pos == '\n'))
+    {
+        pos++;
+    }
+
+    char *line_end = (char *) g_find(pos, end, '\n', '\n');
+
+    if(line_end == NULL)
+    {
+        line_end = end;
+    }
+
+    struct http_slice line = trim(pos, line_end);
+    char *line_stop = line.data + line.len;
+    char *space = (char *) g_find(line.data, line_stop, ' ', '\t');
+
+    if(space == NULL || space == line.data)
+    {
+        return -1;
+    }
+
+    head->method = (struct http_slice) { line.data, space - line.data };
+
+    char *target = space;
+
+    while(target < line_stop && (*target == ' ' || *target == '\t'))
+    {
+        target++;
+    }
+
+    char *target_end = (char *) g_find(target, line_stop, ' ', '\t');
+
+    if(target_end == NULL)
+    {
+        target_end = line_stop;
+    }
+
+    if(target_end == target)
+    {
+        return -1;
+    }
+
+    head->target = (struct http_slice) { target, target_end - target };
+
+    struct http_slice version = trim(target_end, line_stop);
+
+    /* HTTP/0.9-style requests without a version are left at -1 */
+    if(version.len >= 8 && memcmp(version.data, "HTTP/1.", 7) == 0
+            && version.data[7] >= '0' && version.data[7] <= '9')
+    {
+        head->minor_version = version.data[7] - '0';
+    }
+
+    pos = line_end < end ? line_end + 1 : end;
+
+    while(pos < end)
+    {
+        char *delim = (char *) g_find(pos, end, ':', '\n');
+
+        if(delim == NULL || *delim == '\n')
+        {
+            struct http_slice blank = trim(pos, delim == NULL ? end : delim);
+
+            if(blank.len == 0)
+            {
+                break;
+            }
+
+            /* A line without a colon; skip it */
+            pos = delim == NULL ? end : delim + 1;
+            continue;
+        }
+
+        line_end = (char *) g_find(delim + 1, end, '\n', '\n');
+
+        if(line_end == NULL)
+        {
+            line_end = end;
+        }
+
+        if(head->num_headers < HTTP_MAX_HEADERS)
+        {
+            struct http_header *header = &head->headers[head->num_headers++];
+
+            header->name = trim(pos, delim);
+            header->value = trim(delim + 1, line_end);
+        }
+
+        pos = line_end < end ? line_end + 1 : end;
+    }
+
+    return 0;
+}
+
+/**
+ * Compares a slice to a string, ignoring case (as header names and tokens
+ * are compared).
+ */
+bool http_slice_equals(struct http_slice slice, const char *str)
+{
+    return strlen(str) == slice.len && strncasecmp(slice.data, str, slice.len)
+        == 0;
+}
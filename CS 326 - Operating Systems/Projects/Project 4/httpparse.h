@@ -0,0 +1,57 @@
+/**
+ * @file
+ *
+ * Zero-copy HTTP/1.x request parser. The request line and headers are
+ * described as slices (pointer and length) into the caller's buffer; nothing
+ * is copied or NUL-terminated. Delimiters are located 16 or 32 bytes at a time
+ * with SSE2 or AVX2, picked at startup from what the CPU supports.
+ *
+ * Parsing is split in two steps so that a request arriving over several reads
+ * is not rescanned from the start each time: http_find_header_end() is called
+ * after every read and resumes where it left off, and http_parse_request()
+ * runs once on the complete header block.
+ */
+
+#ifndef HTTPPARSE_H
+#define HTTPPARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Maximum number of header fields recorded per request; extras are ignored */
+#define HTTP_MAX_HEADERS 64
+
+/**
+ * A run of bytes inside the request buffer.
+ */
+struct http_slice {
+    char *data;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+
+    /** Field value without surrounding whitespace */
+    struct http_slice value;
+};
+
+/**
+ * A parsed request head. All slices point into the parsed buffer.
+ */
+struct http_request_head {
+    struct http_slice method;
+    struct http_slice target;
+
+    /** Minor version of HTTP/1.x, or -1 if the request line had no version */
+    int minor_version;
+
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int num_headers;
+};
+
+size_t http_find_header_end(const char *data, size_t len, size_t *scanned);
+int http_parse_request(char *data, size_t len, struct http_request_head *head);
+bool http_slice_equals(struct http_slice slice, const char *str);
+
+#endif
@@ -0,0 +1,702 @@
+/**
+ * @file
+ *
+ * Embedding API. See libwww.h.
+ *
+ * Routes are consulted by the request handler before it falls back to static
+ * files, so a routed response goes through the same writers, keep-alive
+ * handling, access log and metrics as any other. The route table is only
+ * written before the workers start, so they read it without locking.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "autoindex.h"
+#include "docindex.h"
+#include "fcache.h"
+#include "httpdate.h"
+#include "libwww.h"
+#include "logger.h"
+#include "scache.h"
+#include "worker.h"
+#include "www.h"
+
+/** Room for the header lines added by a handler */
+#define EXTRA_HEADERS_LEN 2048
+
+/**
+ * A registered route: an exact path, or a prefix if the pattern ended in '*'.
+ */
+struct route {
+    char *pattern;
+    size_t len;
+    bool prefix;
+
+    www_handler handler;
+    void *arg;
+};
+
+struct www_server {
+    int port;
+    int workers;
+
+    struct route *routes;
+    int num_routes;
+};
+
+struct www_request {
+    const struct request *req;
+};
+
+/**
+ * A response under construction. The handler's choices are collected here
+ * and turned into the response's header and segments once it returns.
+ */
+struct www_response {
+    struct response *resp;
+
+    int status;
+
+    char headers[EXTRA_HEADERS_LEN];
+    size_t headers_len;
+    bool has_type;
+
+    /** Body; file bodies also hold a file cache reference in resp->file */
+    struct segment body;
+    bool has_body;
+    const char *content_type;
+
+    /** Producer of a streamed body, instead of *body* */
+    www_producer stream;
+    void *stream_arg;
+};
+
+/** The one server; its settings live in g_config */
+static struct www_server *g_server = NULL;
+
+/** Whether the process-wide caches have been set up (they are kept) */
+static bool g_initialized = false;
+
+/**
+ * Sets up the date cache, the response cache and the access log the first
+ * time a server is created. They are shared memory meant to outlive any one
+ * server, so later servers reuse them.
+ */
+static bool init_process(const struct www_options *opts)
+{
+    if(g_initialized)
+    {
+        return true;
+    }
+
+    if(http_date_init() == false)
+    {
+        return false;
+    }
+
+    if(opts->access_log != NULL && access_log_open(opts->access_log) == false)
+    {
+        return false;
+    }
+
+    if(g_config.small_file_max > 0 && g_config.small_cache_bytes > 0)
+    {
+        g_scache = scache_create(g_config.small_cache_bytes,
+                g_config.small_file_max);
+
+        if(g_scache == NULL)
+        {
+            return false;
+        }
+    }
+
+    g_initialized = true;
+
+    return true;
+}
+
+/**
+ * Creates the server. Only one may exist at a time.
+ *
+ * Inputs:
+ *  - opts: settings; zero fields take the defaults
+ *
+ * Returns:
+ *  - The server, or NULL with errno set (EBUSY if one already exists)
+ */
+struct www_server *www_server_create(const struct www_options *opts)
+{
+    if(g_server != NULL)
+    {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    int autoindex = opts->autoindex != NULL
+        ? autoindex_parse_format(opts->autoindex) : AUTOINDEX_OFF;
+
+    if(opts->port <= 0 || opts->port > 65535 || autoindex == -1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct www_server *server = calloc(1, sizeof(struct www_server));
+
+    if(server == NULL)
+    {
+        return NULL;
+    }
+
+    int root_fd = -1;
+
+    if(opts->root != NULL)
+    {
+        root_fd = open(opts->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if(root_fd == -1)
+        {
+            perror("open");
+            free(server);
+            return NULL;
+        }
+    }
+
+    if(init_process(opts) == false)
+    {
+        int saved = errno;
+
+        if(root_fd != -1)
+        {
+            close(root_fd);
+        }
+
+        free(server);
+        errno = saved;
+        return NULL;
+    }
+
+    server->port = opts->port;
+    server->workers = opts->workers > 0 ? opts->workers
+        : sysconf(_SC_NPROCESSORS_ONLN);
+
+    g_config.root_fd = root_fd;
+
+    if(opts->idle_timeout > 0)
+    {
+        g_config.idle_timeout = opts->idle_timeout;
+    }
+
+    if(opts->max_requests > 0)
+    {
+        g_config.max_requests = opts->max_requests;
+    }
+
+    g_config.prewarm = opts->prewarm && root_fd != -1;
+    g_config.autoindex = autoindex;
+
+    if(g_config.prewarm)
+    {
+        docindex_start(root_fd);
+    }
+
+    g_server = server;
+
+    return server;
+}
+
+/**
+ * Registers a handler. Patterns are exact paths ("/api/status") or, ending
+ * in '*', prefixes ("/api/" followed by '*' matches everything under /api/);
+ * the first registered match wins. Routes must be added before
+ * www_server_run().
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 on failure (errno is set)
+ */
+int www_server_route(struct www_server *server, const char *pattern,
+        www_handler handler, void *arg)
+{
+    if(pattern[0] != '/' || handler == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct route *routes = realloc(server->routes,
+            (server->num_routes + 1) * sizeof(struct route));
+
+    if(routes == NULL)
+    {
+        return -1;
+    }
+
+    server->routes = routes;
+
+    struct route *route = &routes[server->num_routes];
+
+    route->pattern = strdup(pattern);
+
+    if(route->pattern == NULL)
+    {
+        return -1;
+    }
+
+    route->len = strlen(pattern);
+    route->prefix = pattern[route->len - 1] == '*';
+    route->handler = handler;
+    route->arg = arg;
+
+    if(route->prefix)
+    {
+        route->pattern[--route->len] = '\0';
+    }
+
+    server->num_routes++;
+
+    return 0;
+}
+
+/**
+ * Serves until www_server_stop() is called, on the calling thread plus the
+ * worker threads.
+ *
+ * Returns:
+ *  - 0 once the server has stopped
+ *  - -1 if it could not start (e.g. the port is in use)
+ */
+int www_server_run(struct www_server *server)
+{
+    LOG("Serving on port %d with %d workers\n", server->port,
+            server->workers);
+
+    return workers_run(server->port, server->workers);
+}
+
+/**
+ * Makes www_server_run() return once the workers have closed their
+ * connections. Safe to call from a signal handler or a route handler.
+ */
+void www_server_stop(struct www_server *server)
+{
+    (void) server;
+
+    workers_stop();
+}
+
+/**
+ * Frees a server that is not running. Another may be created afterwards.
+ */
+void www_server_destroy(struct www_server *server)
+{
+    if(server == NULL)
+    {
+        return;
+    }
+
+    for(int i = 0; i < server->num_routes; i++)
+    {
+        free(server->routes[i].pattern);
+    }
+
+    if(g_config.prewarm)
+    {
+        docindex_stop();
+    }
+
+    if(g_config.root_fd >= 0)
+    {
+        close(g_config.root_fd);
+    }
+
+    g_config.root_fd = AT_FDCWD;
+    free(server->routes);
+    free(server);
+    g_server = NULL;
+}
+
+/**
+ * Returns the request method, e.g. "GET".
+ */
+const char *www_request_method(const struct www_request *req)
+{
+    return req->req->method;
+}
+
+/**
+ * Returns the path of the request, without the query string.
+ */
+const char *www_request_path(const struct www_request *req)
+{
+    /* Skip the '.' that makes it relative to the document root */
+    return req->req->path + 1;
+}
+
+/**
+ * Returns the query string (after the '?'), or "" if there is none.
+ */
+const char *www_request_query(const struct www_request *req)
+{
+    return req->req->query;
+}
+
+/**
+ * Returns the value of the first header field called *name* (compared
+ * without regard to case), or NULL if the request has none.
+ */
+const char *www_request_header(const struct www_request *req,
+        const char *name)
+{
+    const struct http_request_head *head = &req->req->head;
+
+    for(int i = 0; i < head->num_headers; i++)
+    {
+        if(http_slice_equals(head->headers[i].name, name))
+        {
+            return head->headers[i].value.data;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sets the status code (200 unless changed).
+ */
+void www_response_status(struct www_response *resp, int status)
+{
+    resp->status = status;
+}
+
+/**
+ * Adds a header line. Content-Length and the connection-management headers
+ * are generated and must not be added.
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if the header lines do not fit
+ */
+int www_response_header(struct www_response *resp, const char *name,
+        const char *value)
+{
+    size_t room = sizeof(resp->headers) - resp->headers_len;
+    int len = snprintf(resp->headers + resp->headers_len, room, "%s: %s\r\n",
+            name, value);
+
+    if(len < 0 || (size_t) len >= room)
+    {
+        resp->headers[resp->headers_len] = '\0';
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    resp->headers_len += len;
+
+    if(strcasecmp(name, "Content-Type") == 0)
+    {
+        resp->has_type = true;
+    }
+
+    return 0;
+}
+
+/**
+ * Drops the body set so far, so that a handler can replace it.
+ */
+static void clear_body(struct www_response *resp)
+{
+    struct response *r = resp->resp;
+
+    release_body(r);
+    resp->has_body = false;
+    resp->content_type = NULL;
+    resp->stream = NULL;
+}
+
+/**
+ * Sets the body to a copy of *data*.
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if memory is short
+ */
+int www_response_body(struct www_response *resp, const void *data,
+        size_t len)
+{
+    /* Lives as long as the response; replacing the body leaves it unused */
+    char *copy = arena_alloc(&resp->resp->arena, len > 0 ? len : 1);
+
+    if(copy == NULL)
+    {
+        return -1;
+    }
+
+    memcpy(copy, data, len);
+    clear_body(resp);
+
+    resp->body = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = copy,
+        .len = len,
+    };
+    resp->has_body = true;
+
+    return 0;
+}
+
+/**
+ * Sets the body to *data* without copying it. The bytes must stay valid until
+ * *release* (if not NULL) is called with *arg*, after the response has been
+ * sent or the connection has failed.
+ */
+void www_response_body_ref(struct www_response *resp, const void *data,
+        size_t len, void (*release)(void *arg), void *arg)
+{
+    clear_body(resp);
+
+    resp->resp->release = release;
+    resp->resp->release_arg = arg;
+    resp->body = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = data,
+        .len = len,
+    };
+    resp->has_body = true;
+}
+
+/**
+ * Streams the body: it is sent with the chunked transfer coding (to HTTP/1.0
+ * clients, up to the closing of the connection) as *producer* generates it,
+ * so neither its length nor all of it is needed up front. The producer is
+ * called from the worker whenever the connection can take more, with room
+ * for up to 16 KiB; it must not block. *release* (if not NULL) is called with
+ * *arg* once the response is finished or abandoned.
+ */
+void www_response_stream(struct www_response *resp, www_producer producer,
+        void *arg, void (*release)(void *arg))
+{
+    clear_body(resp);
+
+    resp->resp->release = release;
+    resp->resp->release_arg = arg;
+    resp->stream = producer;
+    resp->stream_arg = arg;
+}
+
+/**
+ * Sets the body to a file under the document root, sent without copying it
+ * (from the shared mapping or with sendfile()). Its type becomes the default
+ * Content-Type.
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if the file cannot be opened (errno is set)
+ */
+int www_response_file(struct www_response *resp, const char *path)
+{
+    size_t key_len = strlen(path) + 3;
+    char *key = arena_alloc(&resp->resp->arena, key_len);
+
+    if(key == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Cache keys are relative to the root, like request paths */
+    snprintf(key, key_len, "%s%s", path[0] == '/' ? "." : "./", path);
+
+    struct fcache_entry *file = lookup_file(key);
+
+    if(file == NULL)
+    {
+        return -1;
+    }
+
+    clear_body(resp);
+
+    resp->resp->file = file;
+    resp->body = file_segment(file, 0, file->size);
+    resp->has_body = true;
+    resp->content_type = file->content_type;
+
+    return 0;
+}
+
+/**
+ * Returns the reason phrase for a status code.
+ */
+static const char *reason_phrase(int status)
+{
+    switch(status)
+    {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 413: return "Content Too Large";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+    }
+
+    return "Unknown";
+}
+
+/**
+ * Turns what a handler produced into the response's header and segments.
+ */
+static void finish_response(struct www_response *w,
+        const struct request *req, bool keep_alive)
+{
+    struct response *resp = w->resp;
+    char date[HTTP_DATE_SIZE] = {0};
+    char connection[128] = {0};
+    char content_type[128] = {0};
+    size_t body_len = w->has_body ? w->body.len : 0;
+    bool head_only = strcmp(req->method, "HEAD") == 0;
+    bool chunked = w->stream != NULL && req->minor_version >= 1;
+
+    /* Without chunked framing, closing the connection ends the body */
+    if(w->stream != NULL && chunked == false)
+    {
+        keep_alive = false;
+    }
+
+    generate_timestamp(date, sizeof(date));
+    connection_headers(connection, sizeof(connection), keep_alive);
+
+    if(w->has_type == false && (w->has_body || w->stream != NULL))
+    {
+        snprintf(content_type, sizeof(content_type), "Content-Type: %s\r\n",
+            w->content_type != NULL ? w->content_type
+                : "application/octet-stream");
+    }
+
+    /* No body, and no Content-Length, for statuses that cannot have one */
+    bool bodyless = w->status == 204 || w->status == 304
+        || (w->status >= 100 && w->status < 200);
+    char length[64] = {0};
+
+    if(chunked && bodyless == false)
+    {
+        snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+    }
+
+    else if(w->stream == NULL && bodyless == false)
+    {
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body_len);
+    }
+
+    int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+        "HTTP/1.1 %d %s\r\n"
+        "Date: %s\r\n"
+        "%s"
+        "%s"
+        "%s"
+        "%s"
+        "\r\n",
+        w->status, reason_phrase(w->status), date, w->headers, content_type,
+        length, connection);
+
+    resp->status = w->status;
+    resp->keep_alive = keep_alive;
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->num_segments = 1;
+
+    if(w->has_body && body_len > 0 && bodyless == false && head_only == false)
+    {
+        resp->segments[resp->num_segments++] = w->body;
+    }
+
+    if(w->stream != NULL && bodyless == false && head_only == false)
+    {
+        resp->stream = w->stream;
+        resp->stream_arg = w->stream_arg;
+        resp->chunked = chunked;
+    }
+}
+
+/**
+ * Hands a request to the handler of the first route that matches its path.
+ * Called by the request handler before it serves files.
+ *
+ * Inputs:
+ *  - req: parsed request
+ *  - keep_alive: whether the connection stays open after this response
+ *  - resp: response to fill in
+ *
+ * Returns:
+ *  - true if a route handled the request
+ */
+bool route_request(struct request *req, bool keep_alive,
+        struct response *resp)
+{
+    if(g_server == NULL)
+    {
+        return false;
+    }
+
+    const char *path = req->path + 1;
+
+    for(int i = 0; i < g_server->num_routes; i++)
+    {
+        const struct route *route = &g_server->routes[i];
+        bool match = route->prefix
+            ? strncmp(path, route->pattern, route->len) == 0
+            : strcmp(path, route->pattern) == 0;
+
+        if(match == false)
+        {
+            continue;
+        }
+
+        struct www_request request = { .req = req };
+        struct www_response w;
+
+        w.resp = resp;
+        w.status = 200;
+        w.headers[0] = '\0';
+        w.headers_len = 0;
+        w.has_type = false;
+        w.has_body = false;
+        w.content_type = NULL;
+        w.stream = NULL;
+
+        route->handler(&request, &w, route->arg);
+        finish_response(&w, req, keep_alive);
+
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file
+ *
+ * Embedding API of libwww.so: runs the web server inside another program.
+ * Requests for registered routes are answered by handler callbacks; all
+ * others are served as static files from the document root, with the same
+ * caching, range and conditional request support as the www binary.
+ *
+ *     static void hello(const struct www_request *req,
+ *             struct www_response *resp, void *arg)
+ *     {
+ *         www_response_header(resp, "Content-Type", "text/plain");
+ *         www_response_body(resp, "hello\n", 6);
+ *     }
+ *
+ *     struct www_options opts = { .port = 8080, .root = "public" };
+ *     struct www_server *server = www_server_create(&opts);
+ *
+ *     www_server_route(server, "/hello", hello, NULL);
+ *     www_server_run(server);       (returns after www_server_stop())
+ *     www_server_destroy(server);
+ *
+ * Connections are served by worker threads, so handlers run concurrently and
+ * must be thread safe; a handler should not block, as it holds up every other
+ * connection of its worker. Request bodies are not read (they are skipped).
+ * Bodies that are generated as they are sent can be streamed with
+ * www_response_stream() instead of being built in memory first.
+ * The server settings are process-wide, so only one server can exist at a
+ * time. SIGPIPE is ignored once the server runs.
+ */
+
+#ifndef LIBWWW_H
+#define LIBWWW_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define WWW_API __attribute__((visibility("default")))
+
+struct www_server;
+struct www_request;
+struct www_response;
+
+/**
+ * Answers a request by filling in *resp*. Without a call to one of the body
+ * functions the response has an empty body; without www_response_status()
+ * it is a 200.
+ */
+typedef void (*www_handler)(const struct www_request *req,
+        struct www_response *resp, void *arg);
+
+/**
+ * Produces the next piece of a streamed body into *buf* (at most *len* bytes).
+ * Returns the number of bytes produced, 0 at the end of the body, or -1 to
+ * abort the response, which closes the connection.
+ */
+typedef ssize_t (*www_producer)(void *arg, char *buf, size_t len);
+
+/**
+ * Server settings. Zero fields take the defaults of the www binary.
+ */
+struct www_options {
+    /** TCP port to listen on */
+    int port;
+
+    /** Directory static files are served from (NULL: routes only) */
+    const char *root;
+
+    /** Worker threads (0: one per CPU) */
+    int workers;
+
+    /** Seconds an idle keep-alive connection is kept open */
+    int idle_timeout;
+
+    /** Requests served per connection before it is closed */
+    int max_requests;
+
+    /** File to append the access log to (NULL: no access log) */
+    const char *access_log;
+
+    /** Index the document root up front and follow changes with inotify,
+     * so file lookups (and 404s) do not touch the file system */
+    int prewarm;
+
+    /** Listing for directories without an index.html: "html" or "json"
+     * (NULL: 404) */
+    const char *autoindex;
+};
+
+WWW_API struct www_server *www_server_create(const struct www_options *opts);
+WWW_API int www_server_route(struct www_server *server, const char *pattern,
+        www_handler handler, void *arg);
+WWW_API int www_server_run(struct www_server *server);
+WWW_API void www_server_stop(struct www_server *server);
+WWW_API void www_server_destroy(struct www_server *server);
+
+WWW_API const char *www_request_method(const struct www_request *req);
+WWW_API const char *www_request_path(const struct www_request *req);
+WWW_API const char *www_request_query(const struct www_request *req);
+WWW_API const char *www_request_header(const struct www_request *req,
+        const char *name);
+
+WWW_API void www_response_status(struct www_response *resp, int status);
+WWW_API int www_response_header(struct www_response *resp, const char *name,
+        const char *value);
+WWW_API int www_response_body(struct www_response *resp, const void *data,
+        size_t len);
+WWW_API void www_response_body_ref(struct www_response *resp,
+        const void *data, size_t len, void (*release)(void *arg), void *arg);
+WWW_API void www_response_stream(struct www_response *resp,
+        www_producer producer, void *arg, void (*release)(void *arg));
+WWW_API int www_response_file(struct www_response *resp, const char *path);
+
+#endif
@@ -0,0 +1,340 @@
+/**
+ * @file
+ *
+ * Command-line front end of the web server: parses the options, prepares the
+ * shared caches and serves the given directory, either forking a process per
+ * connection or through the worker threads or io_uring loop. Kept apart from
+ * the request handler so that libwww.so does not carry a main().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "autoindex.h"
+#include "docindex.h"
+#include "fcache.h"
+#include "fmap.h"
+#include "httpdate.h"
+#include "logger.h"
+#include "scache.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "worker.h"
+#include "www.h"
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [-k idle_timeout] [-r read_timeout] "
+        "[-W write_timeout] [-n max_requests] "
+        "[-c cache_entries] [-t cache_ttl] [-s small_file_max] "
+        "[-m small_cache_bytes] [-M mmap_file_max] [-u] "
+        "[-C uring_connections] "
+        "[-w workers|cores] [-b backlog] [-l access_log] [-S] [-P] "
+        "[-A html|json] [-H control_socket] port dir\n",
+        prog);
+}
+
+int main(int argc, char *argv[]){
+
+    int c;
+
+    while((c = getopt(argc, argv, "k:r:W:n:c:t:s:m:M:uC:w:b:l:SPA:H:")) != -1)
+    {
+        switch(c)
+        {
+            case 'k':
+                g_config.idle_timeout = atoi(optarg);
+                break;
+            case 'r':
+                g_config.read_timeout = atoi(optarg);
+                break;
+            case 'W':
+                g_config.write_timeout = atoi(optarg);
+                break;
+            case 'n':
+                g_config.max_requests = atoi(optarg);
+                break;
+            case 'c':
+                g_config.cache_entries = atoi(optarg);
+                break;
+            case 't':
+                g_config.cache_ttl = atoi(optarg);
+                break;
+            case 's':
+                g_config.small_file_max = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                g_config.small_cache_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                g_config.mmap_file_max = strtoull(optarg, NULL, 10);
+                break;
+            case 'u':
+                g_config.use_uring = true;
+                break;
+            case 'C':
+                g_config.uring_connections = atoi(optarg);
+                break;
+            case 'w':
+                if(strcmp(optarg, "cores") == 0)
+                {
+                    g_config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+
+                else
+                {
+                    g_config.workers = atoi(optarg);
+                }
+                break;
+            case 'b':
+                g_config.backlog = atoi(optarg);
+                break;
+            case 'l':
+                g_config.access_log = optarg;
+                break;
+            case 'S':
+                g_config.stats = true;
+                break;
+            case 'P':
+                g_config.prewarm = true;
+                break;
+            case 'A':
+            {
+                int format = autoindex_parse_format(optarg);
+
+                if(format == -1)
+                {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+
+                g_config.autoindex = format;
+                break;
+            }
+            case 'H':
+                g_config.upgrade_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int port = atoi(argv[optind]);
+    char *dir = argv[optind + 1];
+
+    /* Opened before the chdir so a relative path means what the user meant,
+     * and before forking so every connection process logs through it */
+    if(g_config.access_log != NULL
+            && access_log_open(g_config.access_log) == false)
+    {
+        return 1;
+    }
+
+    /* Take over the listening sockets of the server being replaced, if one
+     * is running; they are used in place of new ones as listeners are
+     * created. The control socket path is resolved before the chdir too. */
+    if(g_config.upgrade_path != NULL)
+    {
+        int inherited = upgrade_inherit(g_config.upgrade_path);
+
+        if(inherited == -1)
+        {
+            return 1;
+        }
+
+        /* Keep every socket the old server accepted on in use */
+        if(g_config.workers > 0 && inherited > g_config.workers)
+        {
+            LOG("Running %d workers to serve every inherited listener\n",
+                    inherited);
+            g_config.workers = inherited;
+        }
+    }
+
+    LOG("changing directory to %s\n", dir);
+
+    int ret = chdir(dir);
+
+    if(ret == -1)
+    {
+        perror("chdir");
+        return 1;
+    }
+
+    if(http_date_init() == false)
+    {
+        return 1;
+    }
+
+    if(g_config.stats && stats_init() == false)
+    {
+        return 1;
+    }
+
+    /* Created before forking so every connection process shares it */
+    if(g_config.small_file_max > 0 && g_config.small_cache_bytes > 0)
+    {
+        g_scache = scache_create(g_config.small_cache_bytes,
+                g_config.small_file_max);
+
+        if(g_scache == NULL)
+        {
+            return 1;
+        }
+    }
+
+    if(g_config.mmap_file_max > 0)
+    {
+        fmap_init(g_config.mmap_bytes);
+    }
+
+    /* Connection processes forked in the default mode fall back to the file
+     * system, as their copy of the index would not be kept current */
+    if(g_config.prewarm)
+    {
+        docindex_start(g_config.root_fd);
+    }
+
+    /* A client that resets mid-response must not kill the process (before a
+     * connection process has logged and handed back its stats block) */
+    signal(SIGPIPE, SIG_IGN);
+
+    if(g_config.workers > 0)
+    {
+        return workers_run(port, g_config.workers) == -1 ? 1 : 0;
+    }
+
+    int socket_fd = create_listener(port, false);
+
+    if(socket_fd == -1)
+    {
+        return 1;
+    }
+
+    /* Each connection process starts from this (empty) cache */
+    g_fcache = fcache_create(g_config.cache_entries, g_config.cache_ttl,
+            g_config.root_fd);
+
+    if(g_fcache == NULL)
+    {
+        perror("fcache_create");
+        return 1;
+    }
+
+    LOG("Listening on port %d\n", port);
+
+    upgrade_start();
+
+    if(g_config.use_uring)
+    {
+        /* Returns once drained after an upgrade, or at once if io_uring is
+         * unavailable */
+        if(uring_serve(socket_fd) == 0)
+        {
+            return 0;
+        }
+
+        LOGP("io_uring unavailable, falling back to fork per connection\n");
+    }
+
+    /* Connections are long-lived now; let the kernel reap finished children */
+    signal(SIGCHLD, SIG_IGN);
+
+    struct pollfd fds[2] = {
+        { .fd = socket_fd, .events = POLLIN },
+        { .fd = upgrade_drain_fd(), .events = POLLIN },
+    };
+ 
+    /* Inherited or handed-over listeners are shared with the other server,
+     * so a connection poll() reported may be gone by the time of accept() */
+    if(fds[1].fd != -1)
+    {
+        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    while(true)
+    {
+        /* Only wait on both if a newer server can replace this one */
+        if(fds[1].fd != -1)
+        {
+            if(poll(fds, 2, -1) == -1)
+            {
+                continue;
+            }
+
+            if(fds[1].revents != 0)
+            {
+                /* Connection processes finish their clients on their own;
+                 * with SIGCHLD ignored, wait() returns once all are gone */
+                close(socket_fd);
+
+                while(wait(NULL) != -1 || errno == EINTR)
+                {
+                }
+
+                return 0;
+            }
+        }
+
+        struct sockaddr_storage client_addr = {0};
+        socklen_t slen = sizeof(client_addr);
+ 
+        int client_fd = accept(
+            socket_fd,
+            (struct sockaddr *) &client_addr,
+            &slen);
+ 
+        if(client_fd == -1)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("accept");
+            return 1;
+        }
+ 
+        pid_t pid = fork();
+ 
+        if(pid == 0)
+        {
+            close(socket_fd);
+            serve_connection(client_fd, &client_addr);
+            access_log_detach();
+            stats_detach();
+            exit(0);
+        }
+        
+        else if (pid < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        
+        else
+        {
+            close(client_fd);
+        }
+    }
+    
+    return 0; 
+}
@@ -0,0 +1,73 @@
+/**
+ * @file
+ *
+ * Content-Type lookup. See mime.h.
+ *
+ * The generated table uses hash-and-displace: an extension's first hash
+ * picks a bucket, and the bucket's displacement is the seed of a second hash
+ * that gives the extension's slot. The generator chose the displacements so
+ * that no two extensions share a slot.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mime.h"
+#include "mimehash.h"
+
+struct mime_entry {
+    const char *ext;
+    const char *type;
+};
+
+#include "mime_table.h"
+
+/** Served for extensions not in the table */
+#define DEFAULT_TYPE "application/octet-stream"
+
+/**
+ * Returns the MIME type for a file name, by its extension.
+ *
+ * Inputs:
+ *  - path: file name or path (need not be NUL-terminated)
+ *  - len: length of *path*
+ *
+ * Returns:
+ *  - A static string; application/octet-stream if the extension is unknown
+ */
+const char *mime_type(const char *path, size_t len)
+{
+    char ext[MIME_EXT_MAX];
+    size_t ext_len = 0;
+    size_t dot = len;
+
+    while(dot > 0 && path[dot - 1] != '.' && path[dot - 1] != '/')
+    {
+        dot--;
+    }
+
+    if(dot == 0 || path[dot - 1] != '.' || len - dot > MIME_EXT_MAX)
+    {
+        return DEFAULT_TYPE;
+    }
+
+    for(size_t i = dot; i < len; i++)
+    {
+        char c = path[i];
+
+        ext[ext_len++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    uint32_t bucket = mime_hash(ext, ext_len, 0) & (MIME_BUCKETS - 1);
+    uint32_t slot = mime_hash(ext, ext_len, g_mime_displacements[bucket])
+        & (MIME_SLOTS - 1);
+    const struct mime_entry *entry = &g_mime_table[slot];
+
+    if(entry->ext != NULL && strlen(entry->ext) == ext_len
+            && memcmp(entry->ext, ext, ext_len) == 0)
+    {
+        return entry->type;
+    }
+
+    return DEFAULT_TYPE;
+}
@@ -0,0 +1,16 @@
+/**
+ * @file
+ *
+ * Content-Type lookup by file extension. The table is generated from
+ * mime.types at build time as a perfect hash (see tools/mimegen.c), so a
+ * lookup hashes the extension twice and compares it against a single entry.
+ */
+
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+
+const char *mime_type(const char *path, size_t len);
+
+#endif
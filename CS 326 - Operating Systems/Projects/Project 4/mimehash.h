@@ -0,0 +1,34 @@
+/**
+ * @file
+ *
+ * Hash function of the MIME type table, shared by the generator
+ * (tools/mimegen) and the lookup in mime.c so both place an extension in the
+ * same slot.
+ */
+
+#ifndef MIMEHASH_H
+#define MIMEHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Longest extension that can be looked up */
+#define MIME_EXT_MAX 16
+
+/**
+ * Seeded FNV-1a hash of an extension (already lowercased).
+ */
+static inline uint32_t mime_hash(const char *ext, size_t len, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) ext[i];
+        hash *= 16777619u;
+    }
+
+    return hash ^ (hash >> 15);
+}
+
+#endif
@@ -0,0 +1,314 @@
+/**
+ * @file
+ *
+ * Response writer. See response.h.
+ *
+ * Runs of memory segments go out with one writev(); file segments go out
+ * with sendfile(), repeated until the whole range is sent. When a response
+ * mixes the two, the socket is corked for the duration so that the header
+ * does not leave as a tiny segment of its own, and uncorked at the end to
+ * flush the tail.
+ *
+ * Each chunk of a streamed body is framed in place: the producer fills the
+ * buffer after room left for the size line, which is then written just in
+ * front of the data, so a chunk goes out as one contiguous segment.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "response.h"
+
+static void set_cork(int fd, struct response_writer *writer, bool on)
+{
+    int value = on;
+
+    if(writer->corked == on)
+    {
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    writer->corked = on;
+}
+
+/** Room in front of a chunk's data for its size line ("4000\r\n") */
+#define CHUNK_PREFIX_LEN 8
+
+/** Chunk size line and trailer around the data */
+#define CHUNK_FRAME_LEN (CHUNK_PREFIX_LEN + 2)
+
+/**
+ * Every chunk is written whole, so there is nothing for Nagle's algorithm
+ * to coalesce; it would only hold a short chunk back for an ACK.
+ */
+static void set_nodelay(int fd)
+{
+    int value = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
+/**
+ * Moves a streamed response on to its next chunk once its current segments
+ * have all been sent: the producer fills the chunk buffer, and the segments
+ * are replaced with the framed chunk, or with the zero-length chunk that ends
+ * the body once the producer has nothing more.
+ *
+ * Returns:
+ *  - 1 if there is a new chunk to send
+ *  - 0 if the response is complete
+ *  - -1 if the producer failed (or memory is short)
+ */
+int response_next_chunk(struct response *resp)
+{
+    if(resp->stream == NULL)
+    {
+        return 0;
+    }
+
+    if(resp->chunk == NULL)
+    {
+        resp->chunk = arena_alloc(&resp->arena,
+                RESPONSE_CHUNK_LEN + CHUNK_FRAME_LEN);
+
+        if(resp->chunk == NULL)
+        {
+            return -1;
+        }
+    }
+
+    for(int i = 0; i < resp->num_segments; i++)
+    {
+        resp->streamed += resp->segments[i].len;
+    }
+
+    resp->num_segments = 0;
+
+    char *data = resp->chunk + CHUNK_PREFIX_LEN;
+    ssize_t len = resp->stream(resp->stream_arg, data, RESPONSE_CHUNK_LEN);
+
+    if(len < 0 || len > RESPONSE_CHUNK_LEN)
+    {
+        return -1;
+    }
+
+    if(len == 0)
+    {
+        resp->stream = NULL;
+
+        if(resp->chunked == false)
+        {
+            return 0;
+        }
+
+        resp->segments[0] = (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = "0\r\n\r\n",
+            .len = 5,
+        };
+        resp->num_segments = 1;
+
+        return 1;
+    }
+
+    char *start = data;
+    size_t total = len;
+
+    if(resp->chunked)
+    {
+        char size_line[CHUNK_PREFIX_LEN + 1];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n",
+                (size_t) len);
+
+        start -= n;
+        memcpy(start, size_line, n);
+        memcpy(data + len, "\r\n", 2);
+        total += n + 2;
+    }
+
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = start,
+        .len = total,
+    };
+    resp->num_segments = 1;
+
+    return 1;
+}
+
+/**
+ * Prepares a writer for a new response.
+ */
+void writer_init(struct response_writer *writer)
+{
+    writer->seg = 0;
+    writer->seg_done = 0;
+    writer->corked = false;
+}
+
+/**
+ * Marks *sent* bytes as written, moving through the segments.
+ */
+static void advance(struct response *resp, struct response_writer *writer,
+        size_t sent)
+{
+    while(sent > 0 && writer->seg < resp->num_segments)
+    {
+        size_t left = resp->segments[writer->seg].len - writer->seg_done;
+
+        if(sent < left)
+        {
+            writer->seg_done += sent;
+            return;
+        }
+
+        sent -= left;
+        writer->seg++;
+        writer->seg_done = 0;
+    }
+}
+
+/**
+ * Sends as much of a response as the socket takes. On a blocking socket this
+ * only returns once everything is sent (or on failure); on a non-blocking one
+ * it returns 0 when the socket is full and can be called again with the same
+ * writer once it is writable.
+ *
+ * Inputs:
+ *  - fd: client socket
+ *  - resp: response to send
+ *  - writer: progress, from writer_init() or a previous call
+ *
+ * Returns:
+ *  - 1 once the whole response has been sent
+ *  - 0 if the socket would block
+ *  - -1 on failure (including a file that shrank while being sent)
+ */
+int response_write(int fd, struct response *resp,
+        struct response_writer *writer)
+{
+    if(writer->seg == 0 && writer->seg_done == 0 && resp->stream != NULL
+            && resp->streamed == 0)
+    {
+        set_nodelay(fd);
+    }
+
+    else if(writer->seg == 0 && writer->seg_done == 0
+            && resp->num_segments > 1)
+    {
+        for(int i = 0; i < resp->num_segments; i++)
+        {
+            if(resp->segments[i].type == SEGMENT_FILE)
+            {
+                set_cork(fd, writer, true);
+                break;
+            }
+        }
+    }
+
+    while(true)
+    {
+        if(writer->seg == resp->num_segments)
+        {
+            int more = response_next_chunk(resp);
+
+            if(more == -1)
+            {
+                LOGP("Streamed response failed\n");
+                writer_abort(fd, writer);
+                return -1;
+            }
+
+            if(more == 0)
+            {
+                break;
+            }
+
+            writer->seg = 0;
+            writer->seg_done = 0;
+        }
+
+        struct segment *seg = &resp->segments[writer->seg];
+        ssize_t ret;
+
+        if(seg->len == writer->seg_done)
+        {
+            writer->seg++;
+            writer->seg_done = 0;
+            continue;
+        }
+
+        if(seg->type == SEGMENT_FILE)
+        {
+            off_t offset = seg->offset + writer->seg_done;
+
+            ret = sendfile(fd, seg->fd, &offset, seg->len - writer->seg_done);
+
+            if(ret == 0)
+            {
+                LOGP("File shrank while being sent\n");
+                writer_abort(fd, writer);
+                return -1;
+            }
+        }
+
+        else
+        {
+            struct iovec iov[RESPONSE_MAX_SEGMENTS];
+            int iovcnt = 0;
+
+            for(int i = writer->seg; i < resp->num_segments
+                    && resp->segments[i].type == SEGMENT_MEM; i++)
+            {
+                size_t skip = i == writer->seg ? writer->seg_done : 0;
+
+                iov[iovcnt].iov_base = (char *) resp->segments[i].data + skip;
+                iov[iovcnt].iov_len = resp->segments[i].len - skip;
+                iovcnt++;
+            }
+
+            ret = writev(fd, iov, iovcnt);
+        }
+
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            if(errno == EAGAIN)
+            {
+                return 0;
+            }
+
+            writer_abort(fd, writer);
+            return -1;
+        }
+
+        advance(resp, writer, ret);
+    }
+
+    set_cork(fd, writer, false);
+
+    return 1;
+}
+
+/**
+ * Cleans up after a response that will not be finished (the connection is
+ * being closed).
+ */
+void writer_abort(int fd, struct response_writer *writer)
+{
+    set_cork(fd, writer, false);
+}
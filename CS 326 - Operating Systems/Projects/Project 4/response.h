@@ -0,0 +1,157 @@
+/**
+ * @file
+ *
+ * Responses as ordered lists of memory and file segments, and the writer
+ * that sends them. The writer corks the socket so the header and body leave
+ * as one unit. It loops until every byte is sent, or, on a non-blocking
+ * socket, stops when the socket is full and resumes where it left off.
+ *
+ * A response can also stream a body of unknown length: once its segments are
+ * sent, the writer asks a producer for the next chunk, frames it with the
+ * chunked transfer coding, and sends that, until the producer is done. Only
+ * one chunk is held at a time.
+ */
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "accesslog.h"
+#include "arena.h"
+#include "scache.h"
+
+struct fcache_entry;
+
+/** Room for generated header lines, short error bodies and the part headers
+ * of a multipart/byteranges response (up to RESPONSE_MAX_RANGES of them) */
+#define RESPONSE_HEAD_LEN 4096
+
+/** Maximum number of ranges served from one multipart/byteranges request */
+#define RESPONSE_MAX_RANGES 8
+
+/**
+ * Maximum number of pieces a response is sent in: a multipart response has a
+ * header, a part header and a file range per part, and a closing boundary.
+ */
+#define RESPONSE_MAX_SEGMENTS (2 * RESPONSE_MAX_RANGES + 2)
+
+/** Most body bytes in one chunk of a streamed response */
+#define RESPONSE_CHUNK_LEN (16 * 1024)
+
+/**
+ * Produces the next piece of a streamed body into *buf* (up to *len* bytes).
+ * Returns the number of bytes produced, 0 at the end of the body, or -1 on
+ * failure, which aborts the response and closes the connection.
+ */
+typedef ssize_t (*response_producer)(void *arg, char *buf, size_t len);
+
+/**
+ * Where a piece of a response comes from.
+ */
+enum segment_type {
+    /** Bytes in memory */
+    SEGMENT_MEM,
+
+    /** A range of an open file, sent without copying it to user space */
+    SEGMENT_FILE,
+};
+
+/**
+ * One contiguous piece of a response.
+ */
+struct segment {
+    enum segment_type type;
+
+    /** Start of the bytes (SEGMENT_MEM) */
+    const char *data;
+
+    /** File and starting offset (SEGMENT_FILE) */
+    int fd;
+    off_t offset;
+
+    /** Number of bytes */
+    size_t len;
+};
+
+/**
+ * A response ready to be sent: an ordered list of segments plus the
+ * references that keep them valid until release_response().
+ */
+struct response {
+    /** Memory for the response, handed back by release_response() */
+    struct arena arena;
+
+    /** Storage for the generated part of the response (RESPONSE_HEAD_LEN
+     * bytes from *arena*) */
+    char *head;
+
+    struct segment segments[RESPONSE_MAX_SEGMENTS];
+    int num_segments;
+
+    /** Whether the connection stays open after this response */
+    bool keep_alive;
+
+    /** Request body bytes that follow the headers and must be skipped */
+    size_t discard;
+
+    /** Open-file cache entry backing a SEGMENT_FILE, if any */
+    struct fcache_entry *file;
+
+    /** Response cache entry backing the segments, if has_cached is set */
+    struct scache_ref cached;
+    bool has_cached;
+
+    /** Status code and access log record (used if the log is enabled) */
+    int status;
+    struct access_record log;
+
+    /** When the response was ready to send, for the metrics */
+    uint64_t ready_ns;
+
+    /** Heap buffer backing a SEGMENT_MEM, freed by release_response() */
+    char *owned;
+
+    /** Called by release_response() for a body the response borrowed from
+     * a route handler */
+    void (*release)(void *arg);
+    void *release_arg;
+
+    /** Producer of a streamed body, sent after the segments (NULL if none,
+     * or once it is done) */
+    response_producer stream;
+    void *stream_arg;
+
+    /** Frame the streamed body with the chunked coding; without it (for
+     * HTTP/1.0 clients) the body ends when the connection is closed */
+    bool chunked;
+
+    /** Buffer the current chunk is produced and framed in (from *arena*) */
+    char *chunk;
+
+    /** Bytes of the segments sent before the current ones */
+    size_t streamed;
+};
+
+/**
+ * Progress of sending one response.
+ */
+struct response_writer {
+    /** Current segment and the bytes of it already sent */
+    int seg;
+    size_t seg_done;
+
+    /** Whether TCP_CORK is currently set on the socket */
+    bool corked;
+};
+
+void writer_init(struct response_writer *writer);
+int response_write(int fd, struct response *resp,
+        struct response_writer *writer);
+void writer_abort(int fd, struct response_writer *writer);
+int response_next_chunk(struct response *resp);
+
+#endif
@@ -0,0 +1,666 @@
+/**
+ * @file
+ *
+ * Shared small-file response cache. See scache.h.
+ *
+ * Everything lives in one MAP_SHARED mapping, so links between entries are
+ * indices and offsets rather than pointers. The mapping holds the cache
+ * header, a fixed table of entries, the hash buckets, and an arena of
+ * variable-sized blocks for the cached data. Arena blocks are allocated first
+ * fit; free neighbours are merged lazily while searching.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "scache.h"
+
+/** Arena blocks (and their headers) are aligned to this many bytes */
+#define ARENA_ALIGN 16
+
+/** Blocks are only split if the remainder would be at least this big */
+#define ARENA_MIN_SPLIT 256
+
+/** Marks the end of an index-linked list */
+#define NONE -1
+
+/**
+ * Header that precedes every block in the arena.
+ */
+struct arena_block {
+    /** Usable bytes following this header */
+    size_t size;
+
+    /** Whether the block is allocated */
+    size_t used;
+};
+
+/**
+ * A cached response. The block holds the key, then the header, then the body.
+ */
+struct scache_entry {
+    /** Whether this slot holds an entry */
+    bool in_use;
+
+    /** Whether the entry is linked into the hash table and LRU list */
+    bool published;
+
+    /** Outstanding references from scache_get() / scache_put() */
+    int refs;
+
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+
+    /** Arena offset of the block holding the data */
+    size_t block;
+    size_t key_len;
+    size_t header_len;
+    size_t body_len;
+
+    int hash_next;
+    int lru_prev;
+    int lru_next;
+};
+
+struct scache {
+    /** Process-shared, robust: protects everything except the counters */
+    pthread_mutex_t lock;
+
+    /** Limits */
+    size_t budget;
+    size_t max_file_size;
+
+    /** Arena bytes currently allocated (including block headers) */
+    size_t used;
+
+    /** Statistics, updated atomically */
+    unsigned long hits;
+    unsigned long misses;
+
+    int num_entries;
+    int num_buckets;
+    int lru_head;
+    int lru_tail;
+
+    /** Unused entry slots, linked through hash_next */
+    int free_head;
+
+    /** Offsets of the entry table, bucket array and arena in the mapping */
+    size_t entries_off;
+    size_t buckets_off;
+    size_t arena_off;
+    size_t arena_size;
+};
+
+static struct scache_entry *entries(struct scache *cache)
+{
+    return (struct scache_entry *) ((char *) cache + cache->entries_off);
+}
+
+static int *buckets(struct scache *cache)
+{
+    return (int *) ((char *) cache + cache->buckets_off);
+}
+
+static char *arena(struct scache *cache)
+{
+    return (char *) cache + cache->arena_off;
+}
+
+static struct arena_block *block_at(struct scache *cache, size_t off)
+{
+    return (struct arena_block *) (arena(cache) + off);
+}
+
+static char *block_data(struct scache *cache, size_t off)
+{
+    return arena(cache) + off + sizeof(struct arena_block);
+}
+
+static size_t align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+static uint64_t hash_str(const char *str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*str != '\0')
+    {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Creates the cache in a shared anonymous mapping. Must be called before
+ * forking so every process sees the same mapping.
+ *
+ * Inputs:
+ *  - budget: bytes available for cached responses
+ *  - max_file_size: files larger than this are never cached
+ *
+ * Returns:
+ *  - The new cache, or NULL on failure
+ */
+struct scache *scache_create(size_t budget, size_t max_file_size)
+{
+    int num_entries = budget / 1024 + 16;
+    int num_buckets = 16;
+
+    while(num_buckets < num_entries * 2)
+    {
+        num_buckets *= 2;
+    }
+
+    size_t entries_off = align_up(sizeof(struct scache), ARENA_ALIGN);
+    size_t buckets_off = align_up(
+            entries_off + num_entries * sizeof(struct scache_entry),
+            ARENA_ALIGN);
+    size_t arena_off = align_up(buckets_off + num_buckets * sizeof(int),
+            ARENA_ALIGN);
+    size_t arena_size = align_up(budget, ARENA_ALIGN);
+
+    struct scache *cache = mmap(NULL, arena_off + arena_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(cache == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache->budget = budget;
+    cache->max_file_size = max_file_size;
+    cache->num_entries = num_entries;
+    cache->num_buckets = num_buckets;
+    cache->lru_head = NONE;
+    cache->lru_tail = NONE;
+    cache->entries_off = entries_off;
+    cache->buckets_off = buckets_off;
+    cache->arena_off = arena_off;
+    cache->arena_size = arena_size;
+
+    for(int i = 0; i < num_buckets; i++)
+    {
+        buckets(cache)[i] = NONE;
+    }
+
+    for(int i = 0; i < num_entries; i++)
+    {
+        entries(cache)[i].hash_next = i + 1 < num_entries ? i + 1 : NONE;
+    }
+
+    cache->free_head = 0;
+
+    struct arena_block *first = block_at(cache, 0);
+
+    first->size = arena_size - sizeof(struct arena_block);
+    first->used = 0;
+
+    return cache;
+}
+
+/**
+ * Locks the cache. If a process died while holding the lock, the state it
+ * protected is still consistent enough to keep using (entries are published
+ * last), so the lock is simply marked consistent again.
+ */
+static void lock(struct scache *cache)
+{
+    if(pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+static void unlock(struct scache *cache)
+{
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Allocates an arena block with at least *size* usable bytes.
+ *
+ * Returns:
+ *  - Arena offset of the block, or SIZE_MAX if no free block is large enough
+ */
+static size_t arena_alloc(struct scache *cache, size_t size)
+{
+    size_t off = 0;
+
+    size = align_up(size, ARENA_ALIGN);
+
+    while(off < cache->arena_size)
+    {
+        struct arena_block *block = block_at(cache, off);
+
+        if(block->used == 0)
+        {
+            /* Merge any free blocks that follow this one */
+            size_t next = off + sizeof(struct arena_block) + block->size;
+
+            while(next < cache->arena_size && block_at(cache, next)->used == 0)
+            {
+                block->size += sizeof(struct arena_block)
+                    + block_at(cache, next)->size;
+                next = off + sizeof(struct arena_block) + block->size;
+            }
+
+            if(block->size >= size)
+            {
+                if(block->size - size >=
+                        sizeof(struct arena_block) + ARENA_MIN_SPLIT)
+                {
+                    size_t rest = off + sizeof(struct arena_block) + size;
+
+                    block_at(cache, rest)->size = block->size - size
+                        - sizeof(struct arena_block);
+                    block_at(cache, rest)->used = 0;
+                    block->size = size;
+                }
+
+                block->used = 1;
+                cache->used += sizeof(struct arena_block) + block->size;
+
+                return off;
+            }
+        }
+
+        off += sizeof(struct arena_block) + block->size;
+    }
+
+    return SIZE_MAX;
+}
+
+static void arena_free(struct scache *cache, size_t off)
+{
+    struct arena_block *block = block_at(cache, off);
+
+    block->used = 0;
+    cache->used -= sizeof(struct arena_block) + block->size;
+}
+
+static void lru_remove(struct scache *cache, int index)
+{
+    struct scache_entry *entry = &entries(cache)[index];
+
+    if(entry->lru_prev != NONE)
+    {
+        entries(cache)[entry->lru_prev].lru_next = entry->lru_next;
+    }
+
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if(entry->lru_next != NONE)
+    {
+        entries(cache)[entry->lru_next].lru_prev = entry->lru_prev;
+    }
+
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NONE;
+    entry->lru_next = NONE;
+}
+
+static void lru_push_front(struct scache *cache, int index)
+{
+    struct scache_entry *entry = &entries(cache)[index];
+
+    entry->lru_prev = NONE;
+    entry->lru_next = cache->lru_head;
+
+    if(cache->lru_head != NONE)
+    {
+        entries(cache)[cache->lru_head].lru_prev = index;
+    }
+
+    cache->lru_head = index;
+
+    if(cache->lru_tail == NONE)
+    {
+        cache->lru_tail = index;
+    }
+}
+
+/**
+ * Removes an unreferenced entry from the cache and frees its storage.
+ */
+static void remove_entry(struct scache *cache, int index)
+{
+    struct scache_entry *entry = &entries(cache)[index];
+
+    if(entry->published)
+    {
+        int *link = &buckets(cache)[entry->hash & (cache->num_buckets - 1)];
+
+        while(*link != NONE && *link != index)
+        {
+            link = &entries(cache)[*link].hash_next;
+        }
+
+        if(*link == index)
+        {
+            *link = entry->hash_next;
+        }
+
+        lru_remove(cache, index);
+    }
+
+    arena_free(cache, entry->block);
+    entry->in_use = false;
+    entry->published = false;
+    entry->hash_next = cache->free_head;
+    cache->free_head = index;
+}
+
+/**
+ * Evicts the least recently used entry that is not currently being sent.
+ *
+ * Returns:
+ *  - true if an entry was evicted
+ */
+static bool evict_one(struct scache *cache)
+{
+    int index = cache->lru_tail;
+
+    while(index != NONE && entries(cache)[index].refs > 0)
+    {
+        index = entries(cache)[index].lru_prev;
+    }
+
+    if(index == NONE)
+    {
+        return false;
+    }
+
+    remove_entry(cache, index);
+    return true;
+}
+
+static int find(struct scache *cache, const struct scache_key *key,
+        uint64_t hash)
+{
+    int index = buckets(cache)[hash & (cache->num_buckets - 1)];
+    size_t key_len = strlen(key->path);
+
+    while(index != NONE)
+    {
+        struct scache_entry *entry = &entries(cache)[index];
+
+        if(entry->hash == hash
+                && entry->key_len == key_len
+                && memcmp(block_data(cache, entry->block), key->path,
+                    key_len) == 0)
+        {
+            return index;
+        }
+
+        index = entry->hash_next;
+    }
+
+    return NONE;
+}
+
+static bool key_matches(const struct scache_entry *entry,
+        const struct scache_key *key)
+{
+    return entry->dev == key->dev
+        && entry->ino == key->ino
+        && entry->size == key->size
+        && entry->mtime == key->mtime;
+}
+
+static void fill_ref(struct scache *cache, int index, struct scache_ref *ref)
+{
+    struct scache_entry *entry = &entries(cache)[index];
+    char *data = block_data(cache, entry->block);
+
+    ref->header = data + entry->key_len + 1;
+    ref->header_len = entry->header_len;
+    ref->body = ref->header + entry->header_len;
+    ref->body_len = entry->body_len;
+    ref->index = index;
+}
+
+/**
+ * Looks up the cached response for a file version.
+ *
+ * Inputs:
+ *  - cache: the cache
+ *  - key: resolved path and metadata of the file to serve
+ *  - ref: receives the cached header and body on a hit
+ *
+ * Returns:
+ *  - true on a hit; *ref* must then be passed to scache_release()
+ */
+bool scache_get(struct scache *cache, const struct scache_key *key,
+        struct scache_ref *ref)
+{
+    uint64_t hash = hash_str(key->path);
+
+    lock(cache);
+
+    int index = find(cache, key, hash);
+
+    if(index != NONE && key_matches(&entries(cache)[index], key) == false)
+    {
+        /* The file changed; drop the stale copy if nobody is sending it */
+        if(entries(cache)[index].refs == 0)
+        {
+            remove_entry(cache, index);
+        }
+
+        index = NONE;
+    }
+
+    if(index == NONE)
+    {
+        unlock(cache);
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+
+        return false;
+    }
+
+    entries(cache)[index].refs++;
+    lru_remove(cache, index);
+    lru_push_front(cache, index);
+    fill_ref(cache, index, ref);
+
+    unlock(cache);
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+/**
+ * Adds a response to the cache, evicting least recently used entries to make
+ * room. The body is read from *fd* straight into shared memory, outside of
+ * the lock.
+ *
+ * Inputs:
+ *  - cache: the cache
+ *  - key: resolved path and metadata of the file
+ *  - header: status line and file-dependent headers to store
+ *  - header_len: length of *header*
+ *  - fd: open descriptor of the file (read with pread())
+ *  - ref: receives the new entry on success
+ *
+ * Returns:
+ *  - true if the response was cached; *ref* must then be released
+ */
+bool scache_put(struct scache *cache, const struct scache_key *key,
+        const char *header, size_t header_len, int fd, struct scache_ref *ref)
+{
+    size_t key_len = strlen(key->path);
+    size_t body_len = key->size;
+    size_t need = key_len + 1 + header_len + body_len;
+
+    if(body_len > cache->max_file_size || need > cache->budget / 4)
+    {
+        return false;
+    }
+
+    lock(cache);
+
+    while(cache->free_head == NONE)
+    {
+        if(evict_one(cache) == false)
+        {
+            break;
+        }
+    }
+
+    int index = cache->free_head;
+
+    size_t block = SIZE_MAX;
+
+    if(index != NONE)
+    {
+        while((block = arena_alloc(cache, need)) == SIZE_MAX)
+        {
+            if(evict_one(cache) == false)
+            {
+                break;
+            }
+        }
+    }
+
+    if(block == SIZE_MAX)
+    {
+        unlock(cache);
+        return false;
+    }
+
+    struct scache_entry *entry = &entries(cache)[index];
+
+    cache->free_head = entry->hash_next;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->in_use = true;
+    entry->refs = 1;
+    entry->hash = hash_str(key->path);
+    entry->dev = key->dev;
+    entry->ino = key->ino;
+    entry->size = key->size;
+    entry->mtime = key->mtime;
+    entry->block = block;
+    entry->key_len = key_len;
+    entry->header_len = header_len;
+    entry->body_len = body_len;
+    entry->hash_next = NONE;
+    entry->lru_prev = NONE;
+    entry->lru_next = NONE;
+
+    unlock(cache);
+
+    char *data = block_data(cache, block);
+    size_t got = 0;
+
+    memcpy(data, key->path, key_len + 1);
+    memcpy(data + key_len + 1, header, header_len);
+
+    while(got < body_len)
+    {
+        ssize_t ret = pread(fd, data + key_len + 1 + header_len + got,
+                body_len - got, got);
+
+        if(ret <= 0)
+        {
+            break;
+        }
+
+        got += ret;
+    }
+
+    lock(cache);
+
+    if(got < body_len)
+    {
+        /* The file shrank or failed to read; don't cache it */
+        remove_entry(cache, index);
+        unlock(cache);
+
+        return false;
+    }
+
+    /* Replace any older copy of this path that is not being sent */
+    int old = find(cache, key, entry->hash);
+
+    if(old != NONE && entries(cache)[old].refs == 0)
+    {
+        remove_entry(cache, old);
+    }
+
+    int *bucket = &buckets(cache)[entry->hash & (cache->num_buckets - 1)];
+
+    entry->hash_next = *bucket;
+    *bucket = index;
+    entry->published = true;
+    lru_push_front(cache, index);
+    fill_ref(cache, index, ref);
+
+    unlock(cache);
+
+    LOG("Cached %s (%zu bytes)\n", key->path, need);
+
+    return true;
+}
+
+/**
+ * Drops a reference obtained from scache_get() or scache_put().
+ */
+void scache_release(struct scache *cache, struct scache_ref *ref)
+{
+    lock(cache);
+    entries(cache)[ref->index].refs--;
+    unlock(cache);
+}
+
+/**
+ * Returns the size limit for cached files.
+ */
+size_t scache_max_file_size(const struct scache *cache)
+{
+    return cache->max_file_size;
+}
+
+/**
+ * Reports hit/miss counters and the number of arena bytes in use.
+ */
+void scache_stats(struct scache *cache, unsigned long *hits,
+        unsigned long *misses, size_t *bytes_used)
+{
+    *hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+
+    lock(cache);
+    *bytes_used = cache->used;
+    unlock(cache);
+}
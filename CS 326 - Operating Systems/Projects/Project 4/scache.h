@@ -0,0 +1,60 @@
+/**
+ * @file
+ *
+ * Small-file response cache. For files below a size limit, the status line,
+ * the file-dependent headers and the body are kept in one contiguous buffer
+ * in shared memory, so a hit is a single writev() (cached header, per-request
+ * headers, cached body) with no file system access. The cache is created
+ * before the server forks and is shared by every connection process; it is
+ * LRU-managed within a fixed byte budget.
+ */
+
+#ifndef SCACHE_H
+#define SCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct scache;
+
+/**
+ * A referenced cache hit. The pointers stay valid until scache_release().
+ */
+struct scache_ref {
+    /** Cached status line and file-dependent header lines */
+    const char *header;
+    size_t header_len;
+
+    /** Cached file contents */
+    const char *body;
+    size_t body_len;
+
+    /** Entry index, used by scache_release() */
+    int index;
+};
+
+/**
+ * Identifies a particular version of a file. A cached response is only used
+ * if all of these match.
+ */
+struct scache_key {
+    const char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+struct scache *scache_create(size_t budget, size_t max_file_size);
+bool scache_get(struct scache *cache, const struct scache_key *key,
+        struct scache_ref *ref);
+bool scache_put(struct scache *cache, const struct scache_key *key,
+        const char *header, size_t header_len, int fd, struct scache_ref *ref);
+void scache_release(struct scache *cache, struct scache_ref *ref);
+size_t scache_max_file_size(const struct scache *cache);
+void scache_stats(struct scache *cache, unsigned long *hits,
+        unsigned long *misses, size_t *bytes_used);
+
+#endif
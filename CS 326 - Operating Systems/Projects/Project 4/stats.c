@@ -0,0 +1,471 @@
+/**
+ * @file
+ *
+ * Server metrics. See stats.h.
+ *
+ * Counter blocks are claimed the same way as access log rings: the first
+ * time a thread records anything it swaps its thread id into a free block's
+ * owner field. A block keeps its counts when its owner goes away; the next
+ * owner simply keeps adding to them, so short-lived connection processes
+ * lose nothing and the number of blocks stays fixed. A thread or process that
+ * finds every block taken (more than STATS_SLOTS connection processes at once
+ * in fork-per-connection mode) records nothing and is counted in the report
+ * as turned away; serve with -w to stay within the limit.
+ *
+ * Latency histograms are log-linear like HdrHistogram: values below
+ * 2^SUB_BITS nanoseconds get a bucket each, and every power of two above
+ * that is split into 2^SUB_BITS equal buckets, which bounds the error of a
+ * reported percentile to about 6%.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/** Number of counter blocks, i.e. of threads or processes recording at once */
+#define STATS_SLOTS 64
+
+/** Status codes 100-599 are counted individually */
+#define STATUS_CODES 600
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS ((64 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct stats_slot {
+    /** Thread id of the recorder, or 0 if the block is free */
+    int32_t owner;
+
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t bytes;
+    uint64_t fcache_hits;
+    uint64_t fcache_misses;
+    uint64_t status[STATUS_CODES];
+    struct histogram timers[STATS_NUM_TIMERS];
+};
+
+static const char *g_timer_names[STATS_NUM_TIMERS] = {
+    [STATS_PARSE] = "parse",
+    [STATS_LOOKUP] = "lookup",
+    [STATS_SEND] = "send",
+};
+
+static struct stats_slot *g_slots = NULL; /*!< Shared with forked children */
+
+/** Threads and processes that found no free block; follows g_slots */
+static uint64_t *g_turned_away = NULL;
+
+static __thread struct stats_slot *t_slot = NULL;
+
+/** Set once the calling thread has been turned away, so it stops looking */
+static __thread bool t_turned_away = false;
+
+/**
+ * Adds to a counter that only the calling thread writes. A relaxed store
+ * keeps concurrent readers well-defined without a locked instruction.
+ */
+static inline void bump(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Maps the counter blocks. Must be called before the server forks or starts
+ * its workers.
+ *
+ * Returns:
+ *  - true on success
+ */
+bool stats_init(void)
+{
+    size_t size = STATS_SLOTS * sizeof(struct stats_slot)
+        + sizeof(*g_turned_away);
+    struct stats_slot *slots = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(slots == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    g_slots = slots;
+    g_turned_away = (uint64_t *) (slots + STATS_SLOTS);
+
+    return true;
+}
+
+/**
+ * Returns true if metrics are being collected.
+ */
+bool stats_enabled(void)
+{
+    return g_slots != NULL;
+}
+
+/**
+ * Returns a monotonic timestamp in nanoseconds, for use with stats_time().
+ */
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the calling thread's counter block, claiming one if needed, or
+ * NULL if collection is off or every block is taken.
+ */
+static struct stats_slot *slot(void)
+{
+    if(t_slot != NULL || g_slots == NULL || t_turned_away)
+    {
+        return t_slot;
+    }
+
+    int32_t tid = syscall(SYS_gettid);
+
+    for(int i = 0; i < STATS_SLOTS; i++)
+    {
+        int32_t expected = 0;
+
+        if(__atomic_compare_exchange_n(&g_slots[i].owner, &expected, tid,
+                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            t_slot = &g_slots[i];
+            return t_slot;
+        }
+    }
+
+    __atomic_fetch_add(g_turned_away, 1, __ATOMIC_RELAXED);
+    t_turned_away = true;
+
+    return NULL;
+}
+
+void stats_connection_opened(void)
+{
+    struct stats_slot *s = slot();
+
+    if(s != NULL)
+    {
+        bump(&s->accepted, 1);
+    }
+}
+
+void stats_connection_closed(void)
+{
+    struct stats_slot *s = slot();
+
+    if(s != NULL)
+    {
+        bump(&s->closed, 1);
+    }
+}
+
+/**
+ * Counts a file cache lookup.
+ */
+void stats_file_lookup(bool hit)
+{
+    struct stats_slot *s = slot();
+
+    if(s != NULL)
+    {
+        bump(hit ? &s->fcache_hits : &s->fcache_misses, 1);
+    }
+}
+
+/**
+ * Counts a response that has been sent in full.
+ */
+void stats_response(int status, uint64_t bytes)
+{
+    struct stats_slot *s = slot();
+
+    if(s != NULL)
+    {
+        if(status >= 0 && status < STATUS_CODES)
+        {
+            bump(&s->status[status], 1);
+        }
+
+        bump(&s->bytes, bytes);
+    }
+}
+
+static int bucket_index(uint64_t value)
+{
+    if(value < SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_value(int index)
+{
+    if(index < SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+
+    return (SUB_BUCKETS + sub) << (exponent - SUB_BITS);
+}
+
+/**
+ * Records a duration.
+ *
+ * Inputs:
+ *  - timer: which histogram
+ *  - ns: duration in nanoseconds
+ */
+void stats_time(enum stats_timer timer, uint64_t ns)
+{
+    struct stats_slot *s = slot();
+
+    if(s == NULL)
+    {
+        return;
+    }
+
+    struct histogram *h = &s->timers[timer];
+
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    bump(&h->buckets[bucket_index(ns)], 1);
+
+    if(ns > h->max)
+    {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Gives up the calling thread's counter block (its counts remain), e.g.
+ * before a connection process exits.
+ */
+void stats_detach(void)
+{
+    if(t_slot != NULL)
+    {
+        __atomic_store_n(&t_slot->owner, 0, __ATOMIC_RELEASE);
+        t_slot = NULL;
+    }
+}
+
+/**
+ * Returns the smallest recorded value that at least *fraction* of the
+ * samples do not exceed, to bucket precision. That is the sample of rank
+ * ceil(count * fraction), so p99 of two samples is the larger one.
+ */
+static uint64_t percentile(const struct histogram *h, double fraction)
+{
+    double rank = h->count * fraction;
+    uint64_t target = rank;
+    uint64_t seen = 0;
+
+    if(target < rank)
+    {
+        target++;
+    }
+
+    if(target == 0)
+    {
+        target = 1;
+    }
+
+    if(target > h->count)
+    {
+        target = h->count;
+    }
+
+    for(int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+
+        if(seen >= target)
+        {
+            return bucket_value(i);
+        }
+    }
+
+    return h->max;
+}
+
+/**
+ * Adds up every counter block and formats the report as plain text, one
+ * metric per line.
+ *
+ * Inputs:
+ *  - scache: shared response cache, whose own counters are included (may be
+ *    NULL)
+ *  - len: set to the length of the report
+ *
+ * Returns:
+ *  - Report allocated with malloc(), or NULL on failure
+ */
+char *stats_report(struct scache *scache, size_t *len)
+{
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *fraction_names[] = { "p50", "p90", "p99", "p999" };
+
+    struct stats_slot *total = calloc(1, sizeof(*total));
+    size_t capacity = 16384;
+    char *out = malloc(capacity);
+    size_t used = 0;
+
+    if(total == NULL || out == NULL)
+    {
+        free(total);
+        free(out);
+        return NULL;
+    }
+
+    for(int i = 0; i < STATS_SLOTS; i++)
+    {
+        struct stats_slot *s = &g_slots[i];
+
+        total->accepted += load(&s->accepted);
+        total->closed += load(&s->closed);
+        total->bytes += load(&s->bytes);
+        total->fcache_hits += load(&s->fcache_hits);
+        total->fcache_misses += load(&s->fcache_misses);
+
+        for(int code = 0; code < STATUS_CODES; code++)
+        {
+            total->status[code] += load(&s->status[code]);
+        }
+
+        for(int t = 0; t < STATS_NUM_TIMERS; t++)
+        {
+            struct histogram *h = &s->timers[t];
+            struct histogram *sum = &total->timers[t];
+            uint64_t max = load(&h->max);
+
+            sum->count += load(&h->count);
+            sum->sum += load(&h->sum);
+            sum->max = max > sum->max ? max : sum->max;
+
+            for(int b = 0; b < HIST_BUCKETS; b++)
+            {
+                sum->buckets[b] += load(&h->buckets[b]);
+            }
+        }
+
+        /* Hand back blocks of connection processes that died */
+        int32_t owner = __atomic_load_n(&s->owner, __ATOMIC_RELAXED);
+
+        if(owner != 0 && kill(owner, 0) == -1 && errno == ESRCH)
+        {
+            __atomic_compare_exchange_n(&s->owner, &owner, 0, false,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+    }
+
+#define APPEND(...) \
+    used += snprintf(out + used, used < capacity ? capacity - used : 0, \
+            __VA_ARGS__)
+
+    uint64_t lookups = total->fcache_hits + total->fcache_misses;
+
+    APPEND("connections_accepted %llu\n",
+            (unsigned long long) total->accepted);
+    APPEND("connections_active %llu\n",
+            (unsigned long long) (total->accepted - total->closed));
+    APPEND("bytes_sent %llu\n", (unsigned long long) total->bytes);
+    APPEND("stats_recorders_turned_away %llu\n", (unsigned long long)
+            __atomic_load_n(g_turned_away, __ATOMIC_RELAXED));
+
+    for(int code = 0; code < STATUS_CODES; code++)
+    {
+        if(total->status[code] > 0)
+        {
+            APPEND("requests{status=\"%d\"} %llu\n", code,
+                    (unsigned long long) total->status[code]);
+        }
+    }
+
+    APPEND("fcache_hits %llu\n", (unsigned long long) total->fcache_hits);
+    APPEND("fcache_misses %llu\n", (unsigned long long) total->fcache_misses);
+    APPEND("fcache_hit_rate %.4f\n",
+            lookups > 0 ? (double) total->fcache_hits / lookups : 0.0);
+
+    if(scache != NULL)
+    {
+        unsigned long hits;
+        unsigned long misses;
+        size_t bytes_used;
+
+        scache_stats(scache, &hits, &misses, &bytes_used);
+
+        APPEND("scache_hits %lu\n", hits);
+        APPEND("scache_misses %lu\n", misses);
+        APPEND("scache_hit_rate %.4f\n",
+                hits + misses > 0 ? (double) hits / (hits + misses) : 0.0);
+        APPEND("scache_bytes_used %zu\n", bytes_used);
+    }
+
+    for(int t = 0; t < STATS_NUM_TIMERS; t++)
+    {
+        struct histogram *h = &total->timers[t];
+
+        APPEND("latency_ns{phase=\"%s\"} count=%llu mean=%llu",
+                g_timer_names[t], (unsigned long long) h->count,
+                (unsigned long long) (h->count > 0 ? h->sum / h->count : 0));
+
+        for(size_t f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++)
+        {
+            APPEND(" %s=%llu", fraction_names[f], (unsigned long long)
+                    (h->count > 0 ? percentile(h, fractions[f]) : 0));
+        }
+
+        APPEND(" max=%llu\n", (unsigned long long) h->max);
+    }
+
+#undef APPEND
+
+    free(total);
+
+    if(used >= capacity)
+    {
+        used = capacity - 1;
+    }
+
+    *len = used;
+
+    return out;
+}
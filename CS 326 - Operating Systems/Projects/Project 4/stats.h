@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * Server metrics for the /__stats endpoint: connection and request counters,
+ * bytes sent, file cache hit rates, and latency histograms for parsing the
+ * request head, looking up the file and sending the response.
+ *
+ * Each thread (or forked connection process) records into a block of
+ * counters of its own in shared memory, with plain increments; nothing is
+ * shared between writers, so recording takes no locks and no atomic
+ * read-modify-write instructions. The blocks are only added up when the
+ * report is requested.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scache.h"
+
+enum stats_timer {
+    STATS_PARSE,
+    STATS_LOOKUP,
+    STATS_SEND,
+    STATS_NUM_TIMERS,
+};
+
+bool stats_init(void);
+bool stats_enabled(void);
+uint64_t stats_now(void);
+void stats_connection_opened(void);
+void stats_connection_closed(void);
+void stats_file_lookup(bool hit);
+void stats_response(int status, uint64_t bytes);
+void stats_time(enum stats_timer timer, uint64_t ns);
+void stats_detach(void);
+char *stats_report(struct scache *scache, size_t *len);
+
+#endif
@@ -0,0 +1,213 @@
+/**
+ * @file
+ *
+ * Hashed timing wheel. See timewheel.h.
+ *
+ * Slot lists are circular with the slot itself as the list head, so linking
+ * and unlinking a timer never has to special-case an empty list or the ends.
+ */
+
+#include <time.h>
+
+#include "timewheel.h"
+
+#define SLOT_MASK (TIMEWHEEL_SLOTS - 1)
+
+/**
+ * Returns a monotonic timestamp in milliseconds, the clock deadlines are
+ * expressed in.
+ */
+int64_t timewheel_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Sets up an empty wheel.
+ *
+ * Inputs:
+ *  - tw: wheel to initialize
+ *  - now_ms: current time, from timewheel_now_ms()
+ */
+void timewheel_init(struct timewheel *tw, int64_t now_ms)
+{
+    tw->current = now_ms / TIMEWHEEL_TICK_MS;
+    tw->count = 0;
+
+    for(int i = 0; i < TIMEWHEEL_SLOTS; i++)
+    {
+        tw->slots[i].prev = &tw->slots[i];
+        tw->slots[i].next = &tw->slots[i];
+    }
+
+    tw->due.prev = &tw->due;
+    tw->due.next = &tw->due;
+}
+
+/**
+ * Marks a timer as not armed. Must be called once before a timer is used.
+ */
+void timer_init(struct timer *t)
+{
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+bool timer_armed(const struct timer *t)
+{
+    return t->prev != NULL;
+}
+
+/**
+ * Adds a timer at the end of the list headed by *head*.
+ */
+static void link_timer(struct timer *head, struct timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_timer(struct timewheel *tw, struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+    tw->count--;
+}
+
+/**
+ * Arms a timer, replacing its previous deadline if it was already armed.
+ * The timer fires no earlier than *expires_ms* and at most one tick later.
+ *
+ * Inputs:
+ *  - tw: wheel
+ *  - t: timer
+ *  - expires_ms: deadline, on the timewheel_now_ms() clock
+ */
+void timewheel_arm(struct timewheel *tw, struct timer *t, int64_t expires_ms)
+{
+    uint64_t tick = (expires_ms + TIMEWHEEL_TICK_MS - 1) / TIMEWHEEL_TICK_MS;
+
+    if(timer_armed(t))
+    {
+        unlink_timer(tw, t);
+    }
+
+    /* A deadline already in the past fires on the next tick processed */
+    if(tick < tw->current)
+    {
+        tick = tw->current;
+    }
+
+    t->expires = tick;
+    link_timer(&tw->slots[tick & SLOT_MASK], t);
+    tw->count++;
+}
+
+/**
+ * Disarms a timer. Does nothing if it is not armed.
+ */
+void timewheel_cancel(struct timewheel *tw, struct timer *t)
+{
+    if(timer_armed(t))
+    {
+        unlink_timer(tw, t);
+    }
+}
+
+/**
+ * Hands out the next timer that is due, disarming it. Call repeatedly until
+ * it returns NULL; the caller is free to re-arm or cancel any timer,
+ * including the one just returned, between calls.
+ *
+ * Inputs:
+ *  - tw: wheel
+ *  - now_ms: current time, from timewheel_now_ms()
+ *
+ * Returns:
+ *  - An expired timer, or NULL if none is due
+ */
+struct timer *timewheel_expired(struct timewheel *tw, int64_t now_ms)
+{
+    uint64_t now = now_ms / TIMEWHEEL_TICK_MS;
+
+    while(tw->due.next == &tw->due && tw->current <= now)
+    {
+        if(tw->count == 0)
+        {
+            /* Nothing to visit; skip the empty ticks in one go */
+            tw->current = now + 1;
+            break;
+        }
+
+        struct timer *head = &tw->slots[tw->current & SLOT_MASK];
+        struct timer *next;
+
+        for(struct timer *t = head->next; t != head; t = next)
+        {
+            next = t->next;
+
+            /* Later timers in this slot wait for another turn */
+            if(t->expires <= tw->current)
+            {
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                link_timer(&tw->due, t);
+            }
+        }
+
+        tw->current++;
+    }
+
+    if(tw->due.next == &tw->due)
+    {
+        return NULL;
+    }
+
+    struct timer *t = tw->due.next;
+
+    unlink_timer(tw, t);
+
+    return t;
+}
+
+/**
+ * Returns how long an event loop may sleep before timewheel_expired() could
+ * have something to hand out, in milliseconds, or -1 if no timer is armed.
+ */
+int timewheel_timeout(const struct timewheel *tw, int64_t now_ms)
+{
+    if(tw->count == 0)
+    {
+        return -1;
+    }
+
+    if(tw->due.next != &tw->due)
+    {
+        return 0;
+    }
+
+    /* Sleep until the first slot that holds anything comes up */
+    uint64_t tick = tw->current;
+
+    for(int i = 0; i < TIMEWHEEL_SLOTS; i++, tick++)
+    {
+        const struct timer *head = &tw->slots[tick & SLOT_MASK];
+
+        if(head->next != head)
+        {
+            break;
+        }
+    }
+
+    int64_t wait = (int64_t) tick * TIMEWHEEL_TICK_MS - now_ms;
+
+    return wait > 0 ? wait : 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file
+ *
+ * Hashed timing wheel for connection deadlines. Time is divided into ticks of
+ * TIMEWHEEL_TICK_MS; a timer due at tick t is kept on the list of slot
+ * t % TIMEWHEEL_SLOTS. Timers are embedded in the objects they belong to and
+ * linked into their slot's list directly, so arming and cancelling a timer
+ * are O(1) and never allocate, however many connections there are. Each tick
+ * only the timers of one slot are looked at, in a single pass that moves the
+ * due ones to a list of their own to be handed out from.
+ *
+ * A timer further out than one turn of the wheel shares its slot with
+ * nearer ones and is passed over once per turn until its tick comes around.
+ */
+
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Timer resolution in milliseconds */
+#define TIMEWHEEL_TICK_MS 100
+
+/** Number of slots (a power of two); one turn covers about 100 seconds */
+#define TIMEWHEEL_SLOTS 1024
+
+/**
+ * A timer, embedded in the object it belongs to.
+ */
+struct timer {
+    /** Tick at which the timer fires */
+    uint64_t expires;
+
+    /** Neighbours in the slot's list; prev is NULL while not armed */
+    struct timer *prev;
+    struct timer *next;
+};
+
+struct timewheel {
+    /** Next tick to be processed */
+    uint64_t current;
+
+    /** Number of armed timers */
+    size_t count;
+
+    /** List heads, one per slot */
+    struct timer slots[TIMEWHEEL_SLOTS];
+
+    /** Head of the list of timers that are due but not handed out yet */
+    struct timer due;
+};
+
+void timewheel_init(struct timewheel *tw, int64_t now_ms);
+void timer_init(struct timer *t);
+bool timer_armed(const struct timer *t);
+void timewheel_arm(struct timewheel *tw, struct timer *t, int64_t expires_ms);
+void timewheel_cancel(struct timewheel *tw, struct timer *t);
+struct timer *timewheel_expired(struct timewheel *tw, int64_t now_ms);
+int timewheel_timeout(const struct timewheel *tw, int64_t now_ms);
+int64_t timewheel_now_ms(void);
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * @file
+ *
+ * Generates the MIME type table used by mime.c. Reads a mime.types-style
+ * list (a type followed by its extensions on each line, '#' comments) and
+ * writes a C header with a perfect hash table of the extensions.
+ *
+ * The table is built with hash-and-displace: extensions are grouped into
+ * buckets by one hash, and then, largest bucket first, each bucket gets the
+ * smallest displacement (seed of a second hash) that puts all of its
+ * extensions into slots that are still free.
+ *
+ * Usage: mimegen < mime.types > mime_table.h
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mimehash.h"
+
+#define MAX_ENTRIES 1024
+#define MAX_DISPLACEMENT 1000000
+
+struct entry {
+    char ext[MIME_EXT_MAX + 1];
+    char *type;
+};
+
+static struct entry g_entries[MAX_ENTRIES];
+static int g_count = 0;
+
+static uint32_t next_power_of_two(uint32_t n)
+{
+    uint32_t p = 1;
+
+    while(p < n)
+    {
+        p *= 2;
+    }
+
+    return p;
+}
+
+static bool add_entry(const char *type, const char *ext, int line)
+{
+    size_t len = strlen(ext);
+
+    if(len > MIME_EXT_MAX)
+    {
+        fprintf(stderr, "mimegen: line %d: extension '%s' too long\n",
+                line, ext);
+        return false;
+    }
+
+    for(int i = 0; i < g_count; i++)
+    {
+        if(strcmp(g_entries[i].ext, ext) == 0)
+        {
+            fprintf(stderr, "mimegen: line %d: '%s' already maps to %s\n",
+                    line, ext, g_entries[i].type);
+            return true;
+        }
+    }
+
+    if(g_count == MAX_ENTRIES)
+    {
+        fprintf(stderr, "mimegen: too many extensions\n");
+        return false;
+    }
+
+    struct entry *e = &g_entries[g_count++];
+
+    for(size_t i = 0; i <= len; i++)
+    {
+        e->ext[i] = tolower((unsigned char) ext[i]);
+    }
+
+    e->type = strdup(type);
+
+    return e->type != NULL;
+}
+
+static bool read_types(FILE *in)
+{
+    char buf[1024];
+    int line = 0;
+
+    while(fgets(buf, sizeof(buf), in) != NULL)
+    {
+        line++;
+
+        char *comment = strchr(buf, '#');
+
+        if(comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        char *type = strtok(buf, " \t\r\n");
+        char *ext;
+
+        if(type == NULL)
+        {
+            continue;
+        }
+
+        while((ext = strtok(NULL, " \t\r\n;")) != NULL)
+        {
+            if(add_entry(type, ext, line) == false)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Finds a displacement for every bucket.
+ *
+ * Returns:
+ *  - false if some bucket could not be placed
+ */
+static bool build(uint32_t num_buckets, uint32_t num_slots,
+        uint32_t *displacements, int *slots)
+{
+    int *bucket_of = malloc(g_count * sizeof(int));
+    int *order = malloc(num_buckets * sizeof(int));
+    int *sizes = calloc(num_buckets, sizeof(int));
+    bool ok = true;
+
+    for(int i = 0; i < g_count; i++)
+    {
+        const char *ext = g_entries[i].ext;
+
+        bucket_of[i] = mime_hash(ext, strlen(ext), 0) & (num_buckets - 1);
+        sizes[bucket_of[i]]++;
+    }
+
+    /* Largest buckets are the hardest to place, so they go first */
+    for(uint32_t b = 0; b < num_buckets; b++)
+    {
+        int j = b;
+
+        while(j > 0 && sizes[order[j - 1]] < sizes[b])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+
+        order[j] = b;
+    }
+
+    for(uint32_t s = 0; s < num_slots; s++)
+    {
+        slots[s] = -1;
+    }
+
+    for(uint32_t o = 0; o < num_buckets && ok; o++)
+    {
+        int b = order[o];
+
+        displacements[b] = 0;
+
+        if(sizes[b] == 0)
+        {
+            continue;
+        }
+
+        for(uint32_t d = 1; ; d++)
+        {
+            if(d == MAX_DISPLACEMENT)
+            {
+                ok = false;
+                break;
+            }
+
+            int placed[MAX_ENTRIES];
+            int num_placed = 0;
+            bool fits = true;
+
+            for(int i = 0; i < g_count && fits; i++)
+            {
+                if(bucket_of[i] != b)
+                {
+                    continue;
+                }
+
+                const char *ext = g_entries[i].ext;
+                uint32_t s = mime_hash(ext, strlen(ext), d) & (num_slots - 1);
+
+                if(slots[s] != -1)
+                {
+                    fits = false;
+                    break;
+                }
+
+                slots[s] = i;
+                placed[num_placed++] = s;
+            }
+
+            if(fits)
+            {
+                displacements[b] = d;
+                break;
+            }
+
+            while(num_placed > 0)
+            {
+                slots[placed[--num_placed]] = -1;
+            }
+        }
+    }
+
+    free(bucket_of);
+    free(order);
+    free(sizes);
+
+    return ok;
+}
+
+int main(void)
+{
+    if(read_types(stdin) == false)
+    {
+        return 1;
+    }
+
+    uint32_t num_slots = next_power_of_two(g_count * 2 > 1 ? g_count * 2 : 2);
+    uint32_t num_buckets = next_power_of_two(g_count > 1 ? g_count / 2 : 1);
+    uint32_t *displacements = calloc(num_buckets, sizeof(uint32_t));
+    int *slots = malloc(num_slots * sizeof(int));
+
+    if(build(num_buckets, num_slots, displacements, slots) == false)
+    {
+        fprintf(stderr, "mimegen: could not build a perfect hash\n");
+        return 1;
+    }
+
+    printf("/* Generated from mime.types by tools/mimegen; "
+            "do not edit. */\n\n");
+    printf("#define MIME_BUCKETS %u\n", num_buckets);
+    printf("#define MIME_SLOTS %u\n\n", num_slots);
+
+    printf("static const uint32_t g_mime_displacements[MIME_BUCKETS] = {");
+
+    for(uint32_t b = 0; b < num_buckets; b++)
+    {
+        printf("%s%u,", b % 12 == 0 ? "\n    " : " ", displacements[b]);
+    }
+
+    printf("\n};\n\n");
+    printf("static const struct mime_entry g_mime_table[MIME_SLOTS] = {\n");
+
+    for(uint32_t s = 0; s < num_slots; s++)
+    {
+        if(slots[s] != -1)
+        {
+            printf("    [%u] = { \"%s\", \"%s\" },\n", s,
+                    g_entries[slots[s]].ext, g_entries[slots[s]].type);
+        }
+    }
+
+    printf("};\n");
+
+    return 0;
+}
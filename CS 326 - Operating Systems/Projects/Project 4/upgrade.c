@@ -0,0 +1,393 @@
+/**
+ * @file
+ *
+ * Listening socket handover. See upgrade.h.
+ *
+ * The exchange on the control socket is: the new server connects, the old
+ * one sends a single byte carrying every listening socket it has as
+ * SCM_RIGHTS, the new one creates its workers on them and replies with a
+ * byte, and the old one then starts draining. The old server's handover
+ * runs on a thread of its own, so the serving loops only have to watch the
+ * drain eventfd.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "upgrade.h"
+
+/** Control socket path (NULL: upgrades are off), made absolute so that it
+ * survives the server changing directory */
+static const char *g_path = NULL;
+static char g_path_buf[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/** Listening sockets received from the previous server and not yet used */
+static int g_inherited[UPGRADE_MAX_LISTENERS];
+static int g_num_inherited = 0;
+
+/** Connection to the previous server, told once this one is serving */
+static int g_predecessor_fd = -1;
+
+/** Listening sockets of this server, to hand to the next one */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_listeners[UPGRADE_MAX_LISTENERS];
+static int g_num_listeners = 0;
+
+/** Control socket the next server connects to */
+static int g_control_fd = -1;
+
+/** Becomes readable once this server has been replaced */
+static int g_drain_fd = -1;
+
+static void control_address(struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, g_path);
+}
+
+/**
+ * Enables upgrades through the control socket at *path*, and takes over the
+ * listening sockets of the server running there, if any. Call before
+ * creating listeners.
+ *
+ * Returns:
+ *  - Number of listening sockets inherited (0 if no server was running)
+ *  - -1 on failure
+ */
+int upgrade_inherit(const char *path)
+{
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX] = ".";
+    int len;
+
+    if(path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        len = snprintf(g_path_buf, sizeof(g_path_buf), "%s", path);
+    }
+
+    else
+    {
+        len = snprintf(g_path_buf, sizeof(g_path_buf), "%s/%s", cwd, path);
+    }
+
+    if(len < 0 || (size_t) len >= sizeof(g_path_buf))
+    {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+
+    g_path = g_path_buf;
+    g_drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if(g_drain_fd == -1)
+    {
+        perror("eventfd");
+        return -1;
+    }
+
+    control_address(&addr);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+
+        /* Nobody there (or a stale socket file): a fresh start */
+        if(errno == ENOENT || errno == ECONNREFUSED)
+        {
+            return 0;
+        }
+
+        perror("connect");
+        return -1;
+    }
+
+    char byte;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+    {
+        perror("recvmsg");
+        close(fd);
+        return -1;
+    }
+
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        memcpy(g_inherited, CMSG_DATA(cmsg), count * sizeof(int));
+        g_num_inherited = count;
+    }
+
+    g_predecessor_fd = fd;
+    LOG("Inherited %d listening sockets\n", g_num_inherited);
+
+    return g_num_inherited;
+}
+
+static int socket_port(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if(getsockname(fd, (struct sockaddr *) &addr, &len) == -1)
+    {
+        return -1;
+    }
+
+    if(addr.ss_family == AF_INET)
+    {
+        return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+    }
+
+    if(addr.ss_family == AF_INET6)
+    {
+        return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+    }
+
+    return -1;
+}
+
+/**
+ * Returns an inherited listening socket bound to *port*, or -1 if none is
+ * left.
+ */
+int upgrade_take_listener(int port)
+{
+    for(int i = 0; i < g_num_inherited; i++)
+    {
+        int fd = g_inherited[i];
+
+        if(socket_port(fd) == port)
+        {
+            g_inherited[i] = g_inherited[--g_num_inherited];
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Records a listening socket so that it is handed to the next server.
+ */
+void upgrade_add_listener(int fd)
+{
+    pthread_mutex_lock(&g_lock);
+
+    if(g_num_listeners < UPGRADE_MAX_LISTENERS)
+    {
+        g_listeners[g_num_listeners++] = fd;
+    }
+
+    pthread_mutex_unlock(&g_lock);
+}
+
+/**
+ * Sends this server's listening sockets to a new server and waits for it to
+ * start serving on them.
+ *
+ * Returns:
+ *  - true if the new server took over
+ */
+static bool hand_over(int fd)
+{
+    char byte = 'L';
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)] = {0};
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+    };
+
+    pthread_mutex_lock(&g_lock);
+
+    size_t fds_len = g_num_listeners * sizeof(int);
+
+    msg.msg_controllen = CMSG_SPACE(fds_len);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds_len);
+    memcpy(CMSG_DATA(cmsg), g_listeners, fds_len);
+
+    ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    pthread_mutex_unlock(&g_lock);
+
+    if(sent != 1)
+    {
+        perror("sendmsg");
+        return false;
+    }
+
+    /* EOF here means the new server gave up; keep serving */
+    return read(fd, &byte, 1) == 1;
+}
+
+static void *handover_main(void *arg)
+{
+    (void) arg;
+
+    while(true)
+    {
+        int fd = accept4(g_control_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if(fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            perror("accept4");
+            return NULL;
+        }
+
+        LOGP("Handing the listening sockets to a new server\n");
+
+        bool replaced = hand_over(fd);
+
+        close(fd);
+
+        if(replaced)
+        {
+            uint64_t one = 1;
+            ssize_t ret = write(g_drain_fd, &one, sizeof(one));
+
+            (void) ret;
+            LOGP("Replaced by a new server; draining connections\n");
+
+            /* The successor has bound the path to its own socket by now */
+            close(g_control_fd);
+            g_control_fd = -1;
+
+            return NULL;
+        }
+
+        LOGP("New server did not start; still serving\n");
+    }
+}
+
+/**
+ * Marks this server as serving: tells the previous server to drain, and
+ * starts listening for the next one. Call once every listener exists.
+ */
+void upgrade_start(void)
+{
+    struct sockaddr_un addr;
+
+    if(g_path == NULL)
+    {
+        return;
+    }
+
+    /* Sockets the previous server had that this one has no use for */
+    for(int i = 0; i < g_num_inherited; i++)
+    {
+        LOGP("Closing an inherited listener that is not needed\n");
+        close(g_inherited[i]);
+    }
+
+    g_num_inherited = 0;
+
+    /* Take over the path before releasing the previous server, so the next
+     * upgrade always finds whoever is serving */
+    control_address(&addr);
+
+    g_control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(g_path);
+
+    if(g_control_fd == -1
+            || bind(g_control_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(g_control_fd, 1) == -1)
+    {
+        perror("control socket");
+        close(g_control_fd);
+        g_control_fd = -1;
+    }
+
+    if(g_predecessor_fd != -1)
+    {
+        char byte = 'R';
+        ssize_t ret = write(g_predecessor_fd, &byte, 1);
+
+        (void) ret;
+        close(g_predecessor_fd);
+        g_predecessor_fd = -1;
+    }
+
+    if(g_control_fd == -1)
+    {
+        return;
+    }
+
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, handover_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+/**
+ * Returns an eventfd that becomes readable once a new server has taken over
+ * and this one should stop accepting, or -1 if upgrades are off.
+ */
+int upgrade_drain_fd(void)
+{
+    return g_drain_fd;
+}
+
+/**
+ * Returns true once a new server has taken over.
+ */
+bool upgrade_draining(void)
+{
+    struct pollfd pfd = { .fd = g_drain_fd, .events = POLLIN };
+
+    return g_drain_fd != -1 && poll(&pfd, 1, 0) == 1;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file
+ *
+ * Zero-downtime binary upgrades. A server started with a control socket path
+ * (-H) listens on that Unix socket for its successor. A new binary started
+ * with the same path connects to it and receives the running server's
+ * listening sockets (SCM_RIGHTS), so the port is never closed. Once the new
+ * server is serving it says so, and the old one stops accepting, finishes
+ * the connections it has and exits. If the new binary fails before that, the
+ * old server carries on as if nothing happened.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+/** Most listening sockets handed over */
+#define UPGRADE_MAX_LISTENERS 256
+
+int upgrade_inherit(const char *path);
+int upgrade_take_listener(int port);
+void upgrade_add_listener(int fd);
+void upgrade_start(void);
+int upgrade_drain_fd(void);
+bool upgrade_draining(void);
+
+#endif
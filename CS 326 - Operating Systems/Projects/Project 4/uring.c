@@ -0,0 +1,1002 @@
+/**
+ * @file
+ *
+ * io_uring event loop for the web server. See uring.h.
+ *
+ * The ring is set up with the raw system calls (no liburing). Every
+ * connection lives in a fixed slot whose input buffer is registered with the
+ * kernel, so reads use IORING_OP_READ_FIXED. Each read is linked to a timeout
+ * that implements the keep-alive idle limit, or, once part of a request has
+ * arrived, to whatever is left of the read timeout counted from its first
+ * read; sends are linked to the write timeout. The kernel keeps these timers,
+ * so the loop needs no timer structure of its own. A slot is only reused once
+ * every operation submitted for it has completed.
+ *
+ * The drain eventfd of an upgrade is polled through the ring as well; when
+ * it fires, the accept is cancelled and the loop returns once the
+ * connections it has are done.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "logger.h"
+#include "stats.h"
+#include "timewheel.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "www.h"
+
+/** Submission queue size */
+#define RING_ENTRIES 1024
+
+/** Largest piece of a file moved through the pipe at once */
+#define SPLICE_CHUNK (64 * 1024)
+
+/** Slot number used for the accept operation (and the other operations not
+ * tied to a connection) */
+#define ACCEPT_SLOT 0xffffff
+
+/**
+ * Operation types, stored in the low byte of an SQE's user_data.
+ */
+enum uring_op {
+    OP_ACCEPT,
+    OP_READ,
+    OP_TIMEOUT,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_DRAIN,
+    OP_CANCEL,
+};
+
+/**
+ * Memory-mapped submission and completion queues.
+ */
+struct ring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /** SQEs queued since the last io_uring_enter() */
+    unsigned to_submit;
+};
+
+/**
+ * A connection slot.
+ */
+struct uconn {
+    bool in_use;
+
+    /** Client socket */
+    int fd;
+
+    /** Input buffer; its storage is registered buffer number *slot* */
+    struct conn_buf cb;
+
+    /** Client address, for the access log */
+    struct sockaddr_storage peer;
+
+    /** Requests served so far */
+    int served;
+
+    /** When the request being received must be complete (0 between
+     * requests), and the time left for the next read of it */
+    int64_t read_deadline_ms;
+    struct __kernel_timespec read_timeout;
+
+    /** Operations submitted and not yet completed */
+    int pending;
+
+    /** Set once the connection should be torn down */
+    bool closing;
+
+    /** True while *resp* holds a response being sent */
+    bool sending;
+    struct response resp;
+
+    /** Progress through resp: current segment and bytes of it done */
+    int seg;
+    size_t seg_done;
+
+    /** Outgoing memory segments for the current sendmsg */
+    struct iovec iov[RESPONSE_MAX_SEGMENTS];
+    struct msghdr msg;
+
+    /** Pipe used to splice file data to the socket, and bytes held in it */
+    int pipe[2];
+    size_t in_pipe;
+};
+
+/* Each worker thread runs its own loop, so the loop state is per thread */
+static __thread struct ring g_ring;
+static __thread struct uconn *g_conns = NULL;
+static __thread int g_num_conns = 0;
+static __thread char *g_bufs = NULL;
+static __thread int g_listen_fd = -1;
+static __thread bool g_multishot = true;
+static __thread bool g_draining = false;
+static __thread struct __kernel_timespec g_idle_timeout;
+static __thread struct __kernel_timespec g_write_timeout;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+        unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Creates the ring and maps its queues.
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if io_uring is unavailable
+ */
+static int ring_init(struct ring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+
+    if(ring->fd == -1)
+    {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if((p.features & IORING_FEAT_SINGLE_MMAP) == 0)
+    {
+        LOGP("io_uring: kernel too old (no single mmap)\n");
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+    if(ptr == MAP_FAILED)
+    {
+        perror("mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED)
+    {
+        perror("mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *) (ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *) (ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ptr + p.cq_off.cqes);
+    ring->to_submit = 0;
+
+    return 0;
+}
+
+/**
+ * Hands queued SQEs to the kernel without waiting for completions.
+ */
+static void ring_submit(struct ring *ring)
+{
+    while(ring->to_submit > 0)
+    {
+        int ret = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+
+        if(ret == -1)
+        {
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+
+            perror("io_uring_enter");
+            return;
+        }
+
+        ring->to_submit -= ret;
+    }
+}
+
+/**
+ * Returns a zeroed SQE, flushing the queue to the kernel first if it is full.
+ * The entry is queued for the next io_uring_enter().
+ */
+static struct io_uring_sqe *ring_get_sqe(struct ring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+
+    while(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)
+            >= ring->sq_entries)
+    {
+        ring_submit(ring);
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+static uint64_t make_user_data(unsigned slot, enum uring_op op)
+{
+    return ((uint64_t) slot << 8) | op;
+}
+
+static void submit_accept(void)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = g_listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = g_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = make_user_data(ACCEPT_SLOT, OP_ACCEPT);
+}
+
+/**
+ * Waits for the drain eventfd to become readable. The eventfd is never read,
+ * so it wakes every worker's ring.
+ */
+static void submit_drain_poll(void)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = upgrade_drain_fd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = make_user_data(ACCEPT_SLOT, OP_DRAIN);
+}
+
+/**
+ * Links a timeout to *sqe*, which must be the last SQE queued; if it expires
+ * first, the operation is cancelled and completes with -ECANCELED.
+ */
+static void link_timeout(int slot, struct io_uring_sqe *sqe,
+        const struct __kernel_timespec *timeout)
+{
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = ring_get_sqe(&g_ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) timeout;
+    sqe->len = 1;
+    sqe->user_data = make_user_data(slot, OP_TIMEOUT);
+    g_conns[slot].pending++;
+}
+
+static void conn_close(int slot);
+
+/**
+ * Reads into the free space of a connection's registered buffer, linked to a
+ * timeout that cancels the read once the connection has been idle too long
+ * or has taken too long to send a request it started.
+ */
+static void submit_read(int slot)
+{
+    struct uconn *conn = &g_conns[slot];
+    const struct __kernel_timespec *timeout = NULL;
+
+    if(g_config.idle_timeout > 0)
+    {
+        timeout = &g_idle_timeout;
+    }
+
+    /* Part of a request (or of a body being skipped) has arrived */
+    if(g_config.read_timeout > 0
+            && (conn_buf_pending(&conn->cb) > 0 || conn->cb.discard > 0))
+    {
+        int64_t now = timewheel_now_ms();
+
+        if(conn->read_deadline_ms == 0)
+        {
+            conn->read_deadline_ms = now + g_config.read_timeout * 1000;
+        }
+
+        int64_t left = conn->read_deadline_ms - now;
+
+        if(left <= 0)
+        {
+            LOGP("Read timeout\n");
+            conn_close(slot);
+            return;
+        }
+
+        conn->read_timeout.tv_sec = left / 1000;
+        conn->read_timeout.tv_nsec = left % 1000 * 1000000;
+        timeout = &conn->read_timeout;
+    }
+
+    char *space;
+    size_t len = conn_buf_reserve(&conn->cb, &space);
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) space;
+    sqe->len = len;
+    sqe->buf_index = slot;
+    sqe->user_data = make_user_data(slot, OP_READ);
+    conn->pending++;
+
+    if(timeout != NULL)
+    {
+        link_timeout(slot, sqe, timeout);
+    }
+}
+
+static void submit_splice(int slot, int fd_in, int64_t off_in, int fd_out,
+        size_t len, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->off = (uint64_t) -1;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = off_in;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->user_data = make_user_data(slot, op);
+    g_conns[slot].pending++;
+
+    /* Only the socket side can be stalled by the client */
+    if(op == OP_SPLICE_OUT && g_config.write_timeout > 0)
+    {
+        link_timeout(slot, sqe, &g_write_timeout);
+    }
+}
+
+/**
+ * Marks a connection for teardown. Outstanding operations are forced to
+ * complete by shutting the socket down; the slot is freed once the last of
+ * them has been reaped.
+ */
+static void conn_close(int slot)
+{
+    struct uconn *conn = &g_conns[slot];
+
+    if(conn->closing == false)
+    {
+        conn->closing = true;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    if(conn->pending > 0)
+    {
+        return;
+    }
+
+    if(conn->sending)
+    {
+        release_response(&conn->resp);
+        conn->sending = false;
+    }
+
+    /* Data left in the pipe would leak into the next connection */
+    if(conn->in_pipe > 0)
+    {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+        conn->pipe[0] = -1;
+        conn->pipe[1] = -1;
+        conn->in_pipe = 0;
+    }
+
+    close(conn->fd);
+    conn->in_use = false;
+    stats_connection_closed();
+}
+
+static void process_pipeline(int slot);
+
+/**
+ * Submits the next step of sending the current response: a sendmsg for a
+ * run of memory segments, or a splice into or out of the pipe for a file
+ * segment, fetching the next chunk of a streamed body when the segments run
+ * out. Once everything is sent, moves on to the next request.
+ */
+static void advance_send(int slot)
+{
+    struct uconn *conn = &g_conns[slot];
+    struct response *resp = &conn->resp;
+
+    while(conn->seg < resp->num_segments
+            && conn->seg_done == resp->segments[conn->seg].len
+            && conn->in_pipe == 0)
+    {
+        conn->seg++;
+        conn->seg_done = 0;
+    }
+
+    if(conn->seg == resp->num_segments)
+    {
+        int more = response_next_chunk(resp);
+
+        if(more == 1)
+        {
+            conn->seg = 0;
+            conn->seg_done = 0;
+        }
+
+        else if(more == -1)
+        {
+            LOGP("Streamed response failed\n");
+            conn_close(slot);
+            return;
+        }
+    }
+
+    if(conn->seg == resp->num_segments)
+    {
+        bool keep_alive = resp->keep_alive;
+
+        complete_response(resp, &conn->peer);
+        release_response(resp);
+        conn->sending = false;
+
+        if(keep_alive)
+        {
+            process_pipeline(slot);
+        }
+
+        else
+        {
+            conn_close(slot);
+        }
+
+        return;
+    }
+
+    struct segment *seg = &resp->segments[conn->seg];
+
+    if(seg->type == SEGMENT_FILE)
+    {
+        if(conn->pipe[0] == -1 && pipe2(conn->pipe, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            conn_close(slot);
+            return;
+        }
+
+        if(conn->in_pipe > 0)
+        {
+            submit_splice(slot, conn->pipe[0], -1, conn->fd, conn->in_pipe,
+                    OP_SPLICE_OUT);
+            return;
+        }
+
+        size_t len = seg->len - conn->seg_done;
+
+        if(len > SPLICE_CHUNK)
+        {
+            len = SPLICE_CHUNK;
+        }
+
+        submit_splice(slot, seg->fd, seg->offset + conn->seg_done,
+                conn->pipe[1], len, OP_SPLICE_IN);
+        return;
+    }
+
+    int iovcnt = 0;
+
+    for(int i = conn->seg; i < resp->num_segments
+            && resp->segments[i].type == SEGMENT_MEM; i++)
+    {
+        size_t skip = i == conn->seg ? conn->seg_done : 0;
+
+        conn->iov[iovcnt].iov_base = (char *) resp->segments[i].data + skip;
+        conn->iov[iovcnt].iov_len = resp->segments[i].len - skip;
+        iovcnt++;
+    }
+
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = iovcnt;
+
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) &conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(slot, OP_SEND);
+    conn->pending++;
+
+    if(g_config.write_timeout > 0)
+    {
+        link_timeout(slot, sqe, &g_write_timeout);
+    }
+}
+
+/**
+ * Accounts for *sent* bytes of memory segments, starting at the current one.
+ */
+static void consume_sent(struct uconn *conn, size_t sent)
+{
+    struct response *resp = &conn->resp;
+
+    while(sent > 0 && conn->seg < resp->num_segments)
+    {
+        size_t left = resp->segments[conn->seg].len - conn->seg_done;
+
+        if(sent < left)
+        {
+            conn->seg_done += sent;
+            return;
+        }
+
+        sent -= left;
+        conn->seg++;
+        conn->seg_done = 0;
+    }
+}
+
+/**
+ * Answers every complete request already buffered on a connection, one at a
+ * time and in order, then reads more input.
+ */
+static void process_pipeline(int slot)
+{
+    struct uconn *conn = &g_conns[slot];
+    char *headers;
+
+    if(conn->closing)
+    {
+        conn_close(slot);
+        return;
+    }
+
+    size_t len = conn_buf_take_headers(&conn->cb, &headers);
+
+    if(len > 0)
+    {
+        conn->served++;
+        conn->read_deadline_ms = 0;
+
+        bool last = g_draining || (g_config.max_requests > 0
+            && conn->served >= g_config.max_requests);
+
+        process_request(headers, len, last, &conn->resp);
+        conn_buf_discard(&conn->cb, conn->resp.discard);
+
+        /* Chunks are sent whole; Nagle would only delay the short ones */
+        if(conn->resp.stream != NULL)
+        {
+            int one = 1;
+
+            setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+
+        conn->sending = true;
+        conn->seg = 0;
+        conn->seg_done = 0;
+        advance_send(slot);
+        return;
+    }
+
+    char *space;
+
+    if(conn_buf_reserve(&conn->cb, &space) == 0)
+    {
+        LOGP("Request headers too large\n");
+        conn_close(slot);
+        return;
+    }
+
+    /* Between requests; the new server takes the client's next connection */
+    if(g_draining && conn->served > 0 && conn_buf_pending(&conn->cb) == 0
+            && conn->cb.discard == 0 && conn_buf_unread(&conn->cb) == false)
+    {
+        conn_close(slot);
+        return;
+    }
+
+    submit_read(slot);
+}
+
+static void handle_accept(struct io_uring_cqe *cqe)
+{
+    if((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        if(cqe->res == -EINVAL && g_multishot)
+        {
+            LOGP("io_uring: multishot accept unsupported, using single shot\n");
+            g_multishot = false;
+        }
+
+        if(g_draining == false)
+        {
+            submit_accept();
+        }
+    }
+
+    if(cqe->res < 0)
+    {
+        return;
+    }
+
+    int client_fd = cqe->res;
+    int slot = -1;
+
+    for(int i = 0; i < g_num_conns; i++)
+    {
+        if(g_conns[i].in_use == false)
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if(slot == -1)
+    {
+        LOGP("io_uring: connection limit reached\n");
+        close(client_fd);
+        return;
+    }
+
+    struct uconn *conn = &g_conns[slot];
+
+    conn->in_use = true;
+    conn->fd = client_fd;
+    conn->served = 0;
+    conn->read_deadline_ms = 0;
+    conn->pending = 0;
+    conn->closing = false;
+    conn->sending = false;
+    conn_buf_init(&conn->cb, client_fd, conn->cb.data);
+    stats_connection_opened();
+
+    /* Multishot accept does not report the peer; ask once per connection */
+    if(access_log_enabled())
+    {
+        socklen_t peer_len = sizeof(conn->peer);
+
+        getpeername(client_fd, (struct sockaddr *) &conn->peer, &peer_len);
+    }
+
+    /* A splice into the socket blocks in a kernel worker, where the linked
+     * timeout cannot interrupt it; the socket's own send timeout can */
+    if(g_config.write_timeout > 0)
+    {
+        struct timeval tv = { .tv_sec = g_config.write_timeout };
+
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    submit_read(slot);
+}
+
+/**
+ * Stops accepting, and closes the connections that are waiting for their
+ * next request; the others are closed after their current response.
+ * Connections accepted but not yet sent anything, and those whose next
+ * request has already reached the socket, still get that request answered.
+ */
+static void start_drain(void)
+{
+    struct io_uring_sqe *sqe = ring_get_sqe(&g_ring);
+
+    g_draining = true;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = make_user_data(ACCEPT_SLOT, OP_ACCEPT);
+    sqe->user_data = make_user_data(ACCEPT_SLOT, OP_CANCEL);
+
+    for(int i = 0; i < g_num_conns; i++)
+    {
+        struct uconn *conn = &g_conns[i];
+
+        if(conn->in_use && conn->closing == false && conn->sending == false
+                && conn->served > 0 && conn_buf_pending(&conn->cb) == 0
+                && conn->cb.discard == 0 && conn_buf_unread(&conn->cb) == false)
+        {
+            conn_close(i);
+        }
+    }
+
+    LOGP("io_uring: draining\n");
+}
+
+static bool conns_in_use(void)
+{
+    for(int i = 0; i < g_num_conns; i++)
+    {
+        if(g_conns[i].in_use)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void handle_completion(struct io_uring_cqe *cqe)
+{
+    unsigned slot = cqe->user_data >> 8;
+    enum uring_op op = cqe->user_data & 0xff;
+
+    if(op == OP_ACCEPT)
+    {
+        handle_accept(cqe);
+        return;
+    }
+
+    if(op == OP_DRAIN)
+    {
+        start_drain();
+        return;
+    }
+
+    if(op == OP_CANCEL)
+    {
+        return;
+    }
+
+    struct uconn *conn = &g_conns[slot];
+
+    conn->pending--;
+
+    if(conn->closing)
+    {
+        conn_close(slot);
+        return;
+    }
+
+    switch(op)
+    {
+        case OP_TIMEOUT:
+            /* -ETIME means the idle limit hit; the read is cancelled too */
+            break;
+
+        case OP_READ:
+            if(cqe->res <= 0)
+            {
+                conn_close(slot);
+                break;
+            }
+
+            conn_buf_commit(&conn->cb, cqe->res);
+            process_pipeline(slot);
+            break;
+
+        case OP_SEND:
+            if(cqe->res < 0)
+            {
+                conn_close(slot);
+                break;
+            }
+
+            consume_sent(conn, cqe->res);
+            advance_send(slot);
+            break;
+
+        case OP_SPLICE_IN:
+            if(cqe->res <= 0)
+            {
+                /* The file shrank underneath us */
+                conn_close(slot);
+                break;
+            }
+
+            conn->in_pipe += cqe->res;
+            conn->seg_done += cqe->res;
+            advance_send(slot);
+            break;
+
+        case OP_SPLICE_OUT:
+            if(cqe->res <= 0)
+            {
+                conn_close(slot);
+                break;
+            }
+
+            conn->in_pipe -= cqe->res;
+            advance_send(slot);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Serves connections from *listen_fd* with io_uring. Returns if the ring
+ * cannot be set up, in which case the caller should fall back to the plain
+ * system call path, or once a newer server has taken over and the last
+ * connection is closed.
+ *
+ * Returns:
+ *  - 0 after draining
+ *  - -1 if io_uring is unavailable
+ */
+int uring_serve(int listen_fd)
+{
+    if(ring_init(&g_ring, RING_ENTRIES) == -1)
+    {
+        return -1;
+    }
+
+    g_num_conns = g_config.uring_connections;
+    g_conns = calloc(g_num_conns, sizeof(struct uconn));
+
+    if(g_conns == NULL)
+    {
+        perror("calloc");
+        close(g_ring.fd);
+        return -1;
+    }
+
+    /* The kernel pins registered buffers, so the slots' input buffers stay
+     * put in one array for the life of the loop */
+    struct iovec *bufs = calloc(g_num_conns, sizeof(struct iovec));
+
+    g_bufs = malloc((size_t) g_num_conns * CONN_BUF_SIZE);
+
+    if(bufs == NULL || g_bufs == NULL)
+    {
+        perror("malloc");
+        free(bufs);
+        free(g_bufs);
+        free(g_conns);
+        close(g_ring.fd);
+        return -1;
+    }
+
+    for(int i = 0; i < g_num_conns; i++)
+    {
+        g_conns[i].pipe[0] = -1;
+        g_conns[i].pipe[1] = -1;
+        conn_buf_init(&g_conns[i].cb, -1, g_bufs + (size_t) i * CONN_BUF_SIZE);
+        bufs[i].iov_base = g_conns[i].cb.data;
+        bufs[i].iov_len = CONN_BUF_SIZE;
+    }
+
+    if(sys_io_uring_register(g_ring.fd, IORING_REGISTER_BUFFERS, bufs,
+                g_num_conns) == -1)
+    {
+        perror("io_uring_register");
+        free(bufs);
+        free(g_bufs);
+        free(g_conns);
+        close(g_ring.fd);
+        return -1;
+    }
+
+    free(bufs);
+
+    g_listen_fd = listen_fd;
+    g_idle_timeout.tv_sec = g_config.idle_timeout;
+    g_idle_timeout.tv_nsec = 0;
+    g_write_timeout.tv_sec = g_config.write_timeout;
+    g_write_timeout.tv_nsec = 0;
+
+    /* Splicing to a closed socket must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    LOG("io_uring backend ready (%d connection slots)\n", g_num_conns);
+
+    submit_accept();
+
+    if(upgrade_drain_fd() != -1)
+    {
+        submit_drain_poll();
+    }
+
+    while(g_draining == false || conns_in_use())
+    {
+        int ret = sys_io_uring_enter(g_ring.fd, g_ring.to_submit, 1,
+                IORING_ENTER_GETEVENTS);
+
+        if(ret == -1)
+        {
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                perror("io_uring_enter");
+                exit(1);
+            }
+        }
+
+        else
+        {
+            g_ring.to_submit -= ret;
+        }
+
+        unsigned head = *g_ring.cq_head;
+        unsigned tail = __atomic_load_n(g_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        while(head != tail)
+        {
+            struct io_uring_cqe *cqe = &g_ring.cqes[head & *g_ring.cq_mask];
+
+            handle_completion(cqe);
+            head++;
+        }
+
+        __atomic_store_n(g_ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    for(int i = 0; i < g_num_conns; i++)
+    {
+        if(g_conns[i].pipe[0] != -1)
+        {
+            close(g_conns[i].pipe[0]);
+            close(g_conns[i].pipe[1]);
+        }
+    }
+
+    /* Unregisters the buffers before they are freed */
+    close(g_ring.fd);
+    free(g_conns);
+    g_conns = NULL;
+    free(g_bufs);
+    g_bufs = NULL;
+
+    return 0;
+}
@@ -0,0 +1,15 @@
+/**
+ * @file
+ *
+ * io_uring I/O backend. Accepts connections with a multishot accept, reads
+ * request headers into registered buffers, sends headers with sendmsg and
+ * moves file bodies to the socket with splice() through a per-connection
+ * pipe, all submitted and completed through one ring.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+int uring_serve(int listen_fd);
+
+#endif
@@ -0,0 +1,648 @@
+/**
+ * @file
+ *
+ * Per-core worker threads with SO_REUSEPORT listeners. See worker.h.
+ *
+ * Each worker runs an epoll loop. Connections are non-blocking: input is
+ * read into the connection buffer until a complete header block is
+ * available, and a response that cannot be written in one go is resumed
+ * when the socket becomes writable again. Workers share nothing but the
+ * process-wide caches; each has its own open-file cache.
+ *
+ * Every connection has a single deadline on its worker's timing wheel,
+ * re-armed as it moves between states: waiting for a request (idle timeout),
+ * in the middle of receiving one (read timeout, counted from its first byte
+ * so a client trickling it in cannot extend it), and stuck sending a
+ * response (write timeout, restarted whenever the client takes more data).
+ *
+ * When a newer server takes over the listening sockets, workers drain: they
+ * stop accepting, close connections that are between requests, answer the
+ * requests already under way with "Connection: close", and exit once they
+ * have no connections left.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "logger.h"
+#include "stats.h"
+#include "timewheel.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "worker.h"
+#include "www.h"
+
+/** Events handled per epoll_wait() call */
+#define MAX_EVENTS 256
+
+/**
+ * What a connection's deadline is currently guarding.
+ */
+enum deadline {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,
+    DEADLINE_READ,
+    DEADLINE_WRITE,
+};
+
+/**
+ * A connection owned by a worker.
+ */
+struct econn {
+    /** Input buffer (also holds the socket) */
+    struct conn_buf cb;
+
+    /** Client address, for the access log */
+    struct sockaddr_storage peer;
+
+    /** Requests served so far */
+    int served;
+
+    /** True while *resp* holds a response being sent */
+    bool sending;
+    struct response resp;
+
+    /** Progress through resp */
+    struct response_writer writer;
+
+    /** Whether EPOLLOUT is currently requested */
+    bool want_write;
+
+    /** Which deadline *timer* is armed for */
+    enum deadline deadline;
+    struct timer timer;
+
+    /** Neighbours in the worker's connection list */
+    struct econn *prev;
+    struct econn *next;
+};
+
+/**
+ * Per-thread state.
+ */
+struct worker {
+    int id;
+    int port;
+    pthread_t thread;
+    int listen_fd;
+    int epoll_fd;
+
+    /** Connections owned by this worker, closed when it stops */
+    struct econn *conns;
+
+    /** Deadlines of the connections owned by this worker */
+    struct timewheel wheel;
+
+    /** Time the current batch of events is being handled at */
+    int64_t now_ms;
+
+    /** Set once a newer server has taken over the listening socket */
+    bool draining;
+
+    /** Set if the worker could not start */
+    bool failed;
+};
+
+/** Becomes readable once the workers have been asked to stop */
+static int g_stop_fd = -1;
+
+static struct econn *timer_conn(struct timer *t)
+{
+    return (struct econn *) ((char *) t - offsetof(struct econn, timer));
+}
+
+static void conn_close(struct worker *w, struct econn *conn)
+{
+    stats_connection_closed();
+
+    if(conn->sending)
+    {
+        release_response(&conn->resp);
+    }
+
+    timewheel_cancel(&w->wheel, &conn->timer);
+    close(conn->cb.fd);
+    conn_buf_free(&conn->cb);
+
+    if(conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+
+    else
+    {
+        w->conns = conn->next;
+    }
+
+    if(conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    free(conn);
+}
+
+/**
+ * Switches a connection's deadline. The idle and read deadlines run from
+ * when the connection entered that state, so setting the same one again
+ * keeps it; the write deadline is pushed back on every call, which callers
+ * make whenever the client has taken more of the response.
+ */
+static void set_deadline(struct worker *w, struct econn *conn,
+        enum deadline deadline)
+{
+    if(conn->deadline == deadline && deadline != DEADLINE_WRITE)
+    {
+        return;
+    }
+
+    int seconds = 0;
+
+    switch(deadline)
+    {
+        case DEADLINE_IDLE:
+            seconds = g_config.idle_timeout;
+            break;
+        case DEADLINE_READ:
+            seconds = g_config.read_timeout;
+            break;
+        case DEADLINE_WRITE:
+            seconds = g_config.write_timeout;
+            break;
+        default:
+            break;
+    }
+
+    conn->deadline = deadline;
+
+    if(seconds > 0)
+    {
+        timewheel_arm(&w->wheel, &conn->timer, w->now_ms + seconds * 1000);
+    }
+
+    else
+    {
+        timewheel_cancel(&w->wheel, &conn->timer);
+    }
+}
+
+static void want_write(struct worker *w, struct econn *conn, bool on)
+{
+    if(conn->want_write == on)
+    {
+        return;
+    }
+
+    struct epoll_event ev = {
+        .events = on ? EPOLLOUT : EPOLLIN,
+        .data.ptr = conn,
+    };
+
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, conn->cb.fd, &ev);
+    conn->want_write = on;
+}
+
+/**
+ * Makes as much progress on a connection as possible without blocking:
+ * finishes the response in flight, then answers buffered (pipelined)
+ * requests in order, then reads more input.
+ */
+static void conn_run(struct worker *w, struct econn *conn)
+{
+    while(true)
+    {
+        if(conn->sending)
+        {
+            int ret = response_write(conn->cb.fd, &conn->resp,
+                    &conn->writer);
+
+            if(ret == -1)
+            {
+                conn_close(w, conn);
+                return;
+            }
+
+            if(ret == 0)
+            {
+                want_write(w, conn, true);
+                set_deadline(w, conn, DEADLINE_WRITE);
+                return;
+            }
+
+            bool keep_alive = conn->resp.keep_alive;
+
+            complete_response(&conn->resp, &conn->peer);
+            release_response(&conn->resp);
+            conn->sending = false;
+
+            if(keep_alive == false)
+            {
+                conn_close(w, conn);
+                return;
+            }
+        }
+
+        char *headers;
+
+        size_t len = conn_buf_take_headers(&conn->cb, &headers);
+
+        if(len > 0)
+        {
+            conn->deadline = DEADLINE_NONE;
+            conn->served++;
+
+            bool last = w->draining || (g_config.max_requests > 0
+                && conn->served >= g_config.max_requests);
+
+            process_request(headers, len, last, &conn->resp);
+            conn_buf_discard(&conn->cb, conn->resp.discard);
+            conn->sending = true;
+            writer_init(&conn->writer);
+            continue;
+        }
+
+        want_write(w, conn, false);
+
+        ssize_t read_size = conn_buf_fill(&conn->cb);
+
+        if(read_size == -1 && errno == EAGAIN)
+        {
+            /* Part of a request (or of a body being skipped) has arrived */
+            bool reading = conn_buf_pending(&conn->cb) > 0
+                || conn->cb.discard > 0;
+
+            if(reading == false && w->draining && conn->served > 0)
+            {
+                conn_close(w, conn);
+                return;
+            }
+
+            /* Waiting for the next request needs no input buffer */
+            if(reading == false)
+            {
+                conn_buf_trim(&conn->cb);
+            }
+
+            set_deadline(w, conn, reading ? DEADLINE_READ : DEADLINE_IDLE);
+            return;
+        }
+
+        if(read_size <= 0)
+        {
+            /* EOF, error, or headers too large for the buffer */
+            conn_close(w, conn);
+            return;
+        }
+    }
+}
+
+static void accept_all(struct worker *w)
+{
+    while(true)
+    {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int client_fd = accept4(w->listen_fd, (struct sockaddr *) &peer,
+                &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(client_fd == -1)
+        {
+            if(errno != EAGAIN && errno != EINTR)
+            {
+                perror("accept4");
+            }
+
+            return;
+        }
+
+        struct econn *conn = calloc(1, sizeof(struct econn));
+
+        if(conn == NULL)
+        {
+            close(client_fd);
+            continue;
+        }
+
+        conn_buf_init(&conn->cb, client_fd, NULL);
+        conn->peer = peer;
+        timer_init(&conn->timer);
+        stats_connection_opened();
+        conn->next = w->conns;
+
+        if(w->conns != NULL)
+        {
+            w->conns->prev = conn;
+        }
+
+        w->conns = conn;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+
+        /* The request is usually already there; try it right away */
+        conn_run(w, conn);
+    }
+}
+
+/**
+ * Closes connections whose deadline has passed.
+ */
+static void expire_deadlines(struct worker *w)
+{
+    struct timer *t;
+
+    while((t = timewheel_expired(&w->wheel, w->now_ms)) != NULL)
+    {
+        struct econn *conn = timer_conn(t);
+
+        LOG("Closing connection %d: %s timeout\n", conn->cb.fd,
+                conn->deadline == DEADLINE_IDLE ? "idle"
+                : conn->deadline == DEADLINE_READ ? "read" : "write");
+        conn_close(w, conn);
+    }
+}
+
+/**
+ * Stops accepting and closes the connections that are waiting for their next
+ * request; the others are closed after their current response. Connections
+ * accepted but not yet sent anything, and those whose next request has
+ * already reached the socket, still get that request answered. Called
+ * between batches of events, as it frees connections a batch may refer to.
+ */
+static void start_drain(struct worker *w)
+{
+    struct econn *next;
+
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->listen_fd, NULL);
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, upgrade_drain_fd(), NULL);
+
+    for(struct econn *conn = w->conns; conn != NULL; conn = next)
+    {
+        next = conn->next;
+
+        if(conn->sending == false && conn->served > 0
+                && conn_buf_pending(&conn->cb) == 0 && conn->cb.discard == 0
+                && conn_buf_unread(&conn->cb) == false)
+        {
+            conn_close(w, conn);
+        }
+    }
+
+    LOG("Worker %d draining\n", w->id);
+}
+
+static void pin_to_cpu(int id)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    if(cpus < 1)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(id % cpus, &set);
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        LOG("Worker %d: could not pin to CPU %ld\n", id, id % cpus);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    pin_to_cpu(w->id);
+
+    g_fcache = fcache_create(g_config.cache_entries, g_config.cache_ttl,
+            g_config.root_fd);
+
+    /* Its listener stays in the SO_REUSEPORT group and would keep being
+     * handed connections, so one worker failing stops them all */
+    if(g_fcache == NULL)
+    {
+        perror("fcache_create");
+        w->failed = true;
+        workers_stop();
+        return NULL;
+    }
+
+    if(g_config.use_uring)
+    {
+        /* Returns once drained, or at once if io_uring is unavailable */
+        if(uring_serve(w->listen_fd) == 0)
+        {
+            fcache_destroy(g_fcache);
+            g_fcache = NULL;
+            return NULL;
+        }
+    }
+
+    /* accept_all() drains the queue until accept4() would block */
+    fcntl(w->listen_fd, F_SETFL, fcntl(w->listen_fd, F_GETFL) | O_NONBLOCK);
+
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+
+    /* Level-triggered, so every worker sees the stop request */
+    ev.data.ptr = &g_stop_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, g_stop_fd, &ev);
+
+    if(upgrade_drain_fd() != -1)
+    {
+        ev.data.ptr = &w->draining;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, upgrade_drain_fd(), &ev);
+    }
+
+    LOG("Worker %d listening on port %d\n", w->id, w->port);
+
+    w->now_ms = timewheel_now_ms();
+    timewheel_init(&w->wheel, w->now_ms);
+
+    bool stopping = false;
+
+    while(stopping == false && (w->draining == false || w->conns != NULL))
+    {
+        int timeout = timewheel_timeout(&w->wheel, w->now_ms);
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+
+        bool drain = false;
+
+        w->now_ms = timewheel_now_ms();
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &g_stop_fd)
+            {
+                stopping = true;
+            }
+
+            /* Requests answered from here on close their connection */
+            else if(events[i].data.ptr == &w->draining)
+            {
+                w->draining = true;
+                drain = true;
+            }
+
+            else if(events[i].data.ptr == NULL)
+            {
+                accept_all(w);
+            }
+
+            else
+            {
+                conn_run(w, events[i].data.ptr);
+            }
+        }
+
+        if(drain)
+        {
+            start_drain(w);
+        }
+
+        expire_deadlines(w);
+    }
+
+    LOG("Worker %d stopping\n", w->id);
+
+    while(w->conns != NULL)
+    {
+        conn_close(w, w->conns);
+    }
+
+    close(w->epoll_fd);
+    fcache_destroy(g_fcache);
+    g_fcache = NULL;
+
+    return NULL;
+}
+
+/**
+ * Starts *count* workers, each with its own listening socket on *port*, and
+ * waits for them until workers_stop() is called. Listening sockets are all
+ * created up front so that a bind failure is reported before any worker
+ * starts serving.
+ *
+ * Returns:
+ *  - 0 once the workers have stopped
+ *  - -1 if the workers could not be started
+ */
+int workers_run(int port, int count)
+{
+    struct worker *workers = calloc(count, sizeof(struct worker));
+
+    if(workers == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    g_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if(g_stop_fd == -1)
+    {
+        perror("eventfd");
+        free(workers);
+        return -1;
+    }
+
+    /* Writing to a closed socket must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    int created = 0;
+    int started = 0;
+    int ret = 0;
+
+    for(; created < count; created++)
+    {
+        workers[created].id = created;
+        workers[created].port = port;
+        workers[created].listen_fd = create_listener(port, true);
+
+        if(workers[created].listen_fd == -1)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    for(; ret == 0 && started < count; started++)
+    {
+        if(pthread_create(&workers[started].thread, NULL, worker_main,
+                    &workers[started]) != 0)
+        {
+            perror("pthread_create");
+            workers_stop();
+            ret = -1;
+            break;
+        }
+    }
+
+    if(ret == 0)
+    {
+        upgrade_start();
+    }
+
+    for(int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+
+        if(workers[i].failed)
+        {
+            ret = -1;
+        }
+    }
+
+    for(int i = 0; i < created; i++)
+    {
+        close(workers[i].listen_fd);
+    }
+
+    close(g_stop_fd);
+    g_stop_fd = -1;
+    free(workers);
+
+    return ret;
+}
+
+/**
+ * Asks the workers started by workers_run() to stop: each closes its
+ * connections and exits its loop, and workers_run() then returns. Safe to
+ * call from any thread or from a signal handler.
+ */
+void workers_stop(void)
+{
+    uint64_t one = 1;
+
+    if(g_stop_fd != -1)
+    {
+        /* Can only fail if the counter would overflow, i.e. when a stop
+         * request is already pending */
+        ssize_t ret = write(g_stop_fd, &one, sizeof(one));
+
+        (void) ret;
+    }
+}
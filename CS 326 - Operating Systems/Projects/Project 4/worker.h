@@ -0,0 +1,16 @@
+/**
+ * @file
+ *
+ * Multi-acceptor mode. Starts one worker thread per requested core; each
+ * worker owns its own SO_REUSEPORT listening socket (so the kernel spreads
+ * incoming connections across them), is pinned to a CPU, and runs its own
+ * event loop over non-blocking connections.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+int workers_run(int port, int count);
+void workers_stop(void);
+
+#endif
@@ -1,48 +1,131 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <netinet/in.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h> 
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "autoindex.h"
+#include "conn.h"
+#include "fcache.h"
+#include "fmap.h"
+#include "httpdate.h"
+#include "httpparse.h"
 #include "logger.h"
+#include "mime.h"
+#include "scache.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "worker.h"
+#include "www.h"
+
+/** Default number of seconds an idle keep-alive connection is kept open */
+#define DEFAULT_IDLE_TIMEOUT 5
+
+/** Default seconds allowed for the rest of a request to arrive */
+#define DEFAULT_READ_TIMEOUT 10
+
+/** Default seconds a response may be stalled by a client not reading it */
+#define DEFAULT_WRITE_TIMEOUT 30
+
+/** Default number of requests served on one connection before closing it */
+#define DEFAULT_MAX_REQUESTS 100
+
+/** Default number of open files kept in the file cache */
+#define DEFAULT_CACHE_ENTRIES 256
+
+/** Default seconds before cached file metadata is checked again */
+#define DEFAULT_CACHE_TTL 2
+
+/** Default size limit for files kept in the shared response cache */
+#define DEFAULT_SMALL_FILE_MAX (16 * 1024)
 
-#define MAX_STR_LEN 8192
+/** Default memory budget of the shared response cache */
+#define DEFAULT_SMALL_CACHE_BYTES (16 * 1024 * 1024)
+
+/** Default limit on the bytes of files mapped for the mmap serving mode */
+#define DEFAULT_MMAP_BYTES (1024UL * 1024 * 1024)
+
+/** Default connection limit of the io_uring event loop */
+#define DEFAULT_URING_CONNECTIONS 256
+
+/** Default accept queue length of the listening sockets */
+#define DEFAULT_BACKLOG SOMAXCONN
+
+struct www_config g_config = {
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .read_timeout = DEFAULT_READ_TIMEOUT,
+    .write_timeout = DEFAULT_WRITE_TIMEOUT,
+    .max_requests = DEFAULT_MAX_REQUESTS,
+    .cache_entries = DEFAULT_CACHE_ENTRIES,
+    .cache_ttl = DEFAULT_CACHE_TTL,
+    .small_file_max = DEFAULT_SMALL_FILE_MAX,
+    .small_cache_bytes = DEFAULT_SMALL_CACHE_BYTES,
+    .mmap_file_max = 0,
+    .mmap_bytes = DEFAULT_MMAP_BYTES,
+    .use_uring = false,
+    .uring_connections = DEFAULT_URING_CONNECTIONS,
+    .workers = 0,
+    .backlog = DEFAULT_BACKLOG,
+    .access_log = NULL,
+    .stats = false,
+    .root_fd = AT_FDCWD,
+    .prewarm = false,
+    .autoindex = AUTOINDEX_OFF,
+    .upgrade_path = NULL,
+};
+
+/** Open files and their metadata; each worker thread has its own */
+__thread struct fcache *g_fcache = NULL;
+
+struct scache *g_scache = NULL; /*!< Shared small-file responses */
 
 /**
- * Generates an HTTP 1.1 compliant timestamp for use in HTTP responses.
+ * Generates an HTTP 1.1 compliant timestamp for use in HTTP responses. The
+ * string comes from the shared date cache, which reformats it at most once
+ * per second.
  *
  * Inputs:
  *  - timestamp: character pointer to a string buffer to be filled with the
  *    timestamp.
+ *  - length: capacity of the timestamp buffer (at least HTTP_DATE_SIZE)
  */
-void generate_timestamp(char *timestamp)
+void generate_timestamp(char *timestamp, size_t length)
 {
-    time_t now = time(0);
-    struct tm time = *gmtime(&now);
-    strftime(timestamp, sizeof(timestamp), "%a, %d %b %Y %H:%M:%S %Z", &time);
+    http_date(timestamp, length);
 }
 
 char *next_char(char **str_ptr, const char *delim)
 {
-    size_t token_start = strspn(*str_ptr, delim);
-    size_t token_end = strcspn(*str_ptr + token_start, delim);
-    
     if(*str_ptr == NULL)
     {
         return NULL;
     }
 
+    size_t token_start = strspn(*str_ptr, delim);
+    size_t token_end = strcspn(*str_ptr + token_start, delim);
+
     if (token_end <= 0)
     {
         *str_ptr = NULL;
@@ -53,14 +136,14 @@ char *next_char(char **str_ptr, const char *delim)
 
     *str_ptr += token_start + token_end;
 
-    if (**str_ptr == "\0")
+    if (**str_ptr == '\0')
     {
         *str_ptr = NULL;
     }
     
     else
     {
-        **str_ptr = "\0";
+        **str_ptr = '\0';
         (*str_ptr)++;
     }
 
@@ -68,270 +151,1573 @@ char *next_char(char **str_ptr, const char *delim)
 }
 
 /**
- * Reads from a file descriptor until:
- *  - the newline ('\n') character is encountered
- *  - *length* is exceeded
- *  This is helpful for reading HTTP headers line by line.
+ * Formats the connection-management headers for a response.
  *
  * Inputs:
- *  - fd: file descriptor to read from
- *  - buf: buffer to store data read from *fd*
- *  - length: maximum capacity of the buffer
+ *  - buf: buffer to receive the header lines
+ *  - length: capacity of the buffer
+ *  - keep_alive: whether the connection stays open after this response
+ */
+void connection_headers(char *buf, size_t length, bool keep_alive)
+{
+    if(keep_alive == false)
+    {
+        snprintf(buf, length, "Connection: close\r\n");
+        return;
+    }
+
+    snprintf(buf, length,
+        "Connection: keep-alive\r\n"
+        "Keep-Alive: timeout=%d\r\n",
+        g_config.idle_timeout);
+}
+
+/**
+ * Builds a short error response whose body is the status code.
  *
- * Returns:
- *  - Number of bytes read;
- *  - -1 on read failure
- *  - 0 on EOF
+ * Inputs:
+ *  - resp: response to fill in
+ *  - status: status line without the protocol, e.g. "404 Not Found"
+ *  - keep_alive: whether the connection stays open after this response
  */
-ssize_t read_line(int fd, char *buf, size_t length)
+void error_response(struct response *resp, const char *status, bool keep_alive)
+{
+    char timestamp[HTTP_DATE_SIZE];
+    char connection[128];
+    char error[4];
+
+    snprintf(error, sizeof(error), "%s", status);
+    resp->status = atoi(status);
+    generate_timestamp(timestamp, sizeof(timestamp));
+    connection_headers(connection, sizeof(connection), keep_alive);
+
+    int len = snprintf(resp->head, RESPONSE_HEAD_LEN, "HTTP/1.1 %s\r\n"
+        "Date: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "\r\n"
+        "%s",
+        status, timestamp, strlen(error), connection, error);
+
+    resp->keep_alive = keep_alive;
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->num_segments = 1;
+}
+
+void file_not_found(struct response *resp, bool keep_alive)
 {
-    ssize_t sum = 0;
+    error_response(resp, "404 Not Found", keep_alive);
+}
 
-    while(sum < length)
+/**
+ * Returns true if a path has a ".." segment, i.e. could name something
+ * outside the document root.
+ */
+static bool leaves_root(const char *path)
+{
+    while(*path != '\0')
     {
-        size_t read_size = read(fd, buf + sum, 1);
+        const char *end = strchrnul(path, '/');
 
-        if(*(buf + sum) == "\n")
+        if(end - path == 2 && path[0] == '.' && path[1] == '.')
         {
-            break;
+            return true;
+        }
+
+        path = *end == '/' ? end + 1 : end;
+    }
+
+    return false;
+}
+
+static int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+/**
+ * Decodes the %XX escapes of a path in place.
+ *
+ * Returns:
+ *  - false if an escape is malformed, or encodes a NUL or a '/', which
+ *    would let the decoded path mean something the target did not
+ */
+static bool decode_path(char *path)
+{
+    char *out = path;
+
+    for(const char *in = path; *in != '\0'; in++)
+    {
+        if(*in != '%')
+        {
+            *out++ = *in;
+            continue;
         }
 
-        if (read_size == -1)
+        int high = hex_value(in[1]);
+        int low = high == -1 ? -1 : hex_value(in[2]);
+
+        if(low == -1 || (high == 0 && low == 0) || (high == 2 && low == 15))
         {
-            perror("read");
-            
-            return -1;
+            return false;
         }
-        
-        else if (read_size == 0)
+
+        *out++ = high * 16 + low;
+        in += 2;
+    }
+
+    *out = '\0';
+
+    return true;
+}
+
+/**
+ * Parses a Content-Length value: one decimal number and nothing else.
+ *
+ * Returns:
+ *  - false if the value is empty, has anything but digits, or overflows
+ */
+static bool parse_content_length(const char *value, size_t *length)
+{
+    size_t n = 0;
+
+    if(*value == '\0')
+    {
+        return false;
+    }
+
+    for(; *value != '\0'; value++)
+    {
+        if(*value < '0' || *value > '9'
+                || n > (SIZE_MAX - (*value - '0')) / 10)
         {
-            return 0;
+            return false;
         }
 
-        sum += read_size;
+        n = n * 10 + (*value - '0');
     }
 
-    return sum;
+    *length = n;
+
+    return true;
 }
 
-int file_not_found(int client_fd)
+/**
+ * NUL-terminates a slice in place and returns it as a string. The byte after
+ * a slice from http_parse_request() is always a delimiter inside the header
+ * block (whitespace, '\r' or '\n'), so overwriting it loses nothing.
+ */
+static char *slice_str(struct http_slice slice)
 {
-    char buf[MAX_STR_LEN] = {0};
-    char timestamp[128];
-    char *error = "404";
+    slice.data[slice.len] = '\0';
 
-    generate_timestamp(timestamp, 128);
+    return slice.data;
+}
 
-    sprintf(buf, "HTTP/1.1 404 Not Found\r\n"
-        "Date: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "\r\n"
-        "%s",
-        timestamp, strlen(error), error);
+/**
+ * Parses a header block into a request without copying: the path and header
+ * values are terminated in place and referenced from *req*.
+ *
+ * Inputs:
+ *  - headers: header block from conn_buf_read_headers() (modified)
+ *  - len: length of the block
+ *  - req: request to fill in
+ *
+ * Returns:
+ *  - 0 on success
+ *  - -1 if the request line is malformed, its (decoded) path leaves the
+ *    document root, or its Content-Length is invalid or repeated (the end
+ *    of its body, and so the start of the next request, is unknown)
+ */
+int parse_request(char *headers, size_t len, struct request *req)
+{
+    struct http_request_head *head = &req->head;
+    bool connection_close = false;
+    bool connection_keep_alive = false;
+    bool has_content_length = false;
 
-    int ret = write(client_fd, buf, strlen(buf));
+    /* Set field by field; clearing *head* as well would cost more than the
+     * parse */
+    req->query = "";
+    req->is_get = false;
+    req->keep_alive = false;
+    req->content_length = 0;
+    req->chunked = false;
+    req->range = "";
+    req->if_range = "";
+    req->if_none_match = "";
+    req->if_modified_since = "";
+    req->accept_encoding = "";
 
-    if(ret == -1)
+    if(http_parse_request(headers, len, head) == -1
+            || head->target.len >= MAX_STR_LEN - 1
+            || head->method.len >= REQUEST_METHOD_LEN)
     {
         return -1;
     }
-    
-    return 0;
-}
 
-int handle_request(int fd)
-{
-    LOGP("Handling Request\n");
-   
-    char path[MAX_STR_LEN] = {0};
-    
-    while(true)
+    /* Methods are case-sensitive, unlike header names */
+    memcpy(req->method, head->method.data, head->method.len);
+    req->method[head->method.len] = '\0';
+    req->is_get = strcmp(req->method, "GET") == 0;
+
+    /* HTTP/0.9-style requests without a version are treated as 1.0 */
+    req->minor_version = head->minor_version < 0 ? 0 : head->minor_version;
+
+    /* The byte before the target is the space after the method; it becomes
+     * the '.' that makes the path relative to the document root. */
+    head->target.data[-1] = '.';
+    req->path = slice_str(head->target) - 1;
+
+    char *query = memchr(req->path, '?', head->target.len + 1);
+
+    if(query != NULL)
+    {
+        *query = '\0';
+        req->query = query + 1;
+    }
+
+    /* Everything after this works on the decoded path, so that is what
+     * has to stay inside the document root */
+    if(decode_path(req->path) == false || leaves_root(req->path))
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < head->num_headers; i++)
     {
-        char header_str[MAX_STR_LEN] = {0};
- 
-        ssize_t read_size = read_line(client_fd, header_str, MAX_STR_LEN);
-        
-        if (read_size == 0 || read_size == -1)
+        struct http_slice name = head->headers[i].name;
+        char *value = slice_str(head->headers[i].value);
+
+        if(http_slice_equals(name, "Connection"))
         {
-            return read_size;
+            /* The value is a comma-separated list of tokens */
+            char *token;
+
+            while((token = next_char(&value, ", \t")) != NULL)
+            {
+                if(strcasecmp(token, "close") == 0)
+                {
+                    connection_close = true;
+                }
+
+                else if(strcasecmp(token, "keep-alive") == 0)
+                {
+                    connection_keep_alive = true;
+                }
+            }
         }
- 
-        LOG("-> %s", header_str);
 
-        char *next_tok = header_str;
-        
-        char *curr_tok = next_char(&next_tok, " \t\r\n");
- 
-        if(strcmp(curr_tok, "GET") == 0 && curr_tok != NULL)
+        else if(http_slice_equals(name, "Content-Length"))
         {
-            curr_tok = next_char(&next_tok, " \t\r\n");
-            path[0] = '.';
+            if(has_content_length
+                    || parse_content_length(value, &req->content_length)
+                        == false)
+            {
+                return -1;
+            }
 
-            strcpy(&path[1], curr_tok);
+            has_content_length = true;
+        }
 
-            LOG("URI: %s\n", curr_tok);
+        else if(http_slice_equals(name, "Transfer-Encoding"))
+        {
+            req->chunked = true;
         }
-        
-        else if (curr_tok == NULL)
+
+        else if(http_slice_equals(name, "Range"))
         {
-            break;
+            req->range = value;
         }
-    }
- 
-    LOG("File path: %s\n", path);
- 
-    struct stat stat_buf;
 
-    int ret = stat(path, &stat_buf);
+        else if(http_slice_equals(name, "If-Range"))
+        {
+            req->if_range = value;
+        }
 
-    if(ret == -1)
-    {
-        perror("stat");
-        file_not_found(client_fd);
-        return 0;
-    }
- 
-    if(S_ISDIR(stat_buf.st_mode) == true)
-    {
-        strcat(path, "/index.html");
-        ret = stat(path, &stat_buf);
-        
-        if (ret == -1)
+        else if(http_slice_equals(name, "If-None-Match"))
         {
-            perror("stat");
+            req->if_none_match = value;
+        }
 
-            file_not_found(client_fd);
+        else if(http_slice_equals(name, "If-Modified-Since"))
+        {
+            req->if_modified_since = value;
+        }
 
-            return 0;
+        else if(http_slice_equals(name, "Accept-Encoding"))
+        {
+            req->accept_encoding = value;
         }
     }
- 
-    char message[MAX_STR_LEN] = {0};
-    char date[128] = {0};
 
-    generate_timestamp(date, 128);
-    
-    sprintf(message,
-        "HTTP/1.1 200 OK\r\n"
-        "Date: %s\r\n"
-        "Content-Length: %zu\r\n"
-        "\r\n",
-        date, stat_buf.st_size);
-   
-    LOG("Sending response:\n%s", message);
+    /* HTTP/1.1 connections persist unless closed; 1.0 ones must opt in */
+    if(req->minor_version >= 1)
+    {
+        req->keep_alive = connection_close == false;
+    }
 
-    write(client_fd, message, strlen(message));
-   
-    int file_fd = open(path, O_RDONLY);
-    
-    sendfile(client_fd, file_fd, 0, stat_buf.st_size);
+    else
+    {
+        req->keep_alive = connection_keep_alive && connection_close == false;
+    }
 
     return 0;
 }
 
-int main(int argc, char *argv[]){
+/**
+ * A satisfiable byte range of a file, inclusive on both ends.
+ */
+struct byte_range {
+    off_t first;
+    off_t last;
+};
+
+/**
+ * Parses a Range header value ("bytes=0-99,200-,-50") against a file size.
+ * Unsatisfiable ranges are dropped.
+ *
+ * Inputs:
+ *  - spec: header value
+ *  - size: size of the file
+ *  - ranges: receives the satisfiable ranges
+ *  - max: capacity of *ranges*
+ *
+ * Returns:
+ *  - Number of satisfiable ranges (0 means 416 Range Not Satisfiable)
+ *  - -1 if the header should be ignored (malformed, a unit other than bytes,
+ *    or more ranges than we are willing to serve)
+ */
+int parse_ranges(const char *spec, off_t size, struct byte_range *ranges,
+        int max)
+{
+    int count = 0;
 
-    if (argc != 3) {
-        printf("Usage: %s port dir\n", argv[0]);
-        return 1;
+    if(strncasecmp(spec, "bytes=", 6) != 0)
+    {
+        return -1;
     }
 
-    int port = atoi(argv[1]);
-    char *dir = argv[2];
+    spec += 6;
 
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    
-    if(socket_fd == -1)
+    while(*spec != '\0')
     {
-        perror("socket");
+        char *end;
+        off_t first;
+        off_t last;
+
+        spec += strspn(spec, " \t");
+
+        if(*spec == '-')
+        {
+            /* Suffix range: the last N bytes */
+            long long suffix = strtoll(spec + 1, &end, 10);
+
+            if(end == spec + 1 || suffix < 0)
+            {
+                return -1;
+            }
+
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+
+            if(suffix == 0)
+            {
+                first = size;
+            }
+        }
+
+        else
+        {
+            long long value = strtoll(spec, &end, 10);
+
+            if(end == spec || *end != '-' || value < 0)
+            {
+                return -1;
+            }
+
+            first = value;
+            spec = end + 1;
+
+            if(*spec >= '0' && *spec <= '9')
+            {
+                value = strtoll(spec, &end, 10);
 
-        return 1;
+                if(value < first)
+                {
+                    return -1;
+                }
+
+                last = value >= size ? size - 1 : value;
+            }
+
+            else
+            {
+                end = (char *) spec;
+                last = size - 1;
+            }
+        }
+
+        spec = end + strspn(end, " \t");
+
+        if(*spec == ',')
+        {
+            spec++;
+        }
+
+        else if(*spec != '\0')
+        {
+            return -1;
+        }
+
+        if(first >= size)
+        {
+            continue;
+        }
+
+        if(count == max)
+        {
+            return -1;
+        }
+
+        ranges[count].first = first;
+        ranges[count].last = last;
+        count++;
     }
- 
-    struct sockaddr_in addr = {0};
 
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+    return count;
+}
 
-    if(bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+/**
+ * Checks an If-Range precondition: the Range header only applies if the
+ * client's copy is still current. An entity tag must match strongly; a date
+ * must match the file's modification time exactly.
+ *
+ * Returns:
+ *  - true if there is no If-Range header or it matches
+ */
+bool if_range_matches(const struct request *req,
+        const struct fcache_entry *file)
+{
+    time_t when;
+
+    if(req->if_range[0] == '\0')
     {
-        perror("bind");
-        return 1;
+        return true;
     }
- 
-    if(listen(socket_fd, 10) == -1)
+
+    if(req->if_range[0] == '"')
     {
-        perror("listen");
-        return 1;
+        return strcmp(req->if_range, file->etag) == 0;
     }
- 
-    LOG("Listening on port %d\n", port);
- 
-    LOG("changing directory to %s\n", dir);
 
-    int ret = chdir(dir);
+    return http_date_parse(req->if_range, &when) && when == file->mtime;
+}
+
+/**
+ * Checks whether an If-None-Match list ("*" or comma-separated entity tags)
+ * contains a tag. Comparison is weak, so a W/ prefix is ignored.
+ */
+bool etag_list_matches(const char *list, const char *etag)
+{
+    size_t etag_len = strlen(etag);
 
-    if(ret == -1)
+    while(*list != '\0')
     {
-        perror("chdir");
-        return 1;
-    }
- 
-    while(true)
-    {
-        struct sockaddr_in client_addr = {0};
-        socklen_t slen = sizeof(client_addr);
- 
-        int client_fd = accept(
-            socket_fd,
-            (struct sockaddr *) &client_addr,
-            &slen);
- 
-        if(client_fd == -1)
-        {
-            perror("accept");
-            return 1;
-        }
- 
-        pid_t pid = fork();
- 
-        if(pid == 0)
-        {
-            close(socket_fd);
-
-            char remote_host[INET_ADDRSTRLEN];
-
-            inet_ntop(
-                client_addr.sin_family,
-                (void *) &((&client_addr)->sin_addr),
-                remote_host,
-                sizeof(remote_host));
-
-            LOG("Accepted connection from %s:%d\n", remote_host, client_addr.sin_port);
- 
-            while(true)
-            {
-                int ret = handle_request(client_fd);
+        list += strspn(list, " \t,");
 
-                if(ret == -1 || ret == 0)
-                {
-                    break;
-                }
-            }
+        if(*list == '*')
+        {
+            return true;
         }
-        
-        else if (pid < 0)
+
+        if(strncmp(list, "W/", 2) == 0)
         {
-            perror("fork");
-            exit(1);
+            list += 2;
         }
-        
-        else
+
+        size_t len = strcspn(list, " \t,");
+
+        if(len == etag_len && strncmp(list, etag, len) == 0)
         {
-            close(client_fd);
+            return true;
         }
+
+        list += len;
     }
-    
-    return 0; 
+
+    return false;
+}
+
+/**
+ * Evaluates If-None-Match and If-Modified-Since. If-Modified-Since is only
+ * considered when there is no If-None-Match, as RFC 7232 requires.
+ *
+ * Returns:
+ *  - true if the client's copy is current and 304 Not Modified should be sent
+ */
+bool not_modified(const struct request *req, const struct fcache_entry *file)
+{
+    time_t since;
+
+    if(req->if_none_match[0] != '\0')
+    {
+        return etag_list_matches(req->if_none_match, file->etag);
+    }
+
+    if(req->if_modified_since[0] != '\0'
+            && http_date_parse(req->if_modified_since, &since))
+    {
+        return file->mtime <= since;
+    }
+
+    return false;
+}
+
+/**
+ * Returns the segment for a slice of a file: memory in its shared mapping if
+ * it has one, so that it goes out with writev() together with the headers,
+ * else a file segment for sendfile().
+ *
+ * If the file is truncated while mapped, the kernel fails the write with
+ * EFAULT rather than raising SIGBUS, as the copy happens in the system call.
+ */
+struct segment file_segment(const struct fcache_entry *file,
+        off_t offset, size_t len)
+{
+    if(file->map != NULL)
+    {
+        return (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = file->map->addr + offset,
+            .len = len,
+        };
+    }
+
+    return (struct segment) {
+        .type = SEGMENT_FILE,
+        .fd = file->fd,
+        .offset = offset,
+        .len = len,
+    };
+}
+
+/**
+ * Builds a 206 Partial Content response for one range, a
+ * multipart/byteranges response for several, or 416 if none is satisfiable.
+ * The file body is sent straight from the file with offsets.
+ *
+ * Inputs:
+ *  - file: file being served (the response holds the reference)
+ *  - ranges: satisfiable ranges
+ *  - count: number of ranges
+ *  - date: Date header value
+ *  - connection: connection-management header lines
+ *  - resp: response to fill in
+ */
+void range_response(struct fcache_entry *file, struct byte_range *ranges,
+        int count, const char *date, const char *connection,
+        struct response *resp)
+{
+    size_t used = 0;
+
+    resp->status = count == 0 ? 416 : 206;
+
+    if(count == 0)
+    {
+        int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+            "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Date: %s\r\n"
+            "Content-Range: bytes */%jd\r\n"
+            "Content-Length: 0\r\n"
+            "%s"
+            "\r\n",
+            date, (intmax_t) file->size, connection);
+
+        resp->segments[0] = (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = resp->head,
+            .len = len,
+        };
+        resp->num_segments = 1;
+
+        return;
+    }
+
+    if(count == 1)
+    {
+        off_t len = ranges[0].last - ranges[0].first + 1;
+
+        used = snprintf(resp->head, RESPONSE_HEAD_LEN,
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Date: %s\r\n"
+            "Content-Type: %s\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "Content-Range: bytes %jd-%jd/%jd\r\n"
+            "Content-Length: %jd\r\n"
+            "%s"
+            "\r\n",
+            date, file->content_type, file->etag, file->last_modified,
+            (intmax_t) ranges[0].first, (intmax_t) ranges[0].last,
+            (intmax_t) file->size, (intmax_t) len, connection);
+
+        resp->segments[0] = (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = resp->head,
+            .len = used,
+        };
+        resp->segments[1] = file_segment(file, ranges[0].first, len);
+        resp->num_segments = 2;
+
+        return;
+    }
+
+    /* Part headers are written after the main header (which needs the total
+     * length, so it is formatted last into the space reserved for it). */
+    char boundary[64];
+    size_t reserved = 512;
+    size_t body_len = 0;
+    int seg = 1;
+
+    snprintf(boundary, sizeof(boundary), "www-%jx-%jx",
+        (uintmax_t) file->ino, (uintmax_t) file->mtime);
+
+    used = reserved;
+
+    for(int i = 0; i < count; i++)
+    {
+        off_t len = ranges[i].last - ranges[i].first + 1;
+        int part = snprintf(resp->head + used, RESPONSE_HEAD_LEN - used,
+            "\r\n--%s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Range: bytes %jd-%jd/%jd\r\n"
+            "\r\n",
+            boundary, file->content_type, (intmax_t) ranges[i].first,
+            (intmax_t) ranges[i].last, (intmax_t) file->size);
+
+        resp->segments[seg++] = (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = resp->head + used,
+            .len = part,
+        };
+        resp->segments[seg++] = file_segment(file, ranges[i].first, len);
+
+        used += part;
+        body_len += part + len;
+    }
+
+    int tail = snprintf(resp->head + used, RESPONSE_HEAD_LEN - used,
+        "\r\n--%s--\r\n", boundary);
+
+    resp->segments[seg++] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head + used,
+        .len = tail,
+    };
+    body_len += tail;
+
+    int len = snprintf(resp->head, reserved,
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Date: %s\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "Content-Type: multipart/byteranges; boundary=%s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "\r\n",
+        date, file->etag, file->last_modified, boundary, body_len, connection);
+
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->num_segments = seg;
+}
+
+/**
+ * A content coding that may be served from a precompressed sidecar file
+ * (path + suffix), in order of preference.
+ */
+struct encoding {
+    const char *name;
+    const char *suffix;
+    unsigned bit;
+};
+
+static const struct encoding g_encodings[] = {
+    { "br", ".br", 1 << 0 },
+    { "gzip", ".gz", 1 << 1 },
+};
+
+#define NUM_ENCODINGS (sizeof(g_encodings) / sizeof(g_encodings[0]))
+
+/**
+ * Looks for precompressed variants of a file. A sidecar is only used if it is
+ * a regular file that is smaller than the original and not older than it, so
+ * a stale .gz left behind after an edit is ignored.
+ *
+ * Returns:
+ *  - Bit mask of the g_encodings entries that are available
+ */
+unsigned find_sidecars(const struct fcache_entry *file)
+{
+    unsigned found = 0;
+
+    for(size_t i = 0; i < NUM_ENCODINGS; i++)
+    {
+        char variant[PATH_MAX];
+        struct stat st;
+
+        /* Longer paths could not be looked up anyway */
+        if(snprintf(variant, sizeof(variant), "%s%s", file->path,
+                    g_encodings[i].suffix) >= (int) sizeof(variant))
+        {
+            continue;
+        }
+
+        if(fstatat(g_config.root_fd, variant, &st, 0) == 0
+                && S_ISREG(st.st_mode)
+                && st.st_size < file->size && st.st_mtime >= file->mtime)
+        {
+            found |= g_encodings[i].bit;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Checks whether an Accept-Encoding value allows a content coding, either by
+ * name or through "*", with a non-zero quality.
+ */
+bool accepts_encoding(const char *list, const char *name)
+{
+    size_t name_len = strlen(name);
+
+    while(*list != '\0')
+    {
+        list += strspn(list, " \t,");
+
+        size_t len = strcspn(list, " \t,;");
+        bool match = (len == name_len && strncasecmp(list, name, len) == 0)
+            || (len == 1 && *list == '*');
+
+        list += len;
+        list += strspn(list, " \t");
+
+        double q = 1.0;
+
+        if(*list == ';')
+        {
+            const char *param = list + 1 + strspn(list + 1, " \t");
+
+            if(strncasecmp(param, "q=", 2) == 0)
+            {
+                q = strtod(param + 2, NULL);
+            }
+        }
+
+        if(match)
+        {
+            return q > 0;
+        }
+
+        list += strcspn(list, ",");
+    }
+
+    return false;
+}
+
+/**
+ * Picks the precompressed variant to send, if any. Range requests always get
+ * the identity representation, whose byte offsets the client knows.
+ */
+const struct encoding *choose_encoding(const struct request *req,
+        const struct fcache_entry *file)
+{
+    if(file->encodings == 0 || req->accept_encoding[0] == '\0'
+            || req->range[0] != '\0')
+    {
+        return NULL;
+    }
+
+    for(size_t i = 0; i < NUM_ENCODINGS; i++)
+    {
+        if((file->encodings & g_encodings[i].bit)
+                && accepts_encoding(req->accept_encoding, g_encodings[i].name))
+        {
+            return &g_encodings[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Formats the validators and the file-dependent header lines of a cache
+ * entry. Files with precompressed variants, and the variants themselves, are
+ * marked as varying by Accept-Encoding.
+ *
+ * Inputs:
+ *  - file: entry to fill in
+ *  - encoding: content coding of the entry if it is a sidecar, else NULL
+ */
+void fill_file_header(struct fcache_entry *file,
+        const struct encoding *encoding)
+{
+    char coding[64] = {0};
+    size_t name_len = strlen(file->path);
+
+    /* A sidecar has the type of the file it was compressed from */
+    if(encoding != NULL)
+    {
+        name_len -= strlen(encoding->suffix);
+    }
+
+    file->content_type = mime_type(file->path, name_len);
+
+    snprintf(file->etag, FCACHE_VALIDATOR_LEN, "\"%jx-%jx-%jx\"",
+        (uintmax_t) file->ino, (uintmax_t) file->size,
+        (uintmax_t) file->mtime);
+    http_date_format(file->mtime, file->last_modified, FCACHE_VALIDATOR_LEN);
+
+    if(encoding != NULL)
+    {
+        snprintf(coding, sizeof(coding),
+            "Content-Encoding: %s\r\n"
+            "Vary: Accept-Encoding\r\n", encoding->name);
+    }
+
+    else if(file->encodings != 0)
+    {
+        snprintf(coding, sizeof(coding), "Vary: Accept-Encoding\r\n");
+    }
+
+    file->header_len = snprintf(file->header, FCACHE_HEADER_LEN,
+        "HTTP/1.1 200 OK\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "Content-Type: %s\r\n"
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n"
+        "%s"
+        "Content-Length: %jd\r\n",
+        file->content_type, file->etag, file->last_modified, coding,
+        (intmax_t) file->size);
+}
+
+/**
+ * Looks a file up in the worker's open-file cache, formatting its header
+ * lines the first time it is served.
+ *
+ * Inputs:
+ *  - path: path relative to the document root, prefixed with "./"
+ *
+ * Returns:
+ *  - A reference to the entry, to be dropped with fcache_release()
+ *  - NULL if the file cannot be opened (errno is set)
+ */
+struct fcache_entry *lookup_file(const char *path)
+{
+    uint64_t lookup_start = 0;
+    unsigned long hits = g_fcache->hits;
+
+    if(g_config.root_fd == -1)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* Paths handed in by embedding code have not been through
+     * parse_request() */
+    if(leaves_root(path))
+    {
+        errno = EACCES;
+        return NULL;
+    }
+
+    if(stats_enabled())
+    {
+        lookup_start = stats_now();
+    }
+
+    struct fcache_entry *file = fcache_lookup(g_fcache, path);
+
+    if(stats_enabled())
+    {
+        stats_time(STATS_LOOKUP, stats_now() - lookup_start);
+        stats_file_lookup(g_fcache->hits != hits);
+    }
+
+    if(file != NULL && file->header_len == 0)
+    {
+        file->encodings = find_sidecars(file);
+        fill_file_header(file, NULL);
+    }
+
+    return file;
+}
+
+static void release_listing(void *page)
+{
+    autoindex_release(page);
+}
+
+/**
+ * Builds the response for a directory that has no index.html: its listing,
+ * if listings are on, or else a 404.
+ *
+ * Returns:
+ *  - false if the path is not a directory that can be listed
+ */
+static bool listing_response(struct request *req, bool keep_alive,
+        struct response *resp)
+{
+    if(g_config.autoindex == AUTOINDEX_OFF)
+    {
+        return false;
+    }
+
+    struct autoindex_page *page = autoindex_acquire(g_config.root_fd,
+            req->path, g_config.autoindex);
+
+    if(page == NULL)
+    {
+        return false;
+    }
+
+    char date[HTTP_DATE_SIZE] = {0};
+    char modified[HTTP_DATE_SIZE] = {0};
+    char connection[128] = {0};
+
+    generate_timestamp(date, sizeof(date));
+    http_date_format(page->mtime.tv_sec, modified, sizeof(modified));
+    connection_headers(connection, sizeof(connection), keep_alive);
+
+    int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+        "HTTP/1.1 200 OK\r\n"
+        "Date: %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Last-Modified: %s\r\n"
+        "Cache-Control: no-cache\r\n"
+        "%s"
+        "\r\n",
+        date,
+        page->format == AUTOINDEX_JSON ? "application/json"
+            : "text/html; charset=utf-8",
+        page->len, modified, connection);
+
+    resp->status = 200;
+    resp->keep_alive = keep_alive;
+    resp->release = release_listing;
+    resp->release_arg = page;
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->segments[1] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = page->body,
+        .len = page->len,
+    };
+    resp->num_segments = 2;
+
+    return true;
+}
+
+/**
+ * Builds the response for a file, preferring the shared response cache for
+ * small files.
+ *
+ * Inputs:
+ *  - req: parsed request
+ *  - keep_alive: whether the connection stays open after this response
+ *  - resp: response to fill in
+ */
+void file_response(struct request *req, bool keep_alive, struct response *resp)
+{
+    char *path = req->path;
+
+    struct fcache_entry *file = lookup_file(path);
+
+    if(file == NULL)
+    {
+        if(listing_response(req, keep_alive, resp))
+        {
+            return;
+        }
+
+        file_not_found(resp, keep_alive);
+        return;
+    }
+
+    const struct encoding *encoding = choose_encoding(req, file);
+
+    if(encoding != NULL)
+    {
+        size_t variant_len = strlen(file->path) + strlen(encoding->suffix) + 3;
+        char *variant = arena_alloc(&resp->arena, variant_len);
+        struct fcache_entry *sidecar = NULL;
+
+        /* The extra "./" gives the variant a cache key of its own, so a
+         * direct request for the .gz file does not share its headers */
+        if(variant != NULL)
+        {
+            snprintf(variant, variant_len, "./%s%s", file->path,
+                encoding->suffix);
+            sidecar = fcache_lookup(g_fcache, variant);
+        }
+
+        if(sidecar != NULL)
+        {
+            if(sidecar->header_len == 0)
+            {
+                fill_file_header(sidecar, encoding);
+            }
+
+            fcache_release(g_fcache, file);
+            file = sidecar;
+        }
+    }
+
+    char date[HTTP_DATE_SIZE] = {0};
+    char connection[128] = {0};
+
+    generate_timestamp(date, sizeof(date));
+    connection_headers(connection, sizeof(connection), keep_alive);
+    resp->keep_alive = keep_alive;
+
+    if(not_modified(req, file))
+    {
+        int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+            "HTTP/1.1 304 Not Modified\r\n"
+            "Date: %s\r\n"
+            "ETag: %s\r\n"
+            "Last-Modified: %s\r\n"
+            "%s"
+            "\r\n",
+            date, file->etag, file->last_modified, connection);
+
+        fcache_release(g_fcache, file);
+
+        resp->status = 304;
+        resp->segments[0] = (struct segment) {
+            .type = SEGMENT_MEM,
+            .data = resp->head,
+            .len = len,
+        };
+        resp->num_segments = 1;
+
+        return;
+    }
+
+    /* Only files the response cache does not take are worth mapping */
+    if(g_config.mmap_file_max > 0 && file->map_tried == false
+            && file->size <= (off_t) g_config.mmap_file_max
+            && (g_scache == NULL
+                || file->size > (off_t) scache_max_file_size(g_scache)))
+    {
+        file->map = fmap_acquire(file->fd, file->dev, file->ino, file->size,
+                file->mtime);
+        file->map_tried = true;
+    }
+
+    if(req->range[0] != '\0' && if_range_matches(req, file))
+    {
+        struct byte_range ranges[RESPONSE_MAX_RANGES];
+        int count = parse_ranges(req->range, file->size, ranges,
+                RESPONSE_MAX_RANGES);
+
+        if(count >= 0)
+        {
+            resp->file = file;
+            range_response(file, ranges, count, date, connection, resp);
+            return;
+        }
+    }
+
+    resp->status = 200;
+
+    if(g_scache != NULL && file->size <= scache_max_file_size(g_scache))
+    {
+        struct scache_key key = {
+            .path = file->path,
+            .dev = file->dev,
+            .ino = file->ino,
+            .size = file->size,
+            .mtime = file->mtime,
+        };
+        struct scache_ref *ref = &resp->cached;
+
+        if(scache_get(g_scache, &key, ref)
+                || scache_put(g_scache, &key, file->header, file->header_len,
+                    file->fd, ref))
+        {
+            fcache_release(g_fcache, file);
+            resp->has_cached = true;
+
+            int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+                "Date: %s\r\n"
+                "%s"
+                "\r\n",
+                date, connection);
+
+            resp->segments[0] = (struct segment) {
+                .type = SEGMENT_MEM,
+                .data = ref->header,
+                .len = ref->header_len,
+            };
+            resp->segments[1] = (struct segment) {
+                .type = SEGMENT_MEM,
+                .data = resp->head,
+                .len = len,
+            };
+            resp->segments[2] = (struct segment) {
+                .type = SEGMENT_MEM,
+                .data = ref->body,
+                .len = ref->body_len,
+            };
+            resp->num_segments = 3;
+
+            return;
+        }
+    }
+
+    int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+        "%s"
+        "Date: %s\r\n"
+        "%s"
+        "\r\n",
+        file->header, date, connection);
+
+    resp->file = file;
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->segments[1] = file_segment(file, 0, file->size);
+    resp->num_segments = 2;
+}
+
+/**
+ * Serves the metrics report.
+ */
+void stats_page(bool keep_alive, struct response *resp)
+{
+    char date[HTTP_DATE_SIZE] = {0};
+    char connection[128] = {0};
+    size_t body_len;
+
+    resp->owned = stats_report(g_scache, &body_len);
+
+    if(resp->owned == NULL)
+    {
+        error_response(resp, "500 Internal Server Error", false);
+        return;
+    }
+
+    generate_timestamp(date, sizeof(date));
+    connection_headers(connection, sizeof(connection), keep_alive);
+
+    int len = snprintf(resp->head, RESPONSE_HEAD_LEN,
+        "HTTP/1.1 200 OK\r\n"
+        "Date: %s\r\n"
+        "Content-Type: text/plain\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "\r\n",
+        date, body_len, connection);
+
+    resp->status = 200;
+    resp->keep_alive = keep_alive;
+    resp->segments[0] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->head,
+        .len = len,
+    };
+    resp->segments[1] = (struct segment) {
+        .type = SEGMENT_MEM,
+        .data = resp->owned,
+        .len = body_len,
+    };
+    resp->num_segments = 2;
+}
+
+/**
+ * Builds the response for a header block; see process_request().
+ */
+void build_response(char *headers, size_t len, bool last,
+        struct response *resp)
+{
+    struct request req;
+    uint64_t parse_start = 0;
+
+    if(stats_enabled())
+    {
+        parse_start = stats_now();
+    }
+
+    if(parse_request(headers, len, &req) == -1)
+    {
+        error_response(resp, "400 Bad Request", false);
+        return;
+    }
+
+    if(stats_enabled())
+    {
+        stats_time(STATS_PARSE, stats_now() - parse_start);
+    }
+
+    if(access_log_enabled())
+    {
+        snprintf(resp->log.path, ACCESS_LOG_PATH_LEN, "%s", req.path + 1);
+    }
+
+    /* A body in a transfer coding cannot be skipped without decoding it;
+     * the connection has to go with it */
+    if(req.chunked)
+    {
+        error_response(resp, "501 Not Implemented", false);
+        return;
+    }
+
+    /* Requests with a body are not supported, but its bytes must not be
+     * mistaken for the next pipelined request. */
+    resp->discard = req.content_length;
+
+    bool keep_alive = req.keep_alive && last == false;
+
+    if(route_request(&req, keep_alive, resp))
+    {
+        return;
+    }
+
+    if(req.is_get == false)
+    {
+        error_response(resp, "501 Not Implemented", keep_alive);
+        return;
+    }
+
+    if(g_config.stats && strcmp(req.path, "./__stats") == 0)
+    {
+        stats_page(keep_alive, resp);
+        return;
+    }
+
+    file_response(&req, keep_alive, resp);
+}
+
+/**
+ * Turns a complete header block into a response. This is the part of request
+ * handling that does not depend on how the connection is driven.
+ *
+ * Inputs:
+ *  - headers: header block (modified while parsing)
+ *  - len: length of the block
+ *  - last: true if this is the last request allowed on the connection
+ *  - resp: response to fill in; must be passed to release_response()
+ */
+void process_request(char *headers, size_t len, bool last,
+        struct response *resp)
+{
+    resp->arena = (struct arena) {0};
+    resp->head = arena_alloc(&resp->arena, RESPONSE_HEAD_LEN);
+    resp->num_segments = 0;
+    resp->discard = 0;
+    resp->file = NULL;
+    resp->has_cached = false;
+    resp->owned = NULL;
+    resp->release = NULL;
+    resp->stream = NULL;
+    resp->chunked = false;
+    resp->chunk = NULL;
+    resp->streamed = 0;
+
+    if(access_log_enabled())
+    {
+        access_log_begin(&resp->log, "-");
+    }
+
+    /* Out of memory: send nothing and close the connection */
+    if(resp->head == NULL)
+    {
+        resp->status = 500;
+        resp->keep_alive = false;
+        return;
+    }
+
+    build_response(headers, len, last, resp);
+
+    if(stats_enabled())
+    {
+        resp->ready_ns = stats_now();
+    }
+}
+
+/**
+ * Accounts for a response that has been sent in full: queues its access log
+ * record and updates the metrics. Call before release_response().
+ *
+ * Inputs:
+ *  - resp: the response
+ *  - peer: client address
+ */
+void complete_response(struct response *resp,
+        const struct sockaddr_storage *peer)
+{
+    if(access_log_enabled())
+    {
+        access_log_commit(&resp->log, peer, resp->status,
+            response_length(resp));
+    }
+
+    if(stats_enabled())
+    {
+        stats_time(STATS_SEND, stats_now() - resp->ready_ns);
+        stats_response(resp->status, response_length(resp));
+    }
+}
+
+/**
+ * Drops the cache references and buffers backing a response's body, leaving
+ * its arena (and so its head) in place.
+ */
+void release_body(struct response *resp)
+{
+    if(resp->file != NULL)
+    {
+        fcache_release(g_fcache, resp->file);
+        resp->file = NULL;
+    }
+
+    if(resp->has_cached)
+    {
+        scache_release(g_scache, &resp->cached);
+        resp->has_cached = false;
+    }
+
+    free(resp->owned);
+    resp->owned = NULL;
+
+    if(resp->release != NULL)
+    {
+        resp->release(resp->release_arg);
+        resp->release = NULL;
+    }
+}
+
+/**
+ * Drops the cache references and memory held by a response once it has been
+ * sent.
+ */
+void release_response(struct response *resp)
+{
+    release_body(resp);
+
+    resp->chunk = NULL;
+    resp->head = NULL;
+    arena_reset(&resp->arena);
+}
+
+/**
+ * Returns the total number of bytes in a response.
+ */
+size_t response_length(const struct response *resp)
+{
+    size_t total = resp->streamed;
+
+    for(int i = 0; i < resp->num_segments; i++)
+    {
+        total += resp->segments[i].len;
+    }
+
+    return total;
+}
+
+/**
+ * Reads one request from the connection buffer and sends the response. The
+ * request's header block is taken from the buffer in one piece; anything
+ * buffered after it belongs to the next (pipelined) request.
+ *
+ * Inputs:
+ *  - cb: buffered connection to read the request from
+ *  - peer: client address, for the access log
+ *  - last: true if this is the last request allowed on the connection
+ *
+ * Returns:
+ *  - 1 once a response has been sent and the connection stays open
+ *  - 0 on EOF, or once a response has been sent and the connection should
+ *    be closed
+ *  - -1 on failure
+ */
+int handle_request(struct conn_buf *cb, const struct sockaddr_storage *peer,
+        bool last)
+{
+    struct response resp;
+    char *headers;
+
+    ssize_t read_size = conn_buf_read_headers(cb, &headers);
+
+    if (read_size == 0 || read_size == -1)
+    {
+        return read_size;
+    }
+
+    struct response_writer writer;
+
+    process_request(headers, read_size, last, &resp);
+    conn_buf_discard(cb, resp.discard);
+
+    /* The socket is blocking, so this only returns once it is all sent or
+     * the send timeout has expired (reported as would-block) */
+    writer_init(&writer);
+
+    int ret = response_write(cb->fd, &resp, &writer);
+
+    if(ret != 1)
+    {
+        release_response(&resp);
+        return -1;
+    }
+
+    complete_response(&resp, peer);
+    release_response(&resp);
+
+    return resp.keep_alive;
+}
+
+/**
+ * Serves requests on an accepted connection until the client closes it, asks
+ * for it to be closed, goes idle for too long, the per-connection request
+ * limit is reached, or a newer server takes over.
+ */
+void serve_connection(int client_fd, const struct sockaddr_storage *peer)
+{
+    struct conn_buf cb;
+    int served = 0;
+
+    conn_buf_init(&cb, client_fd, NULL);
+    cb.timeout_ms = g_config.idle_timeout * 1000;
+    cb.read_timeout_ms = g_config.read_timeout * 1000;
+
+    /* A client that stops reading makes the blocked send fail with EAGAIN */
+    if(g_config.write_timeout > 0)
+    {
+        struct timeval tv = { .tv_sec = g_config.write_timeout };
+
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    stats_connection_opened();
+
+    while(true)
+    {
+        served++;
+
+        bool last = upgrade_draining() || (g_config.max_requests > 0
+            && served >= g_config.max_requests);
+
+        int ret = handle_request(&cb, peer, last);
+
+        if(ret == -1 || ret == 0)
+        {
+            break;
+        }
+
+        /* After an upgrade, stop waiting for a next request */
+        cb.wake_fd = upgrade_drain_fd();
+    }
+
+    close(client_fd);
+    conn_buf_free(&cb);
+    stats_connection_closed();
+}
+
+/**
+ * Creates a TCP socket listening on all interfaces, or takes over one that
+ * the server being upgraded from handed over for the same port.
+ *
+ * Inputs:
+ *  - port: port to listen on
+ *  - reuseport: set SO_REUSEPORT so several sockets can share the port and
+ *    the kernel balances incoming connections across them
+ *
+ * Returns:
+ *  - The listening socket, or -1 on failure
+ */
+int create_listener(int port, bool reuseport)
+{
+    int socket_fd = upgrade_take_listener(port);
+    int one = 1;
+
+    if(socket_fd != -1)
+    {
+        upgrade_add_listener(socket_fd);
+        return socket_fd;
+    }
+
+    socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(socket_fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(reuseport && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &one,
+                sizeof(one)) == -1)
+    {
+        perror("setsockopt");
+        close(socket_fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr = {0};
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if(bind(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        perror("bind");
+        close(socket_fd);
+        return -1;
+    }
+
+    if(listen(socket_fd, g_config.backlog) == -1)
+    {
+        perror("listen");
+        close(socket_fd);
+        return -1;
+    }
+
+    upgrade_add_listener(socket_fd);
+
+    return socket_fd;
 }
@@ -0,0 +1,163 @@
+/**
+ * @file
+ *
+ * Server-wide settings and the request/response types shared by the request
+ * handler and the I/O backends that drive it.
+ */
+
+#ifndef WWW_H
+#define WWW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "autoindex.h"
+#include "fcache.h"
+#include "httpparse.h"
+#include "response.h"
+#include "scache.h"
+
+#define MAX_STR_LEN 8192
+
+/** Room for the request method and its terminator */
+#define REQUEST_METHOD_LEN 16
+
+/**
+ * Server-wide settings, filled in from the command line.
+ */
+struct www_config {
+    /** Seconds to wait for the next request on a keep-alive connection */
+    int idle_timeout;
+
+    /** Seconds a client may take to send a request once it has started */
+    int read_timeout;
+
+    /** Seconds a response may go without the client accepting any of it */
+    int write_timeout;
+
+    /** Maximum number of requests served per connection (0 = unlimited) */
+    int max_requests;
+
+    /** Number of open files kept in the file cache (0 disables it) */
+    int cache_entries;
+
+    /** Seconds before cached file metadata is revalidated */
+    int cache_ttl;
+
+    /** Files up to this size are kept in the response cache (0 disables it) */
+    size_t small_file_max;
+
+    /** Bytes of shared memory for the response cache */
+    size_t small_cache_bytes;
+
+    /** Larger files up to this size are served from a shared mmap() of the
+     * file with writev() instead of sendfile() (0 disables it) */
+    size_t mmap_file_max;
+
+    /** Bytes of files that may be mapped at once */
+    size_t mmap_bytes;
+
+    /** Serve connections from an io_uring event loop instead of forking */
+    bool use_uring;
+
+    /** Maximum number of simultaneous connections in the io_uring loop */
+    int uring_connections;
+
+    /** Number of per-core worker threads (0 = fork per connection) */
+    int workers;
+
+    /** Length of each listening socket's accept queue */
+    int backlog;
+
+    /** File to write the access log to (NULL disables it) */
+    const char *access_log;
+
+    /** Serve metrics at /__stats */
+    bool stats;
+
+    /** Directory files are served from (AT_FDCWD: the working directory) */
+    int root_fd;
+
+    /** Index the document root at startup and follow changes with inotify */
+    bool prewarm;
+
+    /** Listing served for a directory without an index.html */
+    enum autoindex_format autoindex;
+
+    /** Unix socket a newer server takes the listening sockets over from
+     * (NULL disables upgrades) */
+    const char *upgrade_path;
+};
+
+extern struct www_config g_config;
+extern __thread struct fcache *g_fcache;
+extern struct scache *g_scache;
+
+/**
+ * The parts of a request that the handler cares about. The strings point into
+ * the connection's buffer, where parse_request() NUL-terminates them in place;
+ * absent headers are empty strings.
+ */
+struct request {
+    /** Requested file, percent-decoded and relative to the document root
+     * (prefixed with '.') */
+    char *path;
+
+    /** Query string that followed the path after a '?', or "" */
+    const char *query;
+
+    /** Request method, e.g. "GET" */
+    char method[REQUEST_METHOD_LEN];
+
+    /** True for GET requests; anything else is answered with an error */
+    bool is_get;
+
+    /** Minor HTTP version (HTTP/1.x), used for the keep-alive default */
+    int minor_version;
+
+    /** Whether the client wants the connection kept open */
+    bool keep_alive;
+
+    /** Size of the request body, which is skipped */
+    size_t content_length;
+
+    /** True if the request has a Transfer-Encoding; such a body is refused */
+    bool chunked;
+
+    /** Values of the Range and If-Range headers */
+    const char *range;
+    const char *if_range;
+
+    /** Values of the If-None-Match and If-Modified-Since headers */
+    const char *if_none_match;
+    const char *if_modified_since;
+
+    /** Value of the Accept-Encoding header */
+    const char *accept_encoding;
+
+    /** The parsed head, with every header field for route handlers; field
+     * values are NUL-terminated in place, names are not */
+    struct http_request_head head;
+};
+
+int create_listener(int port, bool reuseport);
+void generate_timestamp(char *timestamp, size_t length);
+void connection_headers(char *buf, size_t length, bool keep_alive);
+int parse_request(char *headers, size_t len, struct request *req);
+void process_request(char *headers, size_t len, bool last,
+        struct response *resp);
+void complete_response(struct response *resp,
+        const struct sockaddr_storage *peer);
+void release_body(struct response *resp);
+void release_response(struct response *resp);
+size_t response_length(const struct response *resp);
+void serve_connection(int client_fd, const struct sockaddr_storage *peer);
+struct fcache_entry *lookup_file(const char *path);
+struct segment file_segment(const struct fcache_entry *file,
+        off_t offset, size_t len);
+bool route_request(struct request *req, bool keep_alive,
+        struct response *resp);
+
+#endif